@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# startup.sh PROG SCRIPT RUNS MAX_US MAX_SYSCALLS
+#
+# Measure how long PROG takes to start, run the tiny SCRIPT, and
+# exit, averaged over RUNS runs, and count the system calls one
+# run makes. Fail if either is over its target. The system calls
+# are counted by strace; without it, only the time is checked.
+
+prog=$1
+script=$2
+runs=$3
+max_us=$4
+max_syscalls=$5
+
+status=0
+
+start=$(date +%s%N)
+i=0
+while [ $i -lt $runs ]; do
+    $prog $script > /dev/null 2>&1 < /dev/null
+    i=$((i + 1))
+done
+end=$(date +%s%N)
+
+us=$(((end - start) / runs / 1000))
+if [ $us -le $max_us ]; then verdict=ok; else verdict=OVER; status=1; fi
+printf '    wall time: %d us per run (target %d us) %s\n' $us $max_us $verdict
+
+if command -v strace > /dev/null 2>&1; then
+    syscalls=$(strace -f -c $prog $script 2>&1 > /dev/null < /dev/null | awk '$NF == "total" { print $4 }')
+    if [ $syscalls -le $max_syscalls ]; then verdict=ok; else verdict=OVER; status=1; fi
+    printf '    syscalls:  %d per run (target %d) %s\n' $syscalls $max_syscalls $verdict
+else
+    printf '    syscalls:  not counted, strace was not found\n'
+fi
+
+exit $status
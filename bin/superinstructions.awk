@@ -0,0 +1,110 @@
+#!/usr/bin/awk
+#
+# Choose superinstructions from opcode profiles, and write them
+# out as c/clox/inc/superinstructions.h on stdout.
+#
+# The input is the "profile" lines that a clox built with
+# DEBUG_PROFILE_OPCODES prints when it exits, from any number
+# of runs. A fused pair saves one dispatch each time it runs,
+# and a fused triple saves two.
+#
+# The N (default 8) sequences that save the most are chosen,
+# one at a time: once a pair is chosen, a triple holding it
+# saves only one more dispatch, and once a triple is chosen,
+# the pairs inside it run that much less often, and triples
+# overlapping it may have lost all their runs to it.
+
+$1 == "profile" && $2 == "dispatches" {
+    dispatches += $3;
+}
+
+$1 == "profile" && $2 == "pair" {
+    count[$3 " " $4] += $5;
+    save[$3 " " $4] += $5;
+}
+
+$1 == "profile" && $2 == "triple" {
+    count[$3 " " $4 " " $5] += $6;
+    save[$3 " " $4 " " $5] += 2 * $6;
+}
+
+function opname(seq,    ops, n, i, name) {
+    n = split(seq, ops, " ");
+    name = "OP_SUPER";
+    for (i = 1; i <= n; i++)
+        name = name "_" substr(ops[i], 4);
+    return name;
+}
+
+function choose(seq,    ops, n, s, o) {
+    chosen[seq] = 1;
+    saved += save[seq];
+    n = split(seq, ops, " ");
+    for (s in save) {
+        if (s in chosen)
+            continue;
+        split(s, o, " ");
+        if (n == 2 && (o[1] " " o[2] == seq || o[2] " " o[3] == seq))
+            save[s] -= count[s];
+        if (n == 3 && (s == ops[1] " " ops[2] || s == ops[2] " " ops[3]))
+            save[s] -= count[seq];
+        if (n == 3 && (o[1] " " o[2] == ops[2] " " ops[3] || o[2] " " o[3] == ops[1] " " ops[2]))
+            save[s] -= 2 * (count[s] < count[seq] ? count[s] : count[seq]);
+    }
+}
+
+END {
+    if (dispatches == 0) {
+        print "superinstructions.awk: no opcode profile in the input" > "/dev/stderr";
+        exit 1;
+    }
+    if (N == 0)
+        N = 8;
+
+    for (picked = 0; picked < N; picked++) {
+        best = "";
+        for (s in save) {
+            if (s in chosen || save[s] <= 0)
+                continue;
+            if (best == "" || save[s] > save[best] || (save[s] == save[best] && s < best))
+                best = s;
+        }
+        if (best == "")
+            break;
+        choose(best);
+        order[picked] = best;
+    }
+
+    print "#pragma once";
+    print "";
+    print "/** @file superinstructions.h";
+    print " * @brief Superinstructions generated from an opcode profile";
+    print " *";
+    print " * Generated by bin/superinstructions.awk; do not edit.";
+    printf " * Profile: %d dispatches, about %d (%.1f%%) saved by this set.\n", dispatches, saved, 100 * saved / dispatches;
+    print " */";
+    print "";
+    print "/** Number of superinstructions in this set */";
+    printf "#define SUPER_COUNT %d\n", picked;
+    for (size = 2; size <= 3; size++) {
+        print "";
+        if (size == 2) {
+            print "/** Superinstructions fusing two operations: X (name, a, b) */";
+            line = "#define SUPER_PAIRS(X)";
+        } else {
+            print "/** Superinstructions fusing three operations: X (name, a, b, c) */";
+            line = "#define SUPER_TRIPLES(X)";
+        }
+        for (i = 0; i < picked; i++) {
+            n = split(order[i], ops, " ");
+            if (n != size)
+                continue;
+            printf "%s \\\n", line;
+            line = "    X (" opname(order[i]);
+            for (k = 1; k <= n; k++)
+                line = line ", " ops[k];
+            line = line ")";
+        }
+        print line;
+    }
+}
@@ -1,31 +1,58 @@
 #pragma once
 
 #include "common.h"
+#include "superinstructions.h"
 #include "value.h"
 
 /** @file chunk.h
  * @brief API exposed by the Chunk module
  */
 
+/** Largest operand of a long instruction, which takes three bytes.
+ */
+#define LONG_OPERAND_MAX 0xffffff
+
+/** Read the three byte operand of a long instruction.
+ */
+#define LONG_OPERAND(code) (((code)[0] << 16) | ((code)[1] << 8) | (code)[2])
+
 /** Enumerate defined operation codes.
+ *
+ * An operation named _LONG takes a three byte constant, slot or
+ * jump operand in place of the single byte (or two byte jump) of
+ * the short form. The compiler only picks it when the short form
+ * does not fit.
+ *
+ * An operation named _NUMBER skips the type check of the plain
+ * form, and is only used where the compiler proved the operands
+ * are numbers.
  */
 typedef enum {
     OP_CONSTANT,                ///< Push a constant onto the stack
+    OP_CONSTANT_LONG,           ///< Push a constant onto the stack
     OP_NIL,                     ///< Push a nil onto the stack
     OP_TRUE,                    ///< Push a false onto the stack
     OP_FALSE,                   ///< Push a true onto the stack
     OP_POP,                     ///< discard the top value from the stack
     OP_GET_LOCAL,               ///< push value of local variable onto the stack
     OP_SET_LOCAL,               ///< pop top of stack into local variable
+    OP_GET_LOCAL_LONG,          ///< push value of local variable onto the stack
+    OP_SET_LOCAL_LONG,          ///< pop top of stack into local variable
     OP_GET_GLOBAL,              ///< push value of global variable onto the stack
     OP_DEFINE_GLOBAL,           ///< define a global variable
     OP_SET_GLOBAL,              ///< pop top of stack into global variable
+    OP_GET_GLOBAL_LONG,         ///< push value of global variable onto the stack
+    OP_DEFINE_GLOBAL_LONG,      ///< define a global variable
+    OP_SET_GLOBAL_LONG,         ///< pop top of stack into global variable
     OP_GET_UPVALUE,             ///< push value of upvalue variable onto the stack
     OP_SET_UPVALUE,             ///< pop top of stack into upvalue variable
     OP_GET_PROPERTY,            ///< push value of instance property
     OP_SET_PROPERTY,            ///< pop top of stack into instance property
+    OP_GET_PROPERTY_LONG,       ///< push value of instance property
+    OP_SET_PROPERTY_LONG,       ///< pop top of stack into instance property
 
     OP_GET_SUPER,               ///< execute a "super" access
+    OP_GET_SUPER_LONG,          ///< execute a "super" access
 
     OP_EQUAL,                   ///< compare top two values for equality
     OP_GREATER,                 ///< compare top two values for order
@@ -38,37 +65,144 @@ typedef enum {
 
     OP_NOT,                     ///< logical inversion
     OP_NEGATE,                  ///< invert the sign of the top of the stack
+
+    OP_ADD_NUMBER,              ///< add top two values, known to be numbers
+    OP_SUBTRACT_NUMBER,         ///< subtract top two values, known to be numbers
+    OP_MULTIPLY_NUMBER,         ///< multiply top two values, known to be numbers
+    OP_DIVIDE_NUMBER,           ///< divide top two values, known to be numbers
+    OP_GREATER_NUMBER,          ///< compare top two values, known to be numbers
+    OP_LESS_NUMBER,             ///< compare top two values, known to be numbers
+    OP_NEGATE_NUMBER,           ///< negate top of stack, known to be a number
+
     OP_PRINT,                   ///< print the value on the top of the stack
     OP_JUMP,                    ///< unconditional forward branch 
     OP_JUMP_IF_FALSE,           ///< conditional forward branch
     OP_LOOP,                    ///< unconditional backward branch
+    OP_COMPARE_LOCALS_JUMP,     ///< compare two locals, forward branch on a JumpTest
+    OP_COMPARE_CONSTANT_JUMP,   ///< compare a local with a constant, forward branch on a JumpTest
+    OP_JUMP_LONG,               ///< unconditional forward branch
+    OP_JUMP_IF_FALSE_LONG,      ///< conditional forward branch
+    OP_LOOP_LONG,               ///< unconditional backward branch
+    OP_COMPARE_LOCALS_JUMP_LONG,        ///< compare two locals, forward branch on a JumpTest
+    OP_COMPARE_CONSTANT_JUMP_LONG,      ///< compare a local with a constant, forward branch on a JumpTest
+    OP_ADD_CONSTANT_LOCAL,      ///< add a number constant to a local variable
+    OP_ADD_R,                   ///< add two register operands
+    OP_SUBTRACT_R,              ///< subtract two register operands
+    OP_MULTIPLY_R,              ///< multiply two register operands
+    OP_DIVIDE_R,                ///< divide two register operands
+    OP_EQUAL_R,                 ///< compare two register operands for equality
+    OP_GREATER_R,               ///< compare two register operands for order
+    OP_LESS_R,                  ///< compare two register operands for order
     OP_CALL,                    ///< function call
     OP_INVOKE,                  ///< optimized method invocation
     OP_SUPER_INVOKE,            ///< optimized superclass method invocation
+    OP_INVOKE_LONG,             ///< optimized method invocation
+    OP_SUPER_INVOKE_LONG,       ///< optimized superclass method invocation
     OP_CLOSURE,                 ///< make a closure
+    OP_CLOSURE_LONG,            ///< make a closure
     OP_CLOSE_UPVALUE,           ///< convert upvalue from stack to heap
     OP_RETURN,                  ///< Stop executing a bytecode sequence
     OP_CLASS,                   ///< make a class
+    OP_CLASS_LONG,              ///< make a class
     OP_INHERIT,                 ///< set superclass of new class
     OP_METHOD,                  ///< make a class instance method
+    OP_METHOD_LONG,             ///< make a class instance method
+    OP_IMPORT,                  ///< run a module, unless it already ran
+    OP_IMPORT_LONG,             ///< run a module, unless it already ran
 
-    OP__LAST = OP_RETURN        ///< Expose highest opcode for testing
+    /// superinstructions, from superinstructions.h
+#define SUPER_OPCODE(name, ...) name,
+    SUPER_PAIRS (SUPER_OPCODE)
+    SUPER_TRIPLES (SUPER_OPCODE)
+#undef  SUPER_OPCODE
+
+    OP__LAST = OP_IMPORT_LONG + SUPER_COUNT  ///< Expose highest opcode for testing
 } OpCode;
 
+/** Flags in the mode operand of a register instruction.
+ *
+ * A register instruction is the opcode, the mode, and the two
+ * operands; with REG_STORE, the destination slot follows.
+ */
+typedef enum {
+    REG_A_CONSTANT = 1,         ///< first operand is a constant, not a frame slot
+    REG_B_CONSTANT = 2,         ///< second operand is a constant, not a frame slot
+    REG_STORE = 4,              ///< store the result in a frame slot, do not push it
+} RegisterMode;
+
+/** Enumerate when a fused compare-and-jump takes its branch.
+ *
+ * The tests mirror the code they replace: "a <= b" compiles to
+ * a jump when a > b, which is not the same as !(a <= b) for NaN.
+ */
+typedef enum {
+    TEST_NOT_LESS,              ///< jump unless a < b
+    TEST_NOT_GREATER,           ///< jump unless a > b
+    TEST_LESS,                  ///< jump if a < b
+    TEST_GREATER,               ///< jump if a > b
+} JumpTest;
+
+/** Enumerate how OP_CLOSURE captures each upvalue.
+ */
+typedef enum {
+    CAPTURE_UPVALUE,            ///< share an upvalue of the enclosing closure
+    CAPTURE_LOCAL,              ///< refer to a local of the enclosing function
+    CAPTURE_COPY,               ///< copy a local that is never assigned
+} CaptureKind;
+
+/** Last callee seen by an OP_CALL site
+ *
+ * The callee is not traced; the collector empties the site
+ * instead when it is about to free the callee. A chunk with any
+ * site filled is found through vm.callers.
+ */
+struct CallSite {
+    Obj *callee;                ///< closure or native last called here
+    int headroom;               ///< stack slots the callee needs
+};
+
+/** First offset of a run of code from one source line
+ *
+ * The code from offset up to the offset of the next LineStart
+ * in the chunk, or to the end, came from this line.
+ */
+struct LineStart {
+    int offset;                 ///< offset of the first byte of the run
+    int line;                   ///< source line number of the run
+};
+
 /** Dynamic Array of Instructions
  */
 struct Chunk {
     int count;                  ///< number of bytecode bytes present
     int capacity;               ///< reallocate when we grow past this
     uint8_t *code;              ///< Storage for some bytecodes
-    int *lines;                 ///< parallel array of line numbers
+    int lineCount;              ///< number of runs in lines
+    int lineCapacity;           ///< allocated size of the lines array
+    LineStart *lines;           ///< where each run of code from one line starts
     ValueArray constants;       ///< Expandable pool of consetant values
+    int callCount;              ///< number of OP_CALL sites
+    int callCapacity;           ///< allocated size of the calls array
+    CallSite *calls;            ///< callee cache for each OP_CALL site
+    bool hasCallees;            ///< some site holds a callee; listed in vm.callers
+    bool isImage;               ///< code and lines lie in a mapped image, not the heap
+    bool isPacked;              ///< constants, lines and code share one block; see packChunk
 };
 
 extern void initChunk (Chunk *chunk);
 extern void freeChunk (Chunk *chunk);
 extern void writeChunk (Chunk *chunk, uint8_t byte, int line);
+extern void addLine (Chunk *chunk, int offset, int line);
+extern int getLine (Chunk *chunk, int offset);
+extern void packChunk (Chunk *chunk);
 extern int addConstant (Chunk *chunk, Value value);
+extern int addCallSite (Chunk *chunk);
+extern bool isRegisterOp (OpCode instruction);
+extern uint32_t opcodeHash ();
+extern int opcodeLength (OpCode instruction);
+extern int instructionLength (Chunk *chunk, int offset);
+extern bool jumpDistance (Chunk *chunk, int offset, int *distance);
+extern bool verifyFunction (ObjFunction *function);
 
 extern void postChunk ();
 extern void bistChunk ();
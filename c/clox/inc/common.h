@@ -34,5 +34,18 @@
 /** Enable (or disable) sweep-to-list in GC */
 #undef DEBUG_FREELESS_GC
 
+/** Enable (or disable) the opcode profile for superinstructions */
+#undef DEBUG_PROFILE_OPCODES
+
+/** Storage class for state that each thread has its own copy of
+ *
+ * Several threads may compile at once (see compileAll), each with
+ * its own scanner and compiler state.
+ */
+#define THREAD_LOCAL __thread
+
 /** Number of distinct uint8_t values */
 #define UINT8_COUNT (UINT8_MAX + 1)
+
+/** Number of distinct uint16_t values */
+#define UINT16_COUNT (UINT16_MAX + 1)
@@ -8,6 +8,10 @@
  */
 
 extern ObjFunction *compile (const char *source);
+extern ObjFunction *compileProgram (const char *source);
+extern void compileAll (const char **sources, ObjFunction **functions, int count, int jobs);
+extern bool compileLazy (ObjFunction *function);
+extern void freeLazyBody (ObjFunction *function);
 extern void markCompilerRoots ();
 
 void bistCompiler ();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "chunk.h"
 #include "common.h"
 #include "scanner.h"
 
@@ -10,3 +11,4 @@
 extern void disassembleChunk (Chunk *chunk, const char *name);
 extern int disassembleInstruction (Chunk *chunk, int offset);
 extern const char *tokenTypeString (TokenType tt);
+extern const char *opcodeString (OpCode instruction);
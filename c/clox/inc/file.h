@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+
+/** @file file.h
+ * @brief API exposed by the FILE module
+ */
+
+extern char *readFile (const char *path, size_t *length);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "object.h"
+
+/** @file image.h
+ * @brief API exposed by the IMAGE module
+ */
+
+/** First bytes of every image file */
+#define IMAGE_MAGIC "LOXC"
+
+/** Version of the image format.
+ *
+ * Images hold bytecode as it is, so this must change whenever
+ * the format or the meaning of any opcode does. The numbering
+ * and shape of the opcodes (see opcodeHash) are also checked,
+ * which catches the superinstructions being regenerated.
+ */
+#define IMAGE_VERSION 3
+
+extern bool writeImage (ObjFunction *script, const char *path);
+extern bool isImage (const char *path);
+extern ObjFunction *loadImage (const char *path);
+extern void freeImages ();
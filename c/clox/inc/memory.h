@@ -30,6 +30,12 @@
 extern void initMemory ();
 extern const char *printableHeapAddr (void *ptr);
 extern void *reallocate (void *pointer, size_t oldSize, size_t newSize);
+extern void *allocatePermanent (size_t size);
+extern void rememberValue (Value value);
+extern void rememberCaller (ObjFunction *function);
+extern void shareHeap (bool shared);
+extern void lockHeap ();
+extern void unlockHeap ();
 extern void markObject (Obj *object);
 extern void markValue (Value value);
 extern void freeUnfree ();
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "object.h"
+
+/** @file module.h
+ * @brief API exposed by the MODULE module
+ */
+
+extern ObjString *modulePath (ObjString *path);
+extern ObjFunction *loadModule (ObjString *path);
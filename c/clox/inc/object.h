@@ -60,8 +60,8 @@
 /** Return the String object in this Value. */
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 
-/** Return the C String in this Value. */
-#define AS_CSTRING(value) (AS_STRING(value)->chars)
+/** Return the C String in this Value, flattening a rope if needed. */
+#define AS_CSTRING(value) stringChars(AS_STRING(value))
 
 /** Enumerate the possible object types. */
 typedef enum {
@@ -79,6 +79,7 @@ typedef enum {
 struct Obj {
     ObjType type;               ///< Designate the type of the object
     bool isMarked;              ///< set by GC for reachable objects
+    bool isPermanent;           ///< lives in the permanent region
     struct Obj *next;           ///< next eldest object
 };
 
@@ -87,8 +88,11 @@ struct ObjFunction {
     Obj obj;                    ///< Inherit from Obj
     int arity;                  ///< number of parameters
     int upvalueCount;           ///< number of upvalues
+    int maxStack;               ///< deepest the stack gets in a frame, from slot zero
     Chunk chunk;                ///< compiled bytecode for the function
     ObjString *name;            ///< function name in an ObjString
+    ObjClosure *closure;        ///< closure shared by all uses, if it captures nothing
+    LazyBody *lazy;             ///< body still to be compiled on the first call, or NULL
 };
 
 /** Object that is a Native Function */
@@ -97,12 +101,32 @@ struct ObjNative {
     NativeFn function;          ///< the glue function
 };
 
-/** Object that is a string */
+/** Object that is a string
+ *
+ * Strings made by the compiler are interned as they are created.
+ * Strings made at runtime (for example by concatenation) are not
+ * hashed or interned until they are used as a table key, and are
+ * compared by content until then.
+ *
+ * A String with NULL chars is a rope: the concatenation of its left
+ * and right children. Ropes are flattened in place the first time
+ * their bytes are needed; see stringBytes.
+ *
+ * A String with a parent is a slice: its chars point into the
+ * content of the parent, and are not followed by a '\0'. Slices
+ * get their own copy of the content when interned; see stringChars.
+ */
 struct ObjString {
     Obj obj;                    ///< Inherit from Obj
     int length;                 ///< length of string
-    char *chars;                ///< pointer to start of string
+    char *chars;                ///< pointer to start of string, or NULL for a rope
+    ObjString *parent;          ///< slice: the String owning the content
+    ObjString *left;            ///< rope: leading part of the string
+    ObjString *right;           ///< rope: trailing part of the string
+    int depth;                  ///< rope: height of the tree, 0 for flat strings
     uint32_t hash;              ///< hash code for the string
+    bool hasHash;               ///< set once hash has been computed
+    bool isInterned;            ///< set once listed in vm.strings
 };
 
 /** Object that is an Upvalue */
@@ -110,17 +134,31 @@ struct ObjUpvalue {
     Obj obj;                    ///< Inherit from obj
     Value *location;            ///< where to find the storage
     Value closed;               ///< storage for upvalue when closed
-    ObjUpvalue *next;           ///< make a linked list for searching
 };
 
-/** Object that is a closure */
+/** Object that is a closure
+ *
+ * The upvalues are stored in the same allocation as the closure,
+ * followed by a Value for each of them (see CLOSURE_COPIES). A
+ * captured local that is never assigned (CAPTURE_COPY) is held in
+ * that Value, and its upvalue is left NULL.
+ */
 struct ObjClosure {
     Obj obj;                    ///< Inherit from Obj
     ObjFunction *function;      ///< compiled function
-    ObjUpvalue **upvalues;      ///< list of upvalues
     int upvalueCount;           ///< number of upvalues
+    ObjUpvalue *upvalues[];     ///< list of upvalues, NULL for a copy
 };
 
+/** Offset of the copied values from the upvalues of a closure */
+#define CLOSURE_COPIES_OFFSET(count)    ((sizeof (ObjUpvalue *) * (count) + sizeof (double) - 1) / sizeof (double) * sizeof (double))
+
+/** Bytes taken by a closure with this many upvalues */
+#define CLOSURE_SIZE(count)             (sizeof (ObjClosure) + CLOSURE_COPIES_OFFSET (count) + sizeof (Value) * (count))
+
+/** The copied values of a closure, one for each upvalue */
+#define CLOSURE_COPIES(closure)         ((Value *) ((char *) (closure)->upvalues + CLOSURE_COPIES_OFFSET ((closure)->upvalueCount)))
+
 /** Object that is a class */
 struct ObjClass {
     Obj obj;                    ///< Inherit from Obj
@@ -144,11 +182,22 @@ struct ObjBoundMethod {
 extern ObjBoundMethod *newBoundMethod (Value receiver, ObjClosure *method);
 extern ObjClass *newClass (ObjString *name);
 extern ObjClosure *newClosure (ObjFunction *function);
+extern ObjClosure *sharedClosure (ObjFunction *function);
 extern ObjFunction *newFunction ();
 extern ObjInstance *newInstance (ObjClass *klass);
 extern ObjNative *newNative (NativeFn function);
 extern ObjString *takeString (char *chars, int length);
 extern ObjString *copyString (const char *chars, int length);
+extern ObjString *makeString (char *chars, int length);
+extern ObjString *concatStrings (ObjString *a, ObjString *b);
+extern const char *stringBytes (ObjString *string);
+extern char *stringChars (ObjString *string);
+extern ObjString *sliceString (ObjString *string, int start, int length);
+extern int stringIndexOf (ObjString *haystack, ObjString *needle, int from);
+extern ObjString *internString (ObjString *string);
+extern uint32_t stringHash (ObjString *string);
+extern uint32_t hashString (const char *key, int length);
+extern bool stringsEqual (ObjString *a, ObjString *b);
 extern ObjUpvalue *newUpvalue (Value *slot);
 extern void printObject (Value value);
 
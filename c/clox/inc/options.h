@@ -8,11 +8,22 @@ struct Options {
     int verbose;                ///< verbosity, 0=default, higher is more verbose.
     int dryrun;                 ///< dryrun level, 0=default, higher is skipping more stuff.
     int debug;                  ///< debug level, 0=default, higher is more debugging.
+    const char *compileTo;      ///< write files named after this to an image, not run them
+    bool lazy;                  ///< compile function bodies when first called
+    int jobs;                   ///< threads to compile files on, or 0 to run each as named
+    bool cacheModules;          ///< write an image of each module compiled for import
+    const char *snapshotTo;     ///< write the heap here once the files named have run
 
+    void (*post) ();            ///< Callback for Power-On Self Test
     void (*bist) ();            ///< Callback for Built-In Self Test
     void (*demo) ();            ///< Callback for Demonstration Mode
     void (*repl) ();            ///< Callback to run REPL
 
+    /** Callback to restore the heap from a snapshot
+     * @param path name of snapshot file
+     */
+    void (*restore) (const char *path);
+
     /** Callback for file names
      * @param path name of file
      */
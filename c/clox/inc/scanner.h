@@ -42,6 +42,7 @@ typedef enum {
     TOKEN_FOR,                  ///< "for"
     TOKEN_FUN,                  ///< "fun"
     TOKEN_IF,                   ///< "if"
+    TOKEN_IMPORT,               ///< "import"
     TOKEN_NIL,                  ///< "nil"
     TOKEN_OR,                   ///< "or"
     TOKEN_PRINT,                ///< "print"
@@ -83,6 +84,9 @@ struct Scanner {
 };
 
 extern void initScanner (const char *source);
+extern void initScannerAt (const char *source, int line);
+extern Scanner saveScanner ();
+extern void restoreScanner (Scanner saved);
 extern Token scanToken ();
 
 extern void postScanner ();
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "common.h"
+
+/** @file snapshot.h
+ * @brief API exposed by the SNAPSHOT module
+ */
+
+/** First bytes of every snapshot file */
+#define SNAPSHOT_MAGIC "LOXH"
+
+/** Version of the snapshot format.
+ *
+ * Snapshots hold objects as this build lays them out, and code
+ * as it is, so this must change whenever the format or the
+ * meaning of any opcode does. The numbering and shape of the
+ * opcodes (see opcodeHash), the number of natives, and the sizes
+ * of the structures are also checked.
+ */
+#define SNAPSHOT_VERSION 3
+
+extern bool writeSnapshot (const char *path);
+extern bool restoreSnapshot (const char *path);
+extern void freeSnapshots ();
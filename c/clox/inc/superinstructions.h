@@ -0,0 +1,25 @@
+#pragma once
+
+/** @file superinstructions.h
+ * @brief Superinstructions generated from an opcode profile
+ *
+ * Generated by bin/superinstructions.awk; do not edit.
+ * Profile: 331907943 dispatches, about 113885629 (34.3%) saved by this set.
+ */
+
+/** Number of superinstructions in this set */
+#define SUPER_COUNT 8
+
+/** Superinstructions fusing two operations: X (name, a, b) */
+#define SUPER_PAIRS(X) \
+    X (OP_SUPER_CONSTANT_SUBTRACT, OP_CONSTANT, OP_SUBTRACT) \
+    X (OP_SUPER_GET_GLOBAL_GET_LOCAL, OP_GET_GLOBAL, OP_GET_LOCAL) \
+    X (OP_SUPER_POP_POP, OP_POP, OP_POP) \
+    X (OP_SUPER_GET_GLOBAL_GET_GLOBAL, OP_GET_GLOBAL, OP_GET_GLOBAL) \
+    X (OP_SUPER_GET_LOCAL_GET_LOCAL, OP_GET_LOCAL, OP_GET_LOCAL)
+
+/** Superinstructions fusing three operations: X (name, a, b, c) */
+#define SUPER_TRIPLES(X) \
+    X (OP_SUPER_GET_GLOBAL_GET_LOCAL_CONSTANT, OP_GET_GLOBAL, OP_GET_LOCAL, OP_CONSTANT) \
+    X (OP_SUPER_ADD_SET_GLOBAL_POP, OP_ADD, OP_SET_GLOBAL, OP_POP) \
+    X (OP_SUPER_ADD_SET_LOCAL_POP, OP_ADD, OP_SET_LOCAL, OP_POP)
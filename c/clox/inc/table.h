@@ -6,7 +6,7 @@
 /** Hash Table Entry
  */
 struct Entry {
-    ObjString *key;             ///< key (must be interned)
+    ObjString *key;             ///< key (interned on demand)
     Value value;                ///< value (any object)
 };
 
@@ -14,6 +14,7 @@ struct Entry {
  */
 struct Table {
     int count;                  ///< number of entries including tombstones
+    int tombstones;             ///< number of tombstones
     int capacity;               ///< total current capacity of entries
     Entry *entries;             ///< array of entries
 };
@@ -25,7 +26,7 @@ extern bool tableSet (Table *table, ObjString *key, Value value);
 extern bool tableDelete (Table *table, ObjString *key);
 extern void tableAddAll (Table *from, Table *to);
 extern ObjString *tableFindString (Table *table, const char *chars, int length, uint32_t hash);
-extern void tableRemoveWhite (Table *table);
+extern void tablePurge (Table *table);
 extern void markTable (Table *table);
 
 extern void postTable ();
@@ -19,6 +19,12 @@
 /** Chunk of Bytecodes */
 typedef struct Chunk Chunk;
 
+/** Cached callee of one OP_CALL site */
+typedef struct CallSite CallSite;
+
+/** First offset of a run of code from one source line */
+typedef struct LineStart LineStart;
+
 /** Value Representation */
 typedef struct Value Value;
 
@@ -54,6 +60,9 @@ typedef struct Obj Obj;
 /** String objects */
 typedef struct ObjString ObjString;
 
+/** Block of storage in the permanent region */
+typedef struct PermanentBlock PermanentBlock;
+
 /** Hash Table */
 typedef struct Table Table;
 
@@ -74,10 +83,26 @@ typedef struct Local Local;
  */
 typedef struct ObjFunction ObjFunction;
 
+/** Files being compiled by several threads
+ */
+typedef struct CompilePool CompilePool;
+
+/** Function body kept as text until it is first called
+ */
+typedef struct LazyBody LazyBody;
+
+/** Compilation set aside while another one runs
+ */
+typedef struct SuspendedCompile SuspendedCompile;
+
 /** Stack Frame
  */
 typedef struct CallFrame CallFrame;
 
+/** Compiled script kept for reuse by interpret
+ */
+typedef struct CachedScript CachedScript;
+
 /** Native Function
  */
 typedef Value (*NativeFn) (int argCount, Value *args);
@@ -94,6 +119,54 @@ typedef struct ObjClosure ObjClosure;
  */
 typedef struct Upvalue Upvalue;
 
+/** Forward jump too far for a two byte operand
+ */
+typedef struct LongJump LongJump;
+
+/** What type inference knows of one stack slot
+ */
+typedef struct SlotType SlotType;
+
+/** Stack of SlotType, as type inference walks the code
+ */
+typedef struct TypeStack TypeStack;
+
+/** Start of an image file */
+typedef struct ImageHeader ImageHeader;
+
+/** Start of a function record in an image */
+typedef struct ImageFunction ImageFunction;
+
+/** Constant pool entry in an image */
+typedef struct ImageConstant ImageConstant;
+
+/** Bytes of one section of an image being written */
+typedef struct ImageBuffer ImageBuffer;
+
+/** State of an image being written */
+typedef struct ImageWriter ImageWriter;
+
+/** Position in an image being loaded */
+typedef struct ImageReader ImageReader;
+
+/** Start of a snapshot file */
+typedef struct SnapshotHeader SnapshotHeader;
+
+/** Tables and lists the VM starts from in a snapshot */
+typedef struct SnapshotRoots SnapshotRoots;
+
+/** Native function slot to fill in when a snapshot is restored */
+typedef struct SnapshotNative SnapshotNative;
+
+/** Offset given to an object in a snapshot being written */
+typedef struct SnapshotSlot SnapshotSlot;
+
+/** Pointer in a snapshot being written, to an object not yet placed */
+typedef struct SnapshotFixup SnapshotFixup;
+
+/** State of a snapshot being written */
+typedef struct SnapshotWriter SnapshotWriter;
+
 /** Upvalue Object
  */
 typedef struct ObjUpvalue ObjUpvalue;
@@ -5,13 +5,39 @@
 #include "table.h"
 #include "value.h"
 
-/** Number of stack frames
+/** Number of stack frames allocated when the VM starts
  */
-#define FRAMES_MAX 64
+#define FRAMES_INIT 8
 
-/** Maximum Stack Depth
+/** Maximum number of stack frames (may be set when building)
  */
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 4096
+#endif
+
+/** Stack slots reserved past the verified depth of each call
+ *
+ * The runtime pushes a few values of its own while it works, to
+ * keep them from the collector (a string being concatenated, for
+ * one), and a native function has no verified depth at all.
+ */
+#define STACK_SCRATCH 16
+
+/** Number of stack slots allocated when the VM starts
+ */
+#define STACK_INIT (2 * UINT8_COUNT)
+
+/** Maximum Stack Depth (may be set when building)
+ */
+#ifndef STACK_MAX
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#endif
+
+/** Number of compiled scripts kept by interpret (may be set when building)
+ */
+#ifndef COMPILE_CACHE_SIZE
+#define COMPILE_CACHE_SIZE 16
+#endif
 
 /** Stack Frame for each Function Call
  *
@@ -21,25 +47,51 @@ struct CallFrame {
     ObjClosure *closure;        ///< which closure owns the frame
     uint8_t *ip;                ///< this frame's instruction pointer
     Value *slots;               ///< local variable storage
+    bool hasOpenUpvalues;       ///< set when a local of this frame is captured
+};
+
+/** Compiled script kept for reuse by interpret
+ *
+ * The source is copied, so a hash collision is told apart
+ * from a hit by comparing the text itself.
+ */
+struct CachedScript {
+    uint32_t hash;              ///< hash of the source text
+    int length;                 ///< length of the source text
+    char *source;               ///< copy of the source text, or NULL if unused
+    ObjFunction *function;      ///< the script compiled from it
+    unsigned long lastUse;      ///< vm.compileClock when last compiled or reused
 };
 
 /** Internal state of the VM
  */
 struct VM {
-    CallFrame frames[FRAMES_MAX];       ///< storage for stack frames
+    CallFrame *frames;          ///< storage for stack frames
     int frameCount;             ///< number of currently active stack frames
-    Value stack[STACK_MAX];     ///< storage for the data stack
+    int frameCapacity;          ///< number of stack frames allocated
+    Value *stack;               ///< storage for the data stack
+    int stackCapacity;          ///< number of stack slots allocated
     Value *sp;                  ///< data stack pointer
+    ObjUpvalue **openSlots;     ///< open upvalue for each stack slot, or NULL
+    int openTop;                ///< no slot at or above this has an open upvalue
     Table globals;              ///< hash table of global variables
     Table strings;              ///< hash table for string deduplication
+    Table modules;              ///< script of each module imported, by path
     ObjString *initString;      ///< name of class constructor methods
-    ObjUpvalue *openUpvalues;   ///< linked list of ALL open upvalues on the stack
     Obj *objects;               ///< linked list of all objects
+    Obj *permanentObjects;      ///< linked list of objects in the permanent region
+    bool allocPermanent;        ///< allocate new objects in the permanent region
+    ValueArray permanentRefs;   ///< heap values referenced by permanent objects
+    Obj *snapshotObjects;       ///< linked list of objects in a restored snapshot
 
     int grayCount;              ///< number of grey items identified
     int grayCapacity;           ///< capacity of the gray item list
     Obj **grayStack;            ///< extensable array of gray items
 
+    int callerCount;            ///< number of functions in callers
+    int callerCapacity;         ///< allocated size of the callers array
+    ObjFunction **callers;      ///< functions with a callee in some call site
+
 #ifdef DEBUG_FREELESS_GC
     Obj *unfree;                ///< linked list (FIFO) of sweept objects
     Obj **unfree_link;          ///< tail pointer for FIFO operations
@@ -47,6 +99,11 @@ struct VM {
 
     size_t bytesAllocated;      ///< net bytes allocated
     size_t nextGC;              ///< allocation threshold for next GC run
+
+    CachedScript compileCache[COMPILE_CACHE_SIZE];      ///< scripts compiled by interpret
+    unsigned long compileClock; ///< count of interpret calls, for LRU eviction
+    unsigned int compileHits;   ///< interpret calls that reused a script
+    unsigned int compileMisses; ///< interpret calls that compiled the source
 };
 
 /** Interpreter result
@@ -63,6 +120,10 @@ extern void initVM ();
 extern void freeVM ();
 extern InterpretResult interpretChunk (Chunk *chunk);
 extern InterpretResult interpret (const char *source);
+extern InterpretResult interpretFunction (ObjFunction *function);
+extern int nativeIndex (NativeFn function);
+extern NativeFn nativeFunction (int index);
+extern int nativeCount ();
 extern void push (Value value);
 extern Value pop ();
 extern Value peek (int distance);
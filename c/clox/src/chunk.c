@@ -1,9 +1,16 @@
 #include "chunk.h"
 
+#include "debug.h"
+#include "error_log.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 /** @file chunk.c
  * @brief Manage Chunks of Bytecode
  */
@@ -26,8 +33,27 @@ initChunk (Chunk *chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray (&chunk->constants);
+    chunk->callCount = 0;
+    chunk->callCapacity = 0;
+    chunk->calls = NULL;
+    chunk->hasCallees = false;
+    chunk->isImage = false;
+    chunk->isPacked = false;
+}
+
+/** Size of the block packChunk makes for a chunk.
+ *
+ * @param chunk a complete chunk
+ * @returns bytes needed for its constants, lines and code
+ */
+static size_t
+packedSize (Chunk *chunk)
+{
+    return sizeof (Value) * chunk->constants.count + sizeof (LineStart) * chunk->lineCount + chunk->count;
 }
 
 /** Release resources owned by Chunk.
@@ -43,11 +69,57 @@ initChunk (Chunk *chunk)
 void
 freeChunk (Chunk *chunk)
 {
-    FREE_ARRAY (uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY (int, chunk->lines, chunk->capacity);
+    if (chunk->isPacked) {
+        FREE_ARRAY (uint8_t, (uint8_t *) chunk->constants.values, packedSize (chunk));
+    } else {
+        if (!chunk->isImage) {
+            FREE_ARRAY (uint8_t, chunk->code, chunk->capacity);
+            FREE_ARRAY (LineStart, chunk->lines, chunk->lineCapacity);
+        }
+        freeValueArray (&chunk->constants);
+    }
+    FREE_ARRAY (CallSite, chunk->calls, chunk->callCapacity);
+    initChunk (chunk);
+}
 
+/** Move a complete chunk into one block of just the right size.
+ *
+ * While a chunk is compiled, its constants, lines and code each
+ * grow on their own, with room to spare. Once it is complete they
+ * are copied into one block, in that order, which keeps the Values
+ * aligned and the parts of a function close together. The chunk
+ * must not be written to after this.
+ *
+ * @param chunk the complete chunk
+ */
+void
+packChunk (Chunk *chunk)
+{
+    if (chunk->isPacked || chunk->isImage)
+        return;
+
+    int constantCount = chunk->constants.count;
+    uint8_t *block = ALLOCATE (uint8_t, packedSize (chunk));
+    Value *constants = (Value *) block;
+    LineStart *lines = (LineStart *) (constants + constantCount);
+    uint8_t *code = (uint8_t *) (lines + chunk->lineCount);
+
+    memcpy (constants, chunk->constants.values, sizeof (Value) * constantCount);
+    memcpy (lines, chunk->lines, sizeof (LineStart) * chunk->lineCount);
+    memcpy (code, chunk->code, chunk->count);
+
+    FREE_ARRAY (uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY (LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray (&chunk->constants);
-    initChunk (chunk);
+
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->capacity = chunk->count;
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->constants.values = constants;
+    chunk->constants.count = constantCount;
+    chunk->constants.capacity = constantCount;
+    chunk->isPacked = true;
 }
 
 /** Write an OpCode onto the end of the chunk.
@@ -59,20 +131,74 @@ freeChunk (Chunk *chunk)
 void
 writeChunk (Chunk *chunk, uint8_t byte, int line)
 {
+    INVAR (!chunk->isPacked, "refused, chunk is packed.");
 
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
 
         chunk->capacity = GROW_CAPACITY (oldCapacity);
         chunk->code = GROW_ARRAY (uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY (int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
+    addLine (chunk, chunk->count, line);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
+/** Note the source line of the code starting at an offset.
+ *
+ * A run is only added where the line changes, so most bytes of
+ * code cost nothing here. Offsets must be given in order.
+ *
+ * @param chunk the chunk being written
+ * @param offset where the code from the line starts
+ * @param line source line number
+ */
+void
+addLine (Chunk *chunk, int offset, int line)
+{
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+        return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+
+        chunk->lineCapacity = GROW_CAPACITY (oldCapacity);
+        chunk->lines = GROW_ARRAY (LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    chunk->lines[chunk->lineCount].offset = offset;
+    chunk->lines[chunk->lineCount].line = line;
+    chunk->lineCount++;
+}
+
+/** Find the source line of the code at an offset.
+ *
+ * Only runtime errors and the disassembler need this, so
+ * the runs are searched rather than kept for every byte.
+ *
+ * @param chunk the chunk holding the code
+ * @param offset where in the code
+ * @returns the line number, or 0 if the chunk has none
+ */
+int
+getLine (Chunk *chunk, int offset)
+{
+    int low = 0;
+    int high = chunk->lineCount;
+
+    // find the last run starting at or before offset.
+    while (high - low > 1) {
+        int middle = low + (high - low) / 2;
+
+        if (chunk->lines[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+    return chunk->lineCount == 0 ? 0 : chunk->lines[low].line;
+}
+
 /** Add a value to the constant pool.
  *
  * Append the value to the constant pool, and return
@@ -85,11 +211,680 @@ writeChunk (Chunk *chunk, uint8_t byte, int line)
 int
 addConstant (Chunk *chunk, Value value)
 {
+    INVAR (!chunk->isPacked, "refused, chunk is packed.");
+
     // value may not be otherwise reachable,
     // but we do not want GC to sweep it
     // if GC is triggered by writeValueArray.
+    lockHeap ();
     push (value);
     writeValueArray (&chunk->constants, value);
     pop ();
+    unlockHeap ();
     return chunk->constants.count - 1;
 }
+
+/** Add an empty callee cache for an OP_CALL site.
+ *
+ * @param chunk where the OP_CALL is being written
+ * @returns the index of the new call site
+ */
+int
+addCallSite (Chunk *chunk)
+{
+    if (chunk->callCapacity < chunk->callCount + 1) {
+        int oldCapacity = chunk->callCapacity;
+
+        chunk->callCapacity = GROW_CAPACITY (oldCapacity);
+        chunk->calls = GROW_ARRAY (CallSite, chunk->calls, oldCapacity, chunk->callCapacity);
+    }
+
+    chunk->calls[chunk->callCount].callee = NULL;
+    chunk->calls[chunk->callCount].headroom = 0;
+    return chunk->callCount++;
+}
+
+/** Check for a register instruction.
+ *
+ * @param instruction the OpCode
+ * @returns true if its operands name frame slots and constants
+ */
+bool
+isRegisterOp (OpCode instruction)
+{
+    return instruction >= OP_ADD_R && instruction <= OP_LESS_R;
+}
+
+/** Continue an FNV-1a hash over one more byte.
+ *
+ * @param hash the hash so far
+ * @param byte the byte to add
+ * @returns the hash including the byte
+ */
+static uint32_t
+hashByte (uint32_t hash, uint8_t byte)
+{
+    return (hash ^ byte) * 16777619;
+}
+
+/** Hash the numbering and shape of every opcode.
+ *
+ * Images and snapshots hold bytecode as it is. Regenerating the
+ * superinstructions can renumber or reshape opcodes without
+ * changing how many there are, so loaders compare this instead.
+ *
+ * @returns an FNV-1a hash of the name and length of each opcode,
+ * in order, and of the operations each superinstruction fuses
+ */
+uint32_t
+opcodeHash ()
+{
+    uint32_t hash = 2166136261u;
+
+    for (int instruction = 0; instruction <= OP__LAST; instruction++) {
+        for (const char *c = opcodeString ((OpCode) instruction); *c != '\0'; c++)
+            hash = hashByte (hash, (uint8_t) *c);
+        hash = hashByte (hash, 0);
+        hash = hashByte (hash, (uint8_t) opcodeLength ((OpCode) instruction));
+    }
+
+#define SUPER_PAIR_HASH(name, a, b) \
+    hash = hashByte (hashByte (hashByte (hash, name), a), b);
+#define SUPER_TRIPLE_HASH(name, a, b, c) \
+    hash = hashByte (hashByte (hashByte (hashByte (hash, name), a), b), c);
+    SUPER_PAIRS (SUPER_PAIR_HASH)
+    SUPER_TRIPLES (SUPER_TRIPLE_HASH)
+#undef  SUPER_TRIPLE_HASH
+#undef  SUPER_PAIR_HASH
+
+    return hash;
+}
+
+/** Length of an instruction, judged by its OpCode alone.
+ *
+ * @param instruction the OpCode
+ * @returns the length in bytes, including the operands;
+ * for OP_CLOSURE, this leaves out the capture operands,
+ * and for register instructions, the destination slot.
+ */
+int
+opcodeLength (OpCode instruction)
+{
+
+    // The compiler will inform us if an OpCode value is
+    // not in the switch, as long as we remember,
+    //     DO NOT ADD A "default:" CASE.
+
+    switch (instruction) {
+
+        // *INDENT-OFF*
+
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_ADD_NUMBER:
+    case OP_SUBTRACT_NUMBER:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE_NUMBER:
+    case OP_GREATER_NUMBER:
+    case OP_LESS_NUMBER:
+    case OP_NEGATE_NUMBER:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:                    return 1;
+
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_IMPORT:                     return 2;
+
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_ADD_CONSTANT_LOCAL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:               return 3;
+
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+    case OP_IMPORT_LONG:
+    case OP_CALL:
+    case OP_ADD_R:
+    case OP_SUBTRACT_R:
+    case OP_MULTIPLY_R:
+    case OP_DIVIDE_R:
+    case OP_EQUAL_R:
+    case OP_GREATER_R:
+    case OP_LESS_R:                     return 4;
+
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:          return 5;
+
+    case OP_COMPARE_LOCALS_JUMP:
+    case OP_COMPARE_CONSTANT_JUMP:      return 6;
+
+    case OP_COMPARE_LOCALS_JUMP_LONG:
+    case OP_COMPARE_CONSTANT_JUMP_LONG: return 7;
+
+#define SUPER_PAIR_LENGTH(name, a, b)   case name: return opcodeLength (a) + opcodeLength (b) - 1;
+#define SUPER_TRIPLE_LENGTH(name, a, b, c) case name: return opcodeLength (a) + opcodeLength (b) + opcodeLength (c) - 2;
+    SUPER_PAIRS (SUPER_PAIR_LENGTH)
+    SUPER_TRIPLES (SUPER_TRIPLE_LENGTH)
+#undef  SUPER_TRIPLE_LENGTH
+#undef  SUPER_PAIR_LENGTH
+
+        // *INDENT-ON*
+    }
+
+    UNREACHABLE ("unknown opcode %d", (int) instruction);
+}
+
+/** Length of the instruction at an offset in a chunk.
+ *
+ * @param chunk where to find the bytecode stream
+ * @param offset where the instruction starts
+ * @returns the length in bytes, including all operands
+ */
+int
+instructionLength (Chunk *chunk, int offset)
+{
+    OpCode instruction = (OpCode) chunk->code[offset];
+    int length = opcodeLength (instruction);
+
+    if (instruction == OP_CLOSURE) {
+        ObjFunction *function = AS_FUNCTION (chunk->constants.values[chunk->code[offset + 1]]);
+
+        length += 2 * function->upvalueCount;
+    } else if (instruction == OP_CLOSURE_LONG) {
+        ObjFunction *function = AS_FUNCTION (chunk->constants.values[LONG_OPERAND (chunk->code + offset + 1)]);
+
+        length += 2 * function->upvalueCount;
+    } else if (isRegisterOp (instruction) && (chunk->code[offset + 1] & REG_STORE)) {
+        length++;
+    }
+    return length;
+}
+
+/** Measure a jump from the end of its instruction.
+ *
+ * @param chunk where to find the bytecode stream
+ * @param offset where the instruction starts
+ * @param distance set to the signed distance to the jump target
+ * @returns false if the instruction is not a jump
+ */
+bool
+jumpDistance (Chunk *chunk, int offset, int *distance)
+{
+    uint8_t *code = chunk->code + offset;
+    int length = opcodeLength ((OpCode) code[0]);
+
+    switch (code[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_COMPARE_LOCALS_JUMP:
+    case OP_COMPARE_CONSTANT_JUMP:
+        *distance = (code[length - 2] << 8) | code[length - 1];
+        return true;
+    case OP_LOOP:
+        *distance = -((code[length - 2] << 8) | code[length - 1]);
+        return true;
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_COMPARE_LOCALS_JUMP_LONG:
+    case OP_COMPARE_CONSTANT_JUMP_LONG:
+        *distance = LONG_OPERAND (code + length - 3);
+        return true;
+    case OP_LOOP_LONG:
+        *distance = -LONG_OPERAND (code + length - 3);
+        return true;
+    }
+    return false;
+}
+
+/** Report why a function failed verification.
+ *
+ * @param function the function being verified
+ * @param offset where the offending instruction starts
+ * @param message what is wrong with it
+ * @returns false, for the caller to return
+ */
+static bool
+verifyError (ObjFunction *function, int offset, const char *message)
+{
+    fprintf (stderr, "VERIFY ERROR: %s at offset %d in %s\n", message, offset, NULL == function->name ? "<script>" : function->name->chars);
+    return false;
+}
+
+/** Check a constant operand.
+ *
+ * @param chunk where to find the constants
+ * @param index the operand
+ * @returns true if the constant exists
+ */
+static bool
+isConstant (Chunk *chunk, int index)
+{
+    return index < chunk->constants.count;
+}
+
+/** Check a name operand.
+ *
+ * @param chunk where to find the constants
+ * @param index the operand
+ * @returns true if the constant exists and is a string
+ */
+static bool
+isName (Chunk *chunk, int index)
+{
+    return isConstant (chunk, index) && IS_STRING (chunk->constants.values[index]);
+}
+
+/** Check for the long form of a constant, slot or name operand.
+ *
+ * @param instruction the OpCode
+ * @returns true if its first operand takes three bytes
+ */
+static bool
+hasLongOperand (OpCode instruction)
+{
+    return instruction == OP_CONSTANT_LONG || instruction == OP_GET_LOCAL_LONG || instruction == OP_SET_LOCAL_LONG
+        || instruction == OP_GET_GLOBAL_LONG || instruction == OP_DEFINE_GLOBAL_LONG || instruction == OP_SET_GLOBAL_LONG
+        || instruction == OP_GET_PROPERTY_LONG || instruction == OP_SET_PROPERTY_LONG || instruction == OP_GET_SUPER_LONG
+        || instruction == OP_INVOKE_LONG || instruction == OP_SUPER_INVOKE_LONG || instruction == OP_CLOSURE_LONG
+        || instruction == OP_CLASS_LONG || instruction == OP_METHOD_LONG || instruction == OP_IMPORT_LONG;
+}
+
+/** Check the operands of one operation and apply its stack effect.
+ *
+ * A superinstruction applies each of its operations in turn,
+ * reading their operands where they follow in the fused
+ * instruction, as printInstruction does.
+ *
+ * @param function the function being verified
+ * @param instruction the operation, which for a superinstruction
+ * part differs from the byte at the offset
+ * @param offset where the operands start, less one
+ * @param depth stack depth of the frame, updated
+ * @param peak deepest stack seen, updated
+ * @returns the offset of the last byte of the operation,
+ * or -1 if it failed verification
+ */
+static int
+applyOperation (ObjFunction *function, OpCode instruction, int offset, int *depth, int *peak)
+{
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = chunk->code + offset;
+    int operand = opcodeLength (instruction) < 2 ? 0 : hasLongOperand (instruction) ? LONG_OPERAND (code + 1) : code[1];
+    int pops = 0;
+    int pushes = 0;
+    bool valid = true;
+
+    // The compiler will inform us if an OpCode value is
+    // not in the switch, as long as we remember,
+    //     DO NOT ADD A "default:" CASE.
+
+    switch (instruction) {
+
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        pushes = 1;
+        break;
+
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+        valid = isConstant (chunk, operand);
+        pushes = 1;
+        break;
+
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+        valid = operand < *depth;
+        pushes = 1;
+        break;
+
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+        valid = operand < *depth;
+        pops = pushes = 1;
+        break;
+
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_IMPORT:
+    case OP_IMPORT_LONG:
+        valid = isName (chunk, operand);
+        pushes = 1;
+        break;
+
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+        valid = isName (chunk, operand);
+        pops = 1;
+        break;
+
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+        valid = isName (chunk, operand);
+        pops = pushes = 1;
+        break;
+
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+        valid = isName (chunk, operand);
+        pops = 2;
+        pushes = 1;
+        break;
+
+    case OP_GET_UPVALUE:
+        valid = operand < function->upvalueCount;
+        pushes = 1;
+        break;
+
+    case OP_SET_UPVALUE:
+        valid = operand < function->upvalueCount;
+        pops = pushes = 1;
+        break;
+
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+        pops = 1;
+        break;
+
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_NEGATE_NUMBER:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+        pops = pushes = 1;
+        break;
+
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_NUMBER:
+    case OP_SUBTRACT_NUMBER:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE_NUMBER:
+    case OP_GREATER_NUMBER:
+    case OP_LESS_NUMBER:
+        pops = 2;
+        pushes = 1;
+        break;
+
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_LONG:
+    case OP_LOOP_LONG:
+        break;
+
+    case OP_COMPARE_LOCALS_JUMP:
+    case OP_COMPARE_LOCALS_JUMP_LONG:
+        valid = code[1] <= TEST_GREATER && code[2] < *depth && code[3] < *depth;
+        break;
+
+    case OP_COMPARE_CONSTANT_JUMP:
+    case OP_COMPARE_CONSTANT_JUMP_LONG:
+        valid = code[1] <= TEST_GREATER && code[2] < *depth && isConstant (chunk, code[3]);
+        break;
+
+    case OP_ADD_CONSTANT_LOCAL:
+        valid = code[1] < *depth && isConstant (chunk, code[2]) && IS_NUMBER (chunk->constants.values[code[2]]);
+        break;
+
+    case OP_ADD_R:
+    case OP_SUBTRACT_R:
+    case OP_MULTIPLY_R:
+    case OP_DIVIDE_R:
+    case OP_EQUAL_R:
+    case OP_GREATER_R:
+    case OP_LESS_R:{
+            uint8_t mode = code[1];
+
+            valid = (mode & REG_A_CONSTANT ? isConstant (chunk, code[2]) : code[2] < *depth)
+                && (mode & REG_B_CONSTANT ? isConstant (chunk, code[3]) : code[3] < *depth)
+                && (mode & REG_STORE ? code[4] < *depth : true);
+            pushes = mode & REG_STORE ? 0 : 1;
+            if (mode & REG_STORE)
+                offset++;
+            break;
+        }
+
+    case OP_CALL:
+        valid = ((code[2] << 8) | code[3]) < chunk->callCount;
+        pops = code[1] + 1;
+        pushes = 1;
+        break;
+
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:{
+            int argCount = code[opcodeLength (instruction) - 1];
+
+            valid = isName (chunk, operand);
+            pops = argCount + (instruction == OP_INVOKE || instruction == OP_INVOKE_LONG ? 1 : 2);
+            pushes = 1;
+            break;
+        }
+
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:{
+            // the boundary pass checked that the constant is a function
+            ObjFunction *inner = AS_FUNCTION (chunk->constants.values[operand]);
+            uint8_t *capture = code + opcodeLength (instruction);
+
+            // the closure is pushed before its captures are read, so a
+            // local function may capture the slot it is about to fill.
+            for (int i = 0; i < inner->upvalueCount; i++, capture += 2) {
+                if (capture[0] == CAPTURE_UPVALUE)
+                    valid = valid && capture[1] < function->upvalueCount;
+                else
+                    valid = valid && capture[0] <= CAPTURE_COPY && capture[1] <= *depth;
+            }
+            offset += 2 * inner->upvalueCount;
+            pushes = 1;
+            break;
+        }
+
+        // *INDENT-OFF*
+
+#define SUPER_PAIR_APPLY(name, a, b)                                    \
+    case name:                                                          \
+        offset = applyOperation (function, a, offset, depth, peak);     \
+        return offset < 0 ? -1 : applyOperation (function, b, offset, depth, peak);
+#define SUPER_TRIPLE_APPLY(name, a, b, c)                               \
+    case name:                                                          \
+        offset = applyOperation (function, a, offset, depth, peak);     \
+        offset = offset < 0 ? -1 : applyOperation (function, b, offset, depth, peak); \
+        return offset < 0 ? -1 : applyOperation (function, c, offset, depth, peak);
+    SUPER_PAIRS (SUPER_PAIR_APPLY)
+    SUPER_TRIPLES (SUPER_TRIPLE_APPLY)
+#undef  SUPER_TRIPLE_APPLY
+#undef  SUPER_PAIR_APPLY
+
+        // *INDENT-ON*
+    }
+
+    if (!valid)
+        return verifyError (function, offset, "bad operand"), -1;
+    if (*depth < pops)
+        return verifyError (function, offset, "stack underflow"), -1;
+    *depth += pushes - pops;
+    if (*depth > *peak)
+        *peak = *depth;
+    return offset + opcodeLength (instruction) - 1;
+}
+
+/** Find where each instruction starts.
+ *
+ * This rejects unknown opcodes, and instructions that run
+ * past the end of the code. OP_CLOSURE needs its function
+ * to know its length, so its constant is checked here.
+ *
+ * @param function the function being verified
+ * @param isStart set true at the first byte of each instruction
+ * @returns true if the code splits into whole instructions
+ */
+static bool
+markInstructions (ObjFunction *function, bool *isStart)
+{
+    Chunk *chunk = &function->chunk;
+
+    for (int offset = 0; offset < chunk->count;) {
+        OpCode instruction = (OpCode) chunk->code[offset];
+
+        if (instruction > OP__LAST)
+            return verifyError (function, offset, "unknown opcode");
+        if (offset + opcodeLength (instruction) > chunk->count)
+            return verifyError (function, offset, "truncated instruction");
+        if (instruction == OP_CLOSURE || instruction == OP_CLOSURE_LONG) {
+            int constant = instruction == OP_CLOSURE ? chunk->code[offset + 1] : LONG_OPERAND (chunk->code + offset + 1);
+
+            if (!isConstant (chunk, constant) || !IS_FUNCTION (chunk->constants.values[constant]))
+                return verifyError (function, offset, "closure of a non-function");
+        }
+
+        int length = instructionLength (chunk, offset);
+
+        if (offset + length > chunk->count)
+            return verifyError (function, offset, "truncated instruction");
+        isStart[offset] = true;
+        offset += length;
+    }
+    return true;
+}
+
+/** Verify the bytecode of a function, and find its stack depth.
+ *
+ * Every path through the code is followed from the entry, with
+ * the parameters and the callee in the frame. Each instruction
+ * must find its operands on the stack, in the constants, or in
+ * the frame; jumps must land on an instruction; no path may run
+ * off the end; and paths that meet must agree on the depth.
+ *
+ * Verified code never grows the stack past maxStack slots of its
+ * frame, so the VM reserves them on each call, and need not check
+ * each push.
+ *
+ * @param function the function, with its maxStack set on success
+ * @returns true if the function passed, or
+ * @returns false after reporting why it did not
+ */
+bool
+verifyFunction (ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+    bool *isStart = ALLOCATE (bool, count + 1);
+    int *depths = ALLOCATE (int, count + 1);
+    int *pending = ALLOCATE (int, count + 1);
+    int pendingCount = 0;
+    int peak = function->arity + 1;
+    bool valid;
+
+    for (int i = 0; i <= count; i++) {
+        isStart[i] = false;
+        depths[i] = -1;
+    }
+
+    valid = markInstructions (function, isStart);
+    if (valid) {
+        depths[0] = peak;
+        pending[pendingCount++] = 0;
+        if (count == 0)
+            valid = verifyError (function, 0, "no code");
+    }
+
+    while (valid && pendingCount > 0) {
+        int offset = pending[--pendingCount];
+        OpCode instruction = (OpCode) chunk->code[offset];
+        int depth = depths[offset];
+        int next = offset + instructionLength (chunk, offset);
+        int successors[2];
+        int successorCount = 0;
+        int distance;
+
+        if (applyOperation (function, instruction, offset, &depth, &peak) < 0) {
+            valid = false;
+            break;
+        }
+
+        if (jumpDistance (chunk, offset, &distance))
+            successors[successorCount++] = next + distance;
+        if (instruction != OP_RETURN && instruction != OP_JUMP && instruction != OP_JUMP_LONG && instruction != OP_LOOP && instruction != OP_LOOP_LONG)
+            successors[successorCount++] = next;
+
+        for (int i = 0; valid && i < successorCount; i++) {
+            int target = successors[i];
+
+            if (target == count)
+                valid = verifyError (function, offset, "code runs off the end");
+            else if (target < 0 || target > count || !isStart[target])
+                valid = verifyError (function, offset, "jump into the middle of an instruction");
+            else if (depths[target] < 0) {
+                depths[target] = depth;
+                pending[pendingCount++] = target;
+            } else if (depths[target] != depth)
+                valid = verifyError (function, offset, "stack depths disagree where paths meet");
+        }
+    }
+
+    if (valid)
+        function->maxStack = peak;
+
+    FREE_ARRAY (int, pending, count + 1);
+    FREE_ARRAY (int, depths, count + 1);
+    FREE_ARRAY (bool, isStart, count + 1);
+    return valid;
+}
@@ -1,5 +1,8 @@
 #include "chunk.h"
 
+#include "object.h"
+#include "vm.h"
+
 #include <stdio.h>
 
 /** @file chunk_bist.c
@@ -19,23 +22,25 @@ bistChunk ()
     INVAR (0 == chunk.capacity, "initChunk did not clear the capacity");
     INVAR (NULL == chunk.code, "initChunk did not null the code pointer");
     INVAR (NULL == chunk.lines, "initChunk did not null the lines pointer");
+    INVAR (0 == getLine (&chunk, 0), "an empty chunk has no lines");
 
     for (int i = 0; i < 256; ++i)
-        writeChunk (&chunk, 0xAA ^ i, 123 + i);
+        writeChunk (&chunk, 0xAA ^ i, 123 + i / 2);
     writeChunk (&chunk, OP_RETURN, 1337);
 
     INVAR (257 == chunk.count, "writeChunk did not update the count");
     INVAR (512 == chunk.capacity, "writeChunk did not update the capacity");
     INVAR (NULL != chunk.code, "writeChunk did not update the code pointer");
     INVAR (NULL != chunk.lines, "writeChunk did not update the lines pointer");
+    INVAR (129 == chunk.lineCount, "writeChunk did not add one run per line");
 
     for (int i = 0; i < 256; ++i)
         INVAR ((0xAA ^ i) == chunk.code[i], "writeChunk did not write the data");
     INVAR (OP_RETURN == chunk.code[256], "writeChunk did not write the data");
 
     for (int i = 0; i < 256; ++i)
-        INVAR ((123 + i) == chunk.lines[i], "writeChunk did not write the line");
-    INVAR (1337 == chunk.lines[256], "writeChunk did not write the line");
+        INVAR ((123 + i / 2) == getLine (&chunk, i), "writeChunk did not write the line");
+    INVAR (1337 == getLine (&chunk, 256), "writeChunk did not write the line");
 
     INVAR (0 == addConstant (&chunk, NUMBER_VAL (1.5)), "first constant is at offset zero");
     INVAR (1.5 == AS_NUMBER (chunk.constants.values[0]), "verify first constant stored");
@@ -43,10 +48,51 @@ bistChunk ()
     INVAR (1 == addConstant (&chunk, NUMBER_VAL (3.5)), "second constant is at offset one");
     INVAR (3.5 == AS_NUMBER (chunk.constants.values[1]), "verify second constant stored");
 
+    INVAR (0 == addCallSite (&chunk), "first call site is at offset zero");
+    INVAR (1 == addCallSite (&chunk), "second call site is at offset one");
+    INVAR (NULL == chunk.calls[1].callee, "new call site must start empty");
+
+    packChunk (&chunk);
+    INVAR (chunk.isPacked, "packChunk did not mark the chunk packed");
+    INVAR (257 == chunk.capacity, "packChunk did not trim the capacity");
+    INVAR ((uint8_t *) (chunk.lines + 129) == chunk.code, "packChunk did not place the code after the lines");
+    INVAR ((0xAA ^ 7) == chunk.code[7] && OP_RETURN == chunk.code[256], "packChunk did not keep the code");
+    INVAR (126 == getLine (&chunk, 7) && 1337 == getLine (&chunk, 256), "packChunk did not keep the lines");
+    INVAR (3.5 == AS_NUMBER (chunk.constants.values[1]), "packChunk did not keep the constants");
+
     freeChunk (&chunk);
     INVAR (0 == chunk.count, "freeChunk did not clear the count");
     INVAR (0 == chunk.capacity, "freeChunk did not clear the capacity");
     INVAR (NULL == chunk.code, "freeChunk did not null the code pointer");
 
+    ObjFunction *function = newFunction ();
+
+    push (OBJ_VAL (function));          // so GC does not reap it
+    function->arity = 1;
+    addConstant (&function->chunk, NUMBER_VAL (1.0));
+    writeChunk (&function->chunk, OP_GET_LOCAL, 1);
+    writeChunk (&function->chunk, 1, 1);
+    writeChunk (&function->chunk, OP_CONSTANT, 1);
+    writeChunk (&function->chunk, 0, 1);
+    writeChunk (&function->chunk, OP_ADD, 1);
+    writeChunk (&function->chunk, OP_RETURN, 1);
+    INVAR (verifyFunction (function), "verifyFunction must accept a well formed function");
+    INVAR (4 == function->maxStack, "verifyFunction found maxStack %d, not 4", function->maxStack);
+
+    printf ("BIST: expect a VERIFY ERROR for a stack underflow:\n");
+    function->chunk.code[0] = OP_POP;
+    function->chunk.code[1] = OP_POP;
+    function->chunk.code[2] = OP_POP;
+    INVAR (!verifyFunction (function), "verifyFunction must reject a stack underflow");
+
+    printf ("BIST: expect a VERIFY ERROR for a jump into an instruction:\n");
+    function->chunk.code[0] = OP_JUMP;
+    function->chunk.code[1] = 0;
+    function->chunk.code[2] = 1;
+    function->chunk.code[3] = OP_CONSTANT;
+    function->chunk.code[4] = 0;
+    INVAR (!verifyFunction (function), "verifyFunction must reject a jump into an instruction");
+    pop ();
+
     printf ("BIST: %s ... done.\n", "bistChunk");
 }
@@ -1,11 +1,15 @@
+#define _POSIX_C_SOURCE 200809L        // for flockfile
+
 #include "compiler.h"
 
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
 #include "memory.h"
+#include "options.h"
 #include "scanner.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +22,8 @@
 int _DEBUG_PRINT_CODE = 1;
 #endif
 
+extern Options options;         // --lazy asks for lazy function bodies
+
 /** Parser state */
 struct Parser {
     Token current;              ///< the current token to parse
@@ -56,6 +62,7 @@ struct Local {
     Token name;                 ///< name of the local variable
     int depth;                  ///< scope depth of block defining it
     bool isCaptured;            ///< as an Upvalue
+    bool isAssigned;            ///< assigned after its declaration
 };
 
 /** Upvalues
@@ -63,6 +70,35 @@ struct Local {
 struct Upvalue {
     uint8_t index;              ///< index into locals or upvalues
     bool isLocal;               ///< still resident in locals?
+    Token name;                 ///< name of the captured variable
+};
+
+/** Forward jump too far for a two byte operand
+ *
+ * The jump is widened by widenJumps once the function is complete.
+ */
+struct LongJump {
+    int offset;                 ///< where the jump operand is in the chunk
+    int target;                 ///< where the jump goes in the chunk
+};
+
+/** What type inference knows of one stack slot
+ *
+ * A value read from a local keeps the slot it was copied from,
+ * so a check that passes on the copy also tells about the local.
+ */
+struct SlotType {
+    bool isNumber;              ///< the value is known to be a number
+    bool isCaptured;            ///< a closure may assign the local at any time
+    int copyOf;                 ///< slot this is an unchanged copy of, or -1
+};
+
+/** Stack of SlotType, as type inference walks the code
+ */
+struct TypeStack {
+    SlotType *slots;            ///< one for each value on the stack
+    int depth;                  ///< number of values on the stack
+    int capacity;               ///< allocated size of the slots array
 };
 
 /** Enumerated Function Types
@@ -80,10 +116,19 @@ struct Compiler {
     Compiler *enclosing;        ///< compiler for enclosing scope
     ObjFunction *function;      ///< current function being compiled
     FunctionType type;          ///< type of function being compiled
-    Local locals[UINT8_COUNT];  ///< storage for local variables
+    Local *locals;              ///< storage for local variables
     int localCount;             ///< number of local variables in scope
+    int localCapacity;          ///< allocated size of the locals array
     Upvalue upvalues[UINT8_COUNT];      ///< array of upvalues
     int scopeDepth;             ///< number of blocks surrounding current code
+    int *captures;              ///< offsets of OP_CLOSURE operands capturing locals
+    int captureCount;           ///< number of captures not yet settled
+    int captureCapacity;        ///< allocated size of the captures array
+    LongJump *longJumps;        ///< forward jumps to widen
+    int longJumpCount;          ///< number of forward jumps to widen
+    int longJumpCapacity;       ///< allocated size of the longJumps array
+    int *constantSlots;         ///< hash of the constant pool: 1 + index of a constant, or 0
+    int constantSlotCapacity;   ///< allocated size of constantSlots, a power of two
 };
 
 /** Open "class" compiler with link for stacking */
@@ -92,9 +137,63 @@ struct ClassCompiler {
     bool hasSuperclass;         ///< class is a subclass
 };
 
-Parser parser;                  ///< Storage for the parser state.
-Compiler *current = NULL;       ///< the current compiler state
-ClassCompiler *currentClass = NULL;     ///< stack of open "class" compilations
+/** Function body kept as text until it is first called
+ *
+ * The closure made for a lazy function must capture the same
+ * variables as if the body had been compiled, so the body is
+ * scanned for names when it is skipped, and those that resolve
+ * outside the function become its upvalues. Compiling the body
+ * later finds them again by name.
+ */
+struct LazyBody {
+    char *source;               ///< the parameters and body, from "(" to "}"
+    int length;                 ///< length of the source
+    int line;                   ///< line the source starts on
+    FunctionType type;          ///< kind of function
+    bool inClass;               ///< declared inside a class body
+    bool hasSuperclass;         ///< ... of a class that has a superclass
+    Token *upvalueNames;        ///< name of each upvalue, pointing into the source
+};
+
+/** Files being compiled by compileAll
+ */
+struct CompilePool {
+    const char **sources;       ///< the source text of each file
+    ObjFunction **functions;    ///< where to put the script compiled from each
+    int count;                  ///< number of files
+    int next;                   ///< first file no thread has taken yet
+    pthread_mutex_t lock;       ///< held while taking a file
+};
+
+/** State of a compilation set aside while another one runs
+ *
+ * Compiling on the same thread while a compile is in progress,
+ * such as a lazy body or a module, would overwrite the state of
+ * the one in progress. Each entry point saves that state here,
+ * on its own stack, and puts it back when it is done. The GC
+ * finds the functions of compilations set aside through these.
+ */
+struct SuspendedCompile {
+    SuspendedCompile *enclosing;        ///< compilation set aside before this one
+    Scanner scanner;            ///< where its scanner had got to
+    Parser parser;              ///< its parser state
+    Compiler *current;          ///< its innermost function compiler
+    ClassCompiler *currentClass;        ///< its innermost class compiler
+#ifdef  REGISTER_BYTECODE
+    int operandStart;           ///< its left operand being compiled
+#endif
+};
+
+// Each thread compiling has a parser and compiler of its own.
+THREAD_LOCAL Parser parser;     ///< Storage for the parser state.
+THREAD_LOCAL Compiler *current = NULL;  ///< the current compiler state
+THREAD_LOCAL ClassCompiler *currentClass = NULL;        ///< stack of open "class" compilations
+static THREAD_LOCAL SuspendedCompile *suspended = NULL; ///< compilations set aside, innermost first
+
+#ifdef  REGISTER_BYTECODE
+/** Where the left operand of the infix rule being compiled begins. */
+static THREAD_LOCAL int operandStart;
+#endif
 
 /* Forward Declarations */
 
@@ -131,6 +230,7 @@ errorAt (Token *token, const char *message)
     if (parser.panicMode)
         return;
     parser.panicMode = true;
+    flockfile (stderr);                 // keep the lines of each thread whole
     fprintf (stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -142,6 +242,7 @@ errorAt (Token *token, const char *message)
     }
 
     fprintf (stderr, ": %s\n", message);
+    funlockfile (stderr);
     parser.hadError = true;
 }
 
@@ -269,15 +370,21 @@ emitBytes (uint8_t byte1, uint8_t byte2)
 static void
 emitLoop (int loopStart)
 {
-    emitByte (OP_LOOP);
+    int offset = currentChunk ()->count - loopStart + 3;
 
-    int offset = currentChunk ()->count - loopStart + 2;
+    if (offset <= UINT16_MAX) {
+        emitByte (OP_LOOP);
+        emitBytes ((offset >> 8) & 0xff, offset & 0xff);
+        return;
+    }
 
-    if (offset > UINT16_MAX)
+    offset++;
+    if (offset > LONG_OPERAND_MAX)
         error ("Loop body twoo large.");
 
-    emitByte ((offset >> 8) & 0xff);
-    emitByte (offset & 0xff);
+    emitByte (OP_LOOP_LONG);
+    emitByte ((offset >> 16) & 0xff);
+    emitBytes ((offset >> 8) & 0xff, offset & 0xff);
 }
 
 /** Emit a JUMP instruction into the chunk.
@@ -308,41 +415,163 @@ emitReturn ()
     emitByte (OP_RETURN);
 }
 
+/** Emit an operation with a constant or slot operand.
+ *
+ * The short form takes a one byte operand. The long form, with a
+ * three byte operand, is only used when the operand needs it.
+ *
+ * @param instruction the short form of the operation
+ * @param longInstruction the long form of the operation
+ * @param operand the constant or slot index
+ */
+static void
+emitOperand (OpCode instruction, OpCode longInstruction, int operand)
+{
+    if (operand <= UINT8_MAX) {
+        emitBytes (instruction, (uint8_t) operand);
+        return;
+    }
+    emitByte (longInstruction);
+    emitByte ((operand >> 16) & 0xff);
+    emitBytes ((operand >> 8) & 0xff, operand & 0xff);
+}
+
+/** Hash a constant, for finding it in the constant pool.
+ *
+ * @param value the constant
+ * @returns a hash of its type and its bits
+ */
+static uint32_t
+hashConstant (Value value)
+{
+    uint64_t bits = value.type;
+
+    if (IS_NUMBER (value)) {
+        double number = AS_NUMBER (value);
+
+        memcpy (&bits, &number, sizeof bits);
+    } else if (IS_OBJ (value)) {
+        bits = (uintptr_t) AS_OBJ (value);
+    } else if (IS_BOOL (value)) {
+        bits = AS_BOOL (value);
+    }
+    bits = (bits ^ value.type) * 0x9E3779B97F4A7C15u;
+    return (uint32_t) (bits >> 32);
+}
+
+/** See if two constants are the same.
+ *
+ * Numbers are compared by their bits, so that -0 and 0 are kept
+ * apart; objects by identity, as the compiler interns strings.
+ *
+ * @param a 1st constant to compare
+ * @param b 2nd constant to compare
+ * @returns true if one may stand for the other
+ */
+static bool
+sameConstant (Value a, Value b)
+{
+    if (a.type != b.type)
+        return false;
+    if (IS_NUMBER (a)) {
+        double x = AS_NUMBER (a);
+        double y = AS_NUMBER (b);
+
+        return 0 == memcmp (&x, &y, sizeof x);
+    }
+    if (IS_OBJ (a))
+        return AS_OBJ (a) == AS_OBJ (b);
+    return !IS_BOOL (a) || AS_BOOL (a) == AS_BOOL (b);
+}
+
+/** Find the slot of a constant in the hash of the constant pool.
+ *
+ * @param value the constant
+ * @returns its slot, or the empty slot to put it in
+ */
+static int *
+constantSlot (Value value)
+{
+    Value *constants = currentChunk ()->constants.values;
+    uint32_t mask = (uint32_t) current->constantSlotCapacity - 1;
+
+    for (uint32_t i = hashConstant (value) & mask;; i = (i + 1) & mask) {
+        int *slot = &current->constantSlots[i];
+
+        if (0 == *slot || sameConstant (constants[*slot - 1], value))
+            return slot;
+    }
+}
+
 /** Add a CONSTANT to the bytecode stream
  *
- * This function inserts the constant into the pool then write the
- * constant pool index into the chunk.
+ * This function finds the constant in the pool, or inserts it,
+ * and returns the constant pool index to write into the chunk.
+ * Each distinct constant is in the pool once.
  *
  * @param value the value of the constant
  * @returns the resulting offset into the constant pool
  */
-static uint8_t
+static int
 makeConstant (Value value)
 {
+    ValueArray *constants = &currentChunk ()->constants;
+
+    if (constants->count + 1 > current->constantSlotCapacity * 3 / 4) {
+        int oldCapacity = current->constantSlotCapacity;
+
+        current->constantSlotCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        FREE_ARRAY (int, current->constantSlots, oldCapacity);
+        lockHeap ();
+        push (value);                   // protect from GC sweep
+        current->constantSlots = ALLOCATE (int, current->constantSlotCapacity);
+        pop ();
+        unlockHeap ();
+        memset (current->constantSlots, 0, sizeof (int) * current->constantSlotCapacity);
+        for (int i = 0; i < constants->count; i++) {
+            int *slot = constantSlot (constants->values[i]);
+
+            if (0 == *slot)
+                *slot = i + 1;
+        }
+    }
+
+    int *slot = constantSlot (value);
+
+    if (0 != *slot)
+        return *slot - 1;
+
+    if (current->function->obj.isPermanent)
+        rememberValue (value);
     int constant = addConstant (currentChunk (), value);
 
-    if (constant > UINT8_MAX) {
+    if (constant > LONG_OPERAND_MAX) {
         error ("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t) constant;
+    *slot = constant + 1;
+    return constant;
 }
 
 /** Construct a CONSTANT operation in the chunk.
  *
  * Emits OP_CONSTANT, then an immediate byte picking
- * the constant out of the constant pool.
+ * the constant out of the constant pool; or OP_CONSTANT_LONG
+ * with three bytes, once the pool outgrows one byte.
  *
  * @param value
  */
 static void
 emitConstant (Value value)
 {
-    emitBytes (OP_CONSTANT, makeConstant (value));
+    emitOperand (OP_CONSTANT, OP_CONSTANT_LONG, makeConstant (value));
 }
 
 /** Patch a jump offset.
+ *
+ * A jump too far for its two byte operand is kept in longJumps,
+ * to be widened once the function is complete; see widenJumps.
  *
  * @param offset position of the jump immediate to patch
  */
@@ -353,37 +582,80 @@ patchJump (int offset)
     int jump = currentChunk ()->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error ("Too much code to jump over.");
+        if (current->longJumpCapacity < current->longJumpCount + 1) {
+            int oldCapacity = current->longJumpCapacity;
+
+            current->longJumpCapacity = GROW_CAPACITY (oldCapacity);
+            current->longJumps = GROW_ARRAY (LongJump, current->longJumps, oldCapacity, current->longJumpCapacity);
+        }
+        current->longJumps[current->longJumpCount].offset = offset;
+        current->longJumps[current->longJumpCount].target = currentChunk ()->count;
+        current->longJumpCount++;
+        return;
     }
 
     currentChunk ()->code[offset] = (jump >> 8) & 0xFF;
     currentChunk ()->code[offset + 1] = jump & 0xFF;
 }
 
+/** Claim the next local slot of the current compiler.
+ *
+ * @returns the new local, or NULL if there are too many
+ */
+static Local *
+nextLocal ()
+{
+    if (current->localCount == UINT16_COUNT) {
+        error ("Too many local variables in function.");
+        return NULL;
+    }
+    if (current->localCapacity < current->localCount + 1) {
+        int oldCapacity = current->localCapacity;
+
+        current->localCapacity = GROW_CAPACITY (oldCapacity);
+        current->locals = GROW_ARRAY (Local, current->locals, oldCapacity, current->localCapacity);
+    }
+    return &current->locals[current->localCount++];
+}
+
 /** Initialize the state of the compiler
  *
  * @param compiler the pointer to the compiler state structure to initialize
  * @param type whether this is a Function or a Script compilation
+ * @param function the lazy function to compile into, or NULL for a new one
  */
 static void
-initCompiler (Compiler *compiler, FunctionType type)
+initCompiler (Compiler *compiler, FunctionType type, ObjFunction *function)
 {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction ();
+    compiler->captures = NULL;
+    compiler->captureCount = 0;
+    compiler->captureCapacity = 0;
+    compiler->longJumps = NULL;
+    compiler->longJumpCount = 0;
+    compiler->longJumpCapacity = 0;
+    compiler->constantSlots = NULL;
+    compiler->constantSlotCapacity = 0;
+    compiler->function = function != NULL ? function : newFunction ();
     current = compiler;
 
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && function == NULL) {
         current->function->name = copyString (parser.previous.start, parser.previous.length);
+        if (current->function->obj.isPermanent)
+            rememberValue (OBJ_VAL (current->function->name));
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = nextLocal ();
 
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
 
     // BOOK BUG? I think the code from the book ends up giving
     // us a "this" in TYPE_SCRIPT which is wrong?
@@ -396,6 +668,767 @@ initCompiler (Compiler *compiler, FunctionType type)
     }
 }
 
+/** Record a capture of a local by an OP_CLOSURE.
+ *
+ * Whether the closure can take a copy of the local is only known
+ * once the scope of the local ends, so the offset of the operand
+ * is kept until then; see settleCaptures.
+ *
+ * @param offset where the CaptureKind operand is in the chunk
+ */
+static void
+recordCapture (int offset)
+{
+    if (current->captureCapacity < current->captureCount + 1) {
+        int oldCapacity = current->captureCapacity;
+
+        current->captureCapacity = GROW_CAPACITY (oldCapacity);
+        current->captures = GROW_ARRAY (int, current->captures, oldCapacity, current->captureCapacity);
+    }
+    current->captures[current->captureCount++] = offset;
+}
+
+/** Decide how closures capture a local that goes out of scope.
+ *
+ * A captured local that is never assigned after its declaration
+ * holds the same value for its whole life, so closures can take a
+ * copy of it instead of sharing it through an open upvalue.
+ *
+ * @param slot index of the local in the current compiler
+ */
+static void
+settleCaptures (int slot)
+{
+    Local *local = &current->locals[slot];
+    uint8_t *code = currentChunk ()->code;
+    int kept = 0;
+
+    for (int i = 0; i < current->captureCount; i++) {
+        int offset = current->captures[i];
+
+        if (code[offset + 1] != slot) {
+            current->captures[kept++] = offset;
+        } else if (!local->isAssigned) {
+            code[offset] = CAPTURE_COPY;
+        }
+    }
+    current->captureCount = kept;
+}
+
+/** Find the long form of a jump.
+ *
+ * @param instruction the jump
+ * @returns the long form, or the jump itself if it is already long
+ */
+static OpCode
+longJumpOf (OpCode instruction)
+{
+    switch (instruction) {
+        // *INDENT-OFF*
+    case OP_JUMP:                       return OP_JUMP_LONG;
+    case OP_JUMP_IF_FALSE:              return OP_JUMP_IF_FALSE_LONG;
+    case OP_LOOP:                       return OP_LOOP_LONG;
+    case OP_COMPARE_LOCALS_JUMP:        return OP_COMPARE_LOCALS_JUMP_LONG;
+    case OP_COMPARE_CONSTANT_JUMP:      return OP_COMPARE_CONSTANT_JUMP_LONG;
+    default:                            return instruction;
+        // *INDENT-ON*
+    }
+}
+
+/** See if a jump has a three byte operand.
+ *
+ * @param instruction the jump
+ * @returns true for the long form of a jump
+ */
+static bool
+isLongJump (OpCode instruction)
+{
+    return instruction == OP_JUMP_LONG || instruction == OP_JUMP_IF_FALSE_LONG || instruction == OP_LOOP_LONG || instruction == OP_COMPARE_LOCALS_JUMP_LONG || instruction == OP_COMPARE_CONSTANT_JUMP_LONG;
+}
+
+/** Set the distance of a jump from the end of its instruction.
+ *
+ * @param chunk where to find the bytecode stream
+ * @param offset where the instruction starts
+ * @param distance the signed distance to the jump target
+ */
+static void
+setJumpDistance (Chunk *chunk, int offset, int distance)
+{
+    uint8_t *code = chunk->code + offset;
+    int length = opcodeLength ((OpCode) code[0]);
+    int jump = code[0] == OP_LOOP || code[0] == OP_LOOP_LONG ? -distance : distance;
+
+    if (isLongJump ((OpCode) code[0])) {
+        code[length - 3] = (jump >> 16) & 0xff;
+    }
+    code[length - 2] = (jump >> 8) & 0xff;
+    code[length - 1] = jump & 0xff;
+}
+
+/** Widen the jumps that are too far for a two byte operand.
+ *
+ * The forward jumps that patchJump could not fit are rewritten to
+ * their long form. Each takes one more byte, which moves the code
+ * after it, so other jumps are then measured again, until no more
+ * need widening. Every jump is then pointed at the new offset of
+ * its target.
+ *
+ * @param chunk the finished chunk of a function
+ */
+static void
+widenJumps (Chunk *chunk)
+{
+    if (current->longJumpCount == 0)
+        return;
+
+    int count = chunk->count;
+    int *target = ALLOCATE (int, count + 1);
+    int *pending = ALLOCATE (int, count + 1);
+    bool *isWide = ALLOCATE (bool, count + 1);
+    int *newOffset = ALLOCATE (int, count + 1);
+
+    for (int r = 0; r <= count; r++) {
+        target[r] = pending[r] = -1;
+        isWide[r] = false;
+    }
+    for (int i = 0; i < current->longJumpCount; i++)
+        pending[current->longJumps[i].offset] = current->longJumps[i].target;
+
+    for (int r = 0; r < count; r += instructionLength (chunk, r)) {
+        int length = instructionLength (chunk, r);
+        int distance;
+
+        if (!jumpDistance (chunk, r, &distance))
+            continue;
+        isWide[r] = isLongJump ((OpCode) chunk->code[r]);
+        target[r] = r + length + distance;
+        if (!isWide[r] && pending[r + length - 2] >= 0) {
+            isWide[r] = true;
+            target[r] = pending[r + length - 2];
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        int w = 0;
+
+        for (int r = 0; r < count; r += instructionLength (chunk, r)) {
+            newOffset[r] = w;
+            w += instructionLength (chunk, r) + (isWide[r] && !isLongJump ((OpCode) chunk->code[r]));
+        }
+        newOffset[count] = w;
+
+        changed = false;
+        for (int r = 0; r < count; r += instructionLength (chunk, r)) {
+            if (target[r] < 0 || isWide[r])
+                continue;
+
+            int distance = newOffset[target[r]] - (newOffset[r] + instructionLength (chunk, r));
+
+            if (distance > UINT16_MAX || -distance > UINT16_MAX) {
+                isWide[r] = true;
+                changed = true;
+            }
+        }
+    }
+
+    int newCount = newOffset[count];
+    uint8_t *code = ALLOCATE (uint8_t, newCount);
+    Chunk old = *chunk;
+
+    // the line runs are made again, as the offsets move.
+    chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+
+    // a widened jump keeps the operands before its jump operand,
+    // which is then written by setJumpDistance.
+    for (int r = 0; r < count; r += instructionLength (&old, r)) {
+        int length = instructionLength (&old, r);
+        int w = newOffset[r];
+
+        memcpy (code + w, old.code + r, length);
+        addLine (chunk, w, getLine (&old, r));
+        if (isWide[r] && !isLongJump ((OpCode) old.code[r]))
+            code[w] = longJumpOf ((OpCode) old.code[r]);
+    }
+
+    FREE_ARRAY (uint8_t, old.code, old.capacity);
+    FREE_ARRAY (LineStart, old.lines, old.lineCapacity);
+    chunk->code = code;
+    chunk->count = chunk->capacity = newCount;
+
+    for (int r = 0; r < count; r++) {
+        if (target[r] < 0)
+            continue;
+
+        int w = newOffset[r];
+        int distance = newOffset[target[r]] - (w + instructionLength (chunk, w));
+
+        if (distance > LONG_OPERAND_MAX || -distance > LONG_OPERAND_MAX)
+            error ("Too much code to jump over.");
+        setJumpDistance (chunk, w, distance);
+    }
+
+    FREE_ARRAY (int, newOffset, count + 1);
+    FREE_ARRAY (bool, isWide, count + 1);
+    FREE_ARRAY (int, pending, count + 1);
+    FREE_ARRAY (int, target, count + 1);
+}
+
+/** Push a value of known type for type inference.
+ *
+ * @param stack the types on the stack
+ * @param isNumber true if the value is known to be a number
+ * @param copyOf slot the value was copied from, or -1
+ */
+static void
+pushType (TypeStack *stack, bool isNumber, int copyOf)
+{
+    if (stack->depth == stack->capacity) {
+        int oldCapacity = stack->capacity;
+
+        stack->capacity = GROW_CAPACITY (oldCapacity);
+        stack->slots = GROW_ARRAY (SlotType, stack->slots, oldCapacity, stack->capacity);
+    }
+    stack->slots[stack->depth++] = (SlotType) {
+    isNumber, false, copyOf};
+}
+
+/** Forget that values on the stack are copies of a slot.
+ *
+ * @param stack the types on the stack
+ * @param slot the slot whose value changes
+ */
+static void
+forgetCopies (TypeStack *stack, int slot)
+{
+    for (int i = 0; i < stack->depth; i++) {
+        if (stack->slots[i].copyOf == slot)
+            stack->slots[i].copyOf = -1;
+    }
+}
+
+/** Learn that a value passed a number check.
+ *
+ * The local it was copied from, and every other copy of that
+ * local, is then a number too, unless a closure could change it.
+ *
+ * @param stack the types on the stack
+ * @param index which stack slot holds the value
+ */
+static void
+learnNumber (TypeStack *stack, int index)
+{
+    SlotType *value = &stack->slots[index];
+    int local = value->copyOf >= 0 ? value->copyOf : index;
+
+    if (!value->isCaptured)
+        value->isNumber = true;
+    if (stack->slots[local].isCaptured)
+        return;
+    stack->slots[local].isNumber = true;
+    for (int i = 0; i < stack->depth; i++) {
+        if (stack->slots[i].copyOf == local)
+            stack->slots[i].isNumber = true;
+    }
+}
+
+/** Apply one instruction to the types on the stack.
+ *
+ * Values from globals, upvalues, properties and calls are never
+ * known; closures can only change the locals they capture.
+ *
+ * @param chunk where to find the bytecode stream
+ * @param offset where the instruction starts
+ * @param stack the types on the stack, updated
+ */
+static void
+inferInstruction (Chunk *chunk, int offset, TypeStack *stack)
+{
+    uint8_t *code = chunk->code + offset;
+    OpCode instruction = (OpCode) code[0];
+    SlotType *top = &stack->slots[stack->depth - 1];
+
+    // The compiler will inform us if an OpCode value is
+    // not in the switch, as long as we remember,
+    //     DO NOT ADD A "default:" CASE.
+
+    switch (instruction) {
+
+    case OP_CONSTANT:
+        pushType (stack, IS_NUMBER (chunk->constants.values[code[1]]), -1);
+        break;
+
+    case OP_CONSTANT_LONG:
+        pushType (stack, IS_NUMBER (chunk->constants.values[LONG_OPERAND (code + 1)]), -1);
+        break;
+
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:{
+            int slot = instruction == OP_GET_LOCAL ? code[1] : LONG_OPERAND (code + 1);
+            SlotType *local = &stack->slots[slot];
+
+            pushType (stack, local->isNumber, local->isCaptured ? -1 : slot);
+            break;
+        }
+
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:{
+            int slot = instruction == OP_SET_LOCAL ? code[1] : LONG_OPERAND (code + 1);
+            SlotType *local = &stack->slots[slot];
+
+            forgetCopies (stack, slot);
+            local->isNumber = top->isNumber && !local->isCaptured;
+            local->copyOf = -1;
+            if (!local->isCaptured)
+                top->copyOf = slot;
+            break;
+        }
+
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVALUE:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_IMPORT:
+    case OP_IMPORT_LONG:
+        pushType (stack, false, -1);
+        break;
+
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:{
+            int constant = instruction == OP_CLOSURE ? code[1] : LONG_OPERAND (code + 1);
+            ObjFunction *function = AS_FUNCTION (chunk->constants.values[constant]);
+            uint8_t *capture = code + opcodeLength (instruction);
+
+            for (int i = 0; i < function->upvalueCount; i++, capture += 2) {
+                if (capture[0] == CAPTURE_LOCAL) {
+                    forgetCopies (stack, capture[1]);
+                    stack->slots[capture[1]].isCaptured = true;
+                    stack->slots[capture[1]].isNumber = false;
+                }
+            }
+            pushType (stack, false, -1);
+            break;
+        }
+
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+        stack->depth--;
+        break;
+
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_SET_UPVALUE:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+        break;
+
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+    case OP_NOT:
+        *top = (SlotType) {
+        false, false, -1};
+        break;
+
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_EQUAL:
+        stack->depth--;
+        stack->slots[stack->depth - 1] = (SlotType) {
+        false, false, -1};
+        break;
+
+    case OP_ADD:
+    case OP_ADD_NUMBER:{
+            bool isNumber = top[-1].isNumber && top[0].isNumber;
+
+            stack->depth--;
+            top[-1] = (SlotType) {
+            isNumber, false, -1};
+            break;
+        }
+
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_SUBTRACT_NUMBER:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE_NUMBER:
+    case OP_GREATER_NUMBER:
+    case OP_LESS_NUMBER:{
+            bool isCompare = instruction == OP_GREATER || instruction == OP_LESS || instruction == OP_GREATER_NUMBER || instruction == OP_LESS_NUMBER;
+
+            learnNumber (stack, stack->depth - 2);
+            learnNumber (stack, stack->depth - 1);
+            stack->depth--;
+            top[-1] = (SlotType) {
+            !isCompare, false, -1};
+            break;
+        }
+
+    case OP_NEGATE:
+    case OP_NEGATE_NUMBER:
+        learnNumber (stack, stack->depth - 1);
+        *top = (SlotType) {
+        true, false, -1};
+        break;
+
+    case OP_COMPARE_LOCALS_JUMP:
+    case OP_COMPARE_LOCALS_JUMP_LONG:
+        learnNumber (stack, code[2]);
+        learnNumber (stack, code[3]);
+        break;
+
+    case OP_COMPARE_CONSTANT_JUMP:
+    case OP_COMPARE_CONSTANT_JUMP_LONG:
+        learnNumber (stack, code[2]);
+        break;
+
+    case OP_ADD_CONSTANT_LOCAL:
+        learnNumber (stack, code[1]);
+        forgetCopies (stack, code[1]);
+        break;
+
+    case OP_ADD_R:
+    case OP_SUBTRACT_R:
+    case OP_MULTIPLY_R:
+    case OP_DIVIDE_R:
+    case OP_EQUAL_R:
+    case OP_GREATER_R:
+    case OP_LESS_R:{
+            bool isNumber = instruction == OP_SUBTRACT_R || instruction == OP_MULTIPLY_R || instruction == OP_DIVIDE_R;
+
+            if (code[1] & REG_STORE) {
+                SlotType *local = &stack->slots[code[4]];
+
+                forgetCopies (stack, code[4]);
+                local->isNumber = isNumber && !local->isCaptured;
+                local->copyOf = -1;
+            } else {
+                pushType (stack, isNumber, -1);
+            }
+            break;
+        }
+
+    case OP_CALL:
+        stack->depth -= code[1];
+        stack->slots[stack->depth - 1] = (SlotType) {
+        false, false, -1};
+        break;
+
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:{
+            int argCount = code[opcodeLength (instruction) - 1];
+
+            stack->depth -= argCount + (instruction == OP_INVOKE || instruction == OP_INVOKE_LONG ? 0 : 1);
+            stack->slots[stack->depth - 1] = (SlotType) {
+            false, false, -1};
+            break;
+        }
+
+        // *INDENT-OFF*
+
+#define SUPER_PAIR_INFER(name, a, b)    case name:
+#define SUPER_TRIPLE_INFER(name, a, b, c) case name:
+    SUPER_PAIRS (SUPER_PAIR_INFER)
+    SUPER_TRIPLES (SUPER_TRIPLE_INFER)
+#undef  SUPER_TRIPLE_INFER
+#undef  SUPER_PAIR_INFER
+        UNREACHABLE ("types are inferred before superinstructions are fused");
+
+        // *INDENT-ON*
+    }
+}
+
+/** Merge the types flowing into an instruction.
+ *
+ * @param into what is known so far where the paths meet
+ * @param from what is known along another path
+ * @param depth number of values on the stack
+ * @returns true if less is known than before
+ */
+static bool
+mergeTypes (SlotType *into, const SlotType *from, int depth)
+{
+    bool changed = false;
+
+    for (int i = 0; i < depth; i++) {
+        SlotType merged = {
+            into[i].isNumber && from[i].isNumber,
+            into[i].isCaptured || from[i].isCaptured,
+            into[i].copyOf == from[i].copyOf ? into[i].copyOf : -1
+        };
+
+        if (merged.isNumber != into[i].isNumber || merged.isCaptured != into[i].isCaptured || merged.copyOf != into[i].copyOf)
+            changed = true;
+        into[i] = merged;
+    }
+    return changed;
+}
+
+/** Use the unchecked forms of operations on proven numbers.
+ *
+ * The types on the stack are followed along every path through
+ * the code, until they settle at each instruction. Parameters
+ * and anything that comes from a global, an upvalue, a property
+ * or a call is never known, so numbers come from constants and
+ * arithmetic, and from values that passed a number check.
+ *
+ * @param function the finished function, before superinstructions
+ */
+static void
+inferNumbers (ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+    SlotType **types = ALLOCATE (SlotType *, count + 1);
+    int *depths = ALLOCATE (int, count + 1);
+    int *pending = ALLOCATE (int, count + 1);
+    bool *isPending = ALLOCATE (bool, count + 1);
+    int pendingCount = 0;
+    TypeStack stack = { NULL, 0, 0 };
+
+    memset (types, 0, sizeof (SlotType *) * (count + 1));
+    memset (isPending, 0, sizeof (bool) * (count + 1));
+
+    for (int i = 0; i <= function->arity; i++)
+        pushType (&stack, false, -1);
+    depths[0] = stack.depth;
+    types[0] = ALLOCATE (SlotType, stack.depth);
+    memcpy (types[0], stack.slots, sizeof (SlotType) * stack.depth);
+    pending[pendingCount++] = 0;
+    isPending[0] = true;
+
+    while (pendingCount > 0) {
+        int offset = pending[--pendingCount];
+        OpCode instruction = (OpCode) chunk->code[offset];
+        int next = offset + instructionLength (chunk, offset);
+        int successors[2];
+        int successorCount = 0;
+        int distance;
+
+        isPending[offset] = false;
+        stack.depth = 0;
+        for (int i = 0; i < depths[offset]; i++)
+            pushType (&stack, false, -1);
+        memcpy (stack.slots, types[offset], sizeof (SlotType) * depths[offset]);
+        inferInstruction (chunk, offset, &stack);
+
+        if (jumpDistance (chunk, offset, &distance))
+            successors[successorCount++] = next + distance;
+        if (instruction != OP_RETURN && instruction != OP_JUMP && instruction != OP_JUMP_LONG && instruction != OP_LOOP && instruction != OP_LOOP_LONG)
+            successors[successorCount++] = next;
+
+        for (int i = 0; i < successorCount; i++) {
+            int target = successors[i];
+            bool changed = true;
+
+            if (NULL == types[target]) {
+                depths[target] = stack.depth;
+                types[target] = ALLOCATE (SlotType, stack.depth);
+                memcpy (types[target], stack.slots, sizeof (SlotType) * stack.depth);
+            } else {
+                INVAR (depths[target] == stack.depth, "stack depths disagree at offset %d", target);
+                changed = mergeTypes (types[target], stack.slots, stack.depth);
+            }
+            if (changed && !isPending[target]) {
+                pending[pendingCount++] = target;
+                isPending[target] = true;
+            }
+        }
+    }
+
+    for (int offset = 0; offset < count; offset += instructionLength (chunk, offset)) {
+        SlotType *top = NULL == types[offset] ? NULL : types[offset] + depths[offset] - 1;
+        uint8_t *code = chunk->code + offset;
+
+        if (NULL == top)
+            continue;
+
+        bool isBinary = depths[offset] >= 2 && top[-1].isNumber && top[0].isNumber;
+
+        // *INDENT-OFF*
+        switch (*code) {
+        case OP_ADD:      if (isBinary) *code = OP_ADD_NUMBER;      break;
+        case OP_SUBTRACT: if (isBinary) *code = OP_SUBTRACT_NUMBER; break;
+        case OP_MULTIPLY: if (isBinary) *code = OP_MULTIPLY_NUMBER; break;
+        case OP_DIVIDE:   if (isBinary) *code = OP_DIVIDE_NUMBER;   break;
+        case OP_GREATER:  if (isBinary) *code = OP_GREATER_NUMBER;  break;
+        case OP_LESS:     if (isBinary) *code = OP_LESS_NUMBER;     break;
+        case OP_NEGATE:   if (top[0].isNumber) *code = OP_NEGATE_NUMBER; break;
+        }
+        // *INDENT-ON*
+    }
+
+    for (int offset = 0; offset <= count; offset++) {
+        if (NULL != types[offset])
+            FREE_ARRAY (SlotType, types[offset], depths[offset]);
+    }
+    FREE_ARRAY (SlotType, stack.slots, stack.capacity);
+    FREE_ARRAY (bool, isPending, count + 1);
+    FREE_ARRAY (int, pending, count + 1);
+    FREE_ARRAY (int, depths, count + 1);
+    FREE_ARRAY (SlotType *, types, count + 1);
+}
+
+#if SUPER_COUNT > 0
+
+/** Superinstructions from superinstructions.h, longest first.
+ */
+static const struct {
+    OpCode super;               ///< the superinstruction
+    int count;                  ///< number of operations it fuses
+    OpCode ops[3];              ///< the operations it fuses
+} superinstructions[] = {
+#define SUPER_TRIPLE_ENTRY(name, a, b, c) { name, 3, { a, b, c } },
+#define SUPER_PAIR_ENTRY(name, a, b) { name, 2, { a, b } },
+    SUPER_TRIPLES (SUPER_TRIPLE_ENTRY)
+    SUPER_PAIRS (SUPER_PAIR_ENTRY)
+#undef  SUPER_PAIR_ENTRY
+#undef  SUPER_TRIPLE_ENTRY
+};
+
+/** Find a superinstruction for the code at an offset.
+ *
+ * Only the first of the fused operations may be a jump target,
+ * as a jump can not land inside a superinstruction.
+ *
+ * @param chunk where to find the bytecode stream
+ * @param offset where the first operation starts
+ * @param isTarget marks the offsets that jumps go to
+ * @returns the index into superinstructions, or -1
+ */
+static int
+matchSuperinstruction (Chunk *chunk, int offset, const bool *isTarget)
+{
+    int entries = (int) (sizeof superinstructions / sizeof superinstructions[0]);
+
+    for (int i = 0; i < entries; i++) {
+        int at = offset;
+        int k;
+
+        for (k = 0; k < superinstructions[i].count; k++) {
+            if (at >= chunk->count || chunk->code[at] != superinstructions[i].ops[k] || (k > 0 && isTarget[at]))
+                break;
+            at += opcodeLength (superinstructions[i].ops[k]);
+        }
+        if (k == superinstructions[i].count)
+            return i;
+    }
+    return -1;
+}
+
+#endif
+
+/** Rewrite sequences in a chunk into superinstructions.
+ *
+ * A superinstruction is its own opcode followed by the operands
+ * of each operation it fuses. The code shrinks, so every jump is
+ * then pointed at the new offset of its target.
+ *
+ * A build with DEBUG_PROFILE_OPCODES leaves the code alone,
+ * so the profile sees the plain operations.
+ *
+ * @param chunk the finished chunk of a function
+ */
+static void
+fuseSuperinstructions (Chunk *chunk)
+{
+#if SUPER_COUNT > 0 && !defined(DEBUG_PROFILE_OPCODES)
+    int count = chunk->count;
+    uint8_t *code = chunk->code;
+    Chunk old = *chunk;
+    bool *isTarget = ALLOCATE (bool, count + 1);
+    int *newOffset = ALLOCATE (int, count + 1);
+    int *oldOffset = ALLOCATE (int, count + 1);
+
+    memset (isTarget, 0, sizeof (bool) * (count + 1));
+    for (int r = 0; r < count; r += instructionLength (chunk, r)) {
+        int distance;
+
+        if (jumpDistance (chunk, r, &distance))
+            isTarget[r + instructionLength (chunk, r) + distance] = true;
+    }
+
+    int w = 0;
+
+    // the line runs are made again, as the offsets move; the
+    // operands of each fused instruction keep its line.
+    chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+
+    for (int r = 0; r < count;) {
+        int match = matchSuperinstruction (chunk, r, isTarget);
+
+        newOffset[r] = w;
+        oldOffset[w] = r;
+        addLine (chunk, w, getLine (&old, r));
+        if (match < 0) {
+            int length = instructionLength (chunk, r);
+
+            memmove (code + w, code + r, length);
+            w += length;
+            r += length;
+            continue;
+        }
+
+        code[w] = superinstructions[match].super;
+        w++;
+        for (int k = 0; k < superinstructions[match].count; k++) {
+            int operands = opcodeLength (superinstructions[match].ops[k]) - 1;
+
+            if (operands > 0)
+                addLine (chunk, w, getLine (&old, r));
+            memmove (code + w, code + r + 1, operands);
+            w += operands;
+            r += operands + 1;
+        }
+    }
+    newOffset[count] = w;
+    chunk->count = w;
+    FREE_ARRAY (LineStart, old.lines, old.lineCapacity);
+
+    // jumps are not fused, so each keeps its length,
+    // and the distance still holds from its old offset.
+    for (int n = 0; n < w; n += instructionLength (chunk, n)) {
+        int length = instructionLength (chunk, n);
+        int distance;
+
+        if (jumpDistance (chunk, n, &distance))
+            setJumpDistance (chunk, n, newOffset[oldOffset[n] + length + distance] - (n + length));
+    }
+
+    FREE_ARRAY (int, oldOffset, count + 1);
+    FREE_ARRAY (int, newOffset, count + 1);
+    FREE_ARRAY (bool, isTarget, count + 1);
+#else
+    (void) chunk;
+#endif
+}
+
 /** Shut down the compiler.
  *
  * @returns the Function object created by compilation.
@@ -406,12 +1439,32 @@ endCompiler ()
     emitReturn ();
     ObjFunction *function = current->function;
 
+    for (int slot = current->localCount - 1; slot >= 0; slot--) {
+        if (current->locals[slot].isCaptured)
+            settleCaptures (slot);
+    }
+    FREE_ARRAY (int, current->captures, current->captureCapacity);
+    FREE_ARRAY (Local, current->locals, current->localCapacity);
+
+    FREE_ARRAY (int, current->constantSlots, current->constantSlotCapacity);
+    widenJumps (currentChunk ());
+    FREE_ARRAY (LongJump, current->longJumps, current->longJumpCapacity);
+    if (!parser.hadError)
+        inferNumbers (function);
+    fuseSuperinstructions (currentChunk ());
+
 #ifdef DEBUG_PRINT_CODE
     if (_DEBUG_PRINT_CODE && !parser.hadError) {
         disassembleChunk (currentChunk (), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
 
+    // a failure here is a bug in the compiler, not in the program.
+    if (!parser.hadError) {
+        INVAR (verifyFunction (function), "compiled bad bytecode for %s", function->name != NULL ? function->name->chars : "<script>");
+        packChunk (currentChunk ());
+    }
+
     current = current->enclosing;
     return function;
 }
@@ -431,7 +1484,12 @@ endScope ()
 {
     current->scopeDepth--;
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+        Local *local = &current->locals[current->localCount - 1];
+
+        if (local->isCaptured) {
+            settleCaptures (current->localCount - 1);
+        }
+        if (local->isCaptured && local->isAssigned) {
             emitByte (OP_CLOSE_UPVALUE);
         } else {
             emitByte (OP_POP);
@@ -447,7 +1505,7 @@ endScope ()
  * @param name the token containing the name
  * @returns the index into the table for the variable
  */
-static uint8_t
+static int
 identifierConstant (Token *name)
 {
     return makeConstant (OBJ_VAL (copyString (name->start, name->length)));
@@ -496,10 +1554,11 @@ resolveLocal (Compiler *compiler, Token *name)
  * @param compiler the current compiler state
  * @param index index into the locals
  * @param isLocal true if the upvalue is still in the locals
+ * @param name the name of the captured variable
  * @returns the index into the upvalue array
  */
 static int
-addUpvalue (Compiler *compiler, uint8_t index, bool isLocal)
+addUpvalue (Compiler *compiler, uint8_t index, bool isLocal, Token *name)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -518,6 +1577,7 @@ addUpvalue (Compiler *compiler, uint8_t index, bool isLocal)
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].name = *name;
     return compiler->function->upvalueCount++;
 }
 
@@ -531,20 +1591,31 @@ addUpvalue (Compiler *compiler, uint8_t index, bool isLocal)
 static int
 resolveUpvalue (Compiler *compiler, Token *name)
 {
-    if (compiler->enclosing == NULL)
+    // a lazy body has no enclosing compiler, only the names of
+    // the upvalues found when it was skipped.
+    if (compiler->enclosing == NULL) {
+        for (int i = compiler->function->upvalueCount - 1; i >= 0; i--) {
+            if (identifiersEqual (name, &compiler->upvalues[i].name))
+                return i;
+        }
         return -1;
+    }
 
     int local = resolveLocal (compiler->enclosing, name);
 
+    if (local > UINT8_MAX) {
+        error ("Can't capture a local variable past the first 256.");
+        return -1;
+    }
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue (compiler, (uint8_t) local, true);
+        return addUpvalue (compiler, (uint8_t) local, true, name);
     }
 
     int upvalue = resolveUpvalue (compiler->enclosing, name);
 
     if (upvalue != -1) {
-        return addUpvalue (compiler, (uint8_t) upvalue, false);
+        return addUpvalue (compiler, (uint8_t) upvalue, false, name);
     }
 
     return -1;
@@ -557,15 +1628,15 @@ resolveUpvalue (Compiler *compiler, Token *name)
 static void
 addLocal (Token name)
 {
-    if (current->localCount == UINT8_COUNT) {
-        error ("Too many local variables in function.");
+    Local *local = nextLocal ();
+
+    if (local == NULL)
         return;
-    }
-    Local *local = &current->locals[current->localCount++];
 
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isAssigned = false;
 }
 
 /** Compile a local variable declaration.
@@ -598,7 +1669,7 @@ declareVariable ()
  * @returns zero if we are inside a scope
  * @returns otherwise, the index into the constant table
  */
-static uint8_t
+static int
 parseVariable (const char *errorMessage)
 {
     consume (TOKEN_IDENTIFIER, errorMessage);
@@ -626,13 +1697,13 @@ markInitialized ()
  * @param global index of the global
  */
 static void
-defineVariable (uint8_t global)
+defineVariable (int global)
 {
     if (current->scopeDepth > 0) {
         markInitialized ();
         return;
     }
-    emitBytes (OP_DEFINE_GLOBAL, global);
+    emitOperand (OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 /** Compile a function call argument list.
@@ -673,6 +1744,83 @@ and_ (bool canAssign)
     patchJump (endJump);
 }
 
+#ifdef  REGISTER_BYTECODE
+
+/** Fetch the register operand for code that loads a single value.
+ *
+ * @param start where the code of the operand begins
+ * @param length length of the code of the operand
+ * @param mode mode bit set for the operand if it is a constant
+ * @param[out] modes the mode to update
+ * @param[out] operand the slot or constant index
+ * @returns true if the code is a lone OP_GET_LOCAL or OP_CONSTANT
+ */
+static bool
+registerOperand (int start, int length, RegisterMode mode, int *modes, uint8_t *operand)
+{
+    uint8_t *code = currentChunk ()->code + start;
+
+    if (length != 2 || (code[0] != OP_GET_LOCAL && code[0] != OP_CONSTANT))
+        return false;
+    if (code[0] == OP_CONSTANT)
+        *modes |= mode;
+    *operand = code[1];
+    return true;
+}
+
+/** Compile a binary operation on locals and constants to a register instruction.
+ *
+ * The operands have already been compiled to stack code, which is
+ * replaced when both are a lone local or constant.
+ *
+ * @param operatorType the binary operator
+ * @param leftStart where the code of the left operand begins
+ * @param rightStart where the code of the right operand begins
+ * @returns true if a register instruction was emitted
+ */
+static bool
+registerBinary (TokenType operatorType, int leftStart, int rightStart)
+{
+    int end = currentChunk ()->count;
+    int mode = 0;
+    uint8_t a;
+    uint8_t b;
+
+    if (!registerOperand (leftStart, rightStart - leftStart, REG_A_CONSTANT, &mode, &a) || !registerOperand (rightStart, end - rightStart, REG_B_CONSTANT, &mode, &b))
+        return false;
+
+    OpCode instruction;
+    bool negate = false;
+
+    switch (operatorType) {
+        // *INDENT-OFF*
+
+    case TOKEN_BANG_EQUAL:     instruction = OP_EQUAL_R;    negate = true;  break;
+    case TOKEN_EQUAL_EQUAL:    instruction = OP_EQUAL_R;                    break;
+    case TOKEN_GREATER:        instruction = OP_GREATER_R;                  break;
+    case TOKEN_GREATER_EQUAL:  instruction = OP_LESS_R;     negate = true;  break;
+    case TOKEN_LESS:           instruction = OP_LESS_R;                     break;
+    case TOKEN_LESS_EQUAL:     instruction = OP_GREATER_R;  negate = true;  break;
+
+    case TOKEN_PLUS:           instruction = OP_ADD_R;                      break;
+    case TOKEN_MINUS:          instruction = OP_SUBTRACT_R;                 break;
+    case TOKEN_STAR:           instruction = OP_MULTIPLY_R;                 break;
+    case TOKEN_SLASH:          instruction = OP_DIVIDE_R;                   break;
+
+    default:                   return false;
+        // *INDENT-ON*
+    }
+
+    currentChunk ()->count = leftStart;
+    emitBytes (instruction, (uint8_t) mode);
+    emitBytes (a, b);
+    if (negate)
+        emitByte (OP_NOT);
+    return true;
+}
+
+#endif
+
 /** Compile a binary operation to the chunk.
  *
  * @param canAssign not used by this function
@@ -685,8 +1833,18 @@ binary (bool canAssign)
     TokenType operatorType = parser.previous.type;
     ParseRule *rule = getRule (operatorType);
 
+#ifdef  REGISTER_BYTECODE
+    int leftStart = operandStart;
+    int rightStart = currentChunk ()->count;
+#endif
+
     parsePrecedence ((Precedence) (rule->precedence + 1));
 
+#ifdef  REGISTER_BYTECODE
+    if (registerBinary (operatorType, leftStart, rightStart))
+        return;
+#endif
+
     switch (operatorType) {
         // *INDENT-OFF*
 
@@ -716,8 +1874,13 @@ call (bool canAssign)
 {
     (void) canAssign;                   // not used by this operation.
     uint8_t argCount = argumentList ();
+    int site = addCallSite (currentChunk ());
 
+    if (site > UINT16_MAX) {
+        error ("Too many calls in one chunk.");
+    }
     emitBytes (OP_CALL, argCount);
+    emitBytes ((site >> 8) & 0xff, site & 0xff);
 }
 
 /** Class instance field (get and set)
@@ -728,18 +1891,18 @@ static void
 dot (bool canAssign)
 {
     consume (TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant (&parser.previous);
+    int name = identifierConstant (&parser.previous);
 
     if (canAssign && match (TOKEN_EQUAL)) {
         expression ();
-        emitBytes (OP_SET_PROPERTY, name);
+        emitOperand (OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
     } else if (match (TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList ();
 
-        emitBytes (OP_INVOKE, name);
+        emitOperand (OP_INVOKE, OP_INVOKE_LONG, name);
         emitByte (argCount);
     } else {
-        emitBytes (OP_GET_PROPERTY, name);
+        emitOperand (OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
     }
 }
 
@@ -811,10 +1974,31 @@ or_ (bool canAssign)
  * @param canAssign not used by this function
  */
 static void
-string (bool canAssign)
+string (bool canAssign)
+{
+    (void) canAssign;                   // not used
+    emitConstant (OBJ_VAL (copyString (parser.previous.start + 1, parser.previous.length - 2)));
+}
+
+/** Note that the local behind an upvalue is assigned.
+ *
+ * @param compiler the compiler owning the upvalue
+ * @param index the index into the compiler upvalues
+ */
+static void
+markUpvalueAssigned (Compiler *compiler, int index)
 {
-    (void) canAssign;                   // not used
-    emitConstant (OBJ_VAL (copyString (parser.previous.start + 1, parser.previous.length - 2)));
+    Upvalue *upvalue = &compiler->upvalues[index];
+
+    // the upvalues of a lazy body were marked when it was skipped
+    if (compiler->enclosing == NULL)
+        return;
+
+    if (upvalue->isLocal) {
+        compiler->enclosing->locals[upvalue->index].isAssigned = true;
+    } else {
+        markUpvalueAssigned (compiler->enclosing, upvalue->index);
+    }
 }
 
 /** Do the work of putting a variable into the chunk.
@@ -825,26 +2009,35 @@ string (bool canAssign)
 static void
 namedVariable (Token name, bool canAssign)
 {
-    uint8_t getOp, setOp;
+    OpCode getOp, setOp, getLongOp, setLongOp;
     int arg = resolveLocal (current, &name);
 
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        getLongOp = OP_GET_LOCAL_LONG;
+        setLongOp = OP_SET_LOCAL_LONG;
     } else if ((arg = resolveUpvalue (current, &name)) != -1) {
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        getOp = getLongOp = OP_GET_UPVALUE;
+        setOp = setLongOp = OP_SET_UPVALUE;
     } else {
         arg = identifierConstant (&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setLongOp = OP_SET_GLOBAL_LONG;
     }
 
     if (canAssign && match (TOKEN_EQUAL)) {
         expression ();
-        emitBytes (setOp, (uint8_t) arg);
+        if (setOp == OP_SET_LOCAL) {
+            current->locals[arg].isAssigned = true;
+        } else if (setOp == OP_SET_UPVALUE) {
+            markUpvalueAssigned (current, arg);
+        }
+        emitOperand (setOp, setLongOp, arg);
     } else {
-        emitBytes (getOp, (uint8_t) arg);
+        emitOperand (getOp, getLongOp, arg);
     }
 }
 
@@ -890,18 +2083,18 @@ super_ (bool canAssign)
 
     consume (TOKEN_DOT, "Expect '.' after 'super'.");
     consume (TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant (&parser.previous);
+    int name = identifierConstant (&parser.previous);
 
     namedVariable (syntheticToken ("this"), false);
     if (match (TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList ();
 
         namedVariable (syntheticToken ("super"), false);
-        emitBytes (OP_SUPER_INVOKE, name);
+        emitOperand (OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         emitByte (argCount);
     } else {
         namedVariable (syntheticToken ("super"), false);
-        emitBytes (OP_GET_SUPER, name);
+        emitOperand (OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
@@ -1000,6 +2193,7 @@ ParseRule
     [TOKEN_FOR]            =  {  NULL,       NULL,     PREC_NONE        },   //  "for"
     [TOKEN_FUN]            =  {  NULL,       NULL,     PREC_NONE        },   //  "fun"
     [TOKEN_IF]             =  {  NULL,       NULL,     PREC_NONE        },   //  "if"
+    [TOKEN_IMPORT]         =  {  NULL,       NULL,     PREC_NONE        },   //  "import"
     [TOKEN_NIL]            =  {  literal,    NULL,     PREC_NONE        },   //  "nil"
     [TOKEN_OR]             =  {  NULL,       or_,      PREC_OR          },   //  "or"
     [TOKEN_PRINT]          =  {  NULL,       NULL,     PREC_NONE        },   //  "print"
@@ -1033,11 +2227,18 @@ parsePrecedence (Precedence precedence)
     }
     bool canAssign = precedence <= PREC_ASSIGNMENT;
 
+#ifdef  REGISTER_BYTECODE
+    int start = currentChunk ()->count;
+#endif
+
     prefixRule (canAssign);
     while (precedence <= getRule (parser.current.type)->precedence) {
         advance ();
         ParseFn infixRule = getRule (parser.previous.type)->infix;
 
+#ifdef  REGISTER_BYTECODE
+        operandStart = start;
+#endif
         infixRule (canAssign);
     }
     if (canAssign && match (TOKEN_EQUAL)) {
@@ -1075,18 +2276,11 @@ block ()
     consume (TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-/** Compile a function.
- *
- * @param type either FUNCTION or SCRIPT
+/** Compile the parameters and body of a function.
  */
 static void
-function (FunctionType type)
+functionBody ()
 {
-    Compiler compiler;
-
-    initCompiler (&compiler, type);
-    beginScope ();
-
     consume (TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
     if (!check (TOKEN_RIGHT_PAREN)) {
@@ -1095,7 +2289,7 @@ function (FunctionType type)
             if (current->function->arity > 255) {
                 errorAtCurrent ("Can't have more than 255 parameters.'");
             }
-            uint8_t constant = parseVariable ("Expect parameter name.");
+            int constant = parseVariable ("Expect parameter name.");
 
             defineVariable (constant);
         } while (match (TOKEN_COMMA));
@@ -1104,12 +2298,140 @@ function (FunctionType type)
     consume (TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume (TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block ();
+}
 
-    ObjFunction *function = endCompiler ();
+/** Capture a name used in a skipped function body.
+ *
+ * Any name that would resolve outside the function becomes an
+ * upvalue, even if the body turns out to declare its own, which
+ * only costs a capture the function never uses.
+ *
+ * @param name the name used
+ * @param isAssigned the name is followed by "="
+ */
+static void
+captureName (Token name, bool isAssigned)
+{
+    if (resolveLocal (current, &name) != -1)
+        return;
+
+    int upvalue = resolveUpvalue (current, &name);
+
+    if (upvalue != -1 && isAssigned)
+        markUpvalueAssigned (current, upvalue);
+}
+
+/** Skip the parameters and body of a function, to compile them later.
+ *
+ * The tokens are only matched up to the closing brace, and the
+ * names in them captured; see LazyBody.
+ *
+ * @param type the kind of function
+ * @returns the lazy function
+ */
+static ObjFunction *
+skipFunction (FunctionType type)
+{
+    const char *start = parser.current.start;
+    int line = parser.current.line;
+
+    consume (TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    while (!check (TOKEN_RIGHT_PAREN) && !check (TOKEN_EOF))
+        advance ();
+    consume (TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume (TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+    for (int depth = 1; depth > 0 && !parser.hadError;) {
+        if (check (TOKEN_EOF)) {
+            errorAtCurrent ("Expect '}' after block.");
+            break;
+        }
+
+        TokenType before = parser.previous.type;
+
+        advance ();
+        switch (parser.previous.type) {
+        case TOKEN_LEFT_BRACE:
+            depth++;
+            break;
+        case TOKEN_RIGHT_BRACE:
+            depth--;
+            break;
+        case TOKEN_IDENTIFIER:
+            // a property name is not a variable
+            if (before != TOKEN_DOT)
+                captureName (parser.previous, check (TOKEN_EQUAL));
+            break;
+        case TOKEN_SUPER:
+            captureName (syntheticToken ("super"), false);
+            captureName (syntheticToken ("this"), false);
+            break;
+        case TOKEN_THIS:
+            captureName (syntheticToken ("this"), false);
+            break;
+        default:
+            break;
+        }
+    }
+
+    ObjFunction *function = current->function;
+    LazyBody *lazy = ALLOCATE (LazyBody, 1);
+    int length = (int) (parser.previous.start + parser.previous.length - start);
+
+    lazy->source = ALLOCATE (char, length + 1);
+    memcpy (lazy->source, start, length);
+    lazy->source[length] = '\0';
+    lazy->length = length;
+    lazy->line = line;
+    lazy->type = type;
+    lazy->inClass = currentClass != NULL;
+    lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+    lazy->upvalueNames = ALLOCATE (Token, function->upvalueCount);
+    for (int i = 0; i < function->upvalueCount; i++) {
+        Token name = current->upvalues[i].name;
+
+        // "this" and "super" are not in the source, but live forever
+        if (name.start >= start && name.start < start + length)
+            name.start = lazy->source + (name.start - start);
+        lazy->upvalueNames[i] = name;
+    }
+    function->lazy = lazy;
+
+    FREE_ARRAY (int, current->constantSlots, current->constantSlotCapacity);
+    FREE_ARRAY (Local, current->locals, current->localCapacity);
+    current = current->enclosing;
+    return function;
+}
+
+/** Compile a function.
+ *
+ * @param type either FUNCTION or SCRIPT
+ */
+static void
+function (FunctionType type)
+{
+    Compiler compiler;
+    ObjFunction *function;
+
+    initCompiler (&compiler, type, NULL);
+    beginScope ();
+
+    // images hold bytecode, so nothing is left out of one
+    if (options.lazy && NULL == options.compileTo && !options.cacheModules) {
+        function = skipFunction (type);
+    } else {
+        functionBody ();
+        function = endCompiler ();
+    }
 
-    emitBytes (OP_CLOSURE, makeConstant (OBJ_VAL (function)));
+    emitOperand (OP_CLOSURE, OP_CLOSURE_LONG, makeConstant (OBJ_VAL (function)));
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte (compiler.upvalues[i].isLocal ? 1 : 0);
+        if (compiler.upvalues[i].isLocal) {
+            recordCapture (currentChunk ()->count);
+            emitByte (CAPTURE_LOCAL);
+        } else {
+            emitByte (CAPTURE_UPVALUE);
+        }
         emitByte (compiler.upvalues[i].index);
     }
 }
@@ -1120,7 +2442,7 @@ static void
 method ()
 {
     consume (TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant (&parser.previous);
+    int constant = identifierConstant (&parser.previous);
 
     FunctionType type = TYPE_METHOD;
 
@@ -1130,7 +2452,7 @@ method ()
 
     function (type);
 
-    emitBytes (OP_METHOD, constant);
+    emitOperand (OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 /** Compile a class declaration
@@ -1140,11 +2462,11 @@ classDeclaration ()
 {
     consume (TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant (&parser.previous);
+    int nameConstant = identifierConstant (&parser.previous);
 
     declareVariable ();
 
-    emitBytes (OP_CLASS, nameConstant);
+    emitOperand (OP_CLASS, OP_CLASS_LONG, nameConstant);
     defineVariable (nameConstant);
 
     ClassCompiler classCompiler;
@@ -1190,7 +2512,7 @@ classDeclaration ()
 static void
 funDeclaration ()
 {
-    uint8_t global = parseVariable ("Excpect function name.");
+    int global = parseVariable ("Excpect function name.");
 
     markInitialized ();
     function (TYPE_FUNCTION);
@@ -1202,7 +2524,7 @@ funDeclaration ()
 static void
 varDeclaration ()
 {
-    uint8_t global = parseVariable ("Expect variable name.");
+    int global = parseVariable ("Expect variable name.");
 
     if (match (TOKEN_EQUAL)) {
         expression ();
@@ -1213,14 +2535,125 @@ varDeclaration ()
     defineVariable (global);
 }
 
+/** Fuse an expression that stores to a local.
+ *
+ * Used where the value of the expression is discarded, as the
+ * fused instruction leaves nothing on the stack. The expression
+ * "local = local + constant" becomes OP_ADD_CONSTANT_LOCAL, and a
+ * register instruction followed by OP_SET_LOCAL stores its result
+ * straight to the local.
+ *
+ * @param start where the code of the expression begins
+ * @returns true if the code was replaced by a fused instruction
+ */
+static bool
+fuseStore (int start)
+{
+    Chunk *chunk = currentChunk ();
+    uint8_t *code = chunk->code + start;
+
+    if (chunk->count - start == 6 && isRegisterOp (code[0]) && code[4] == OP_SET_LOCAL) {
+        uint8_t slot = code[5];
+
+        if (code[0] == OP_ADD_R && code[1] == REG_B_CONSTANT && code[2] == slot && IS_NUMBER (chunk->constants.values[code[3]])) {
+            uint8_t constant = code[3];
+
+            chunk->count = start;
+            emitByte (OP_ADD_CONSTANT_LOCAL);
+            emitBytes (slot, constant);
+        } else {
+            code[1] |= REG_STORE;
+            code[4] = slot;
+            chunk->count--;
+        }
+        return true;
+    }
+    if (chunk->count - start != 7 || code[0] != OP_GET_LOCAL || code[2] != OP_CONSTANT || code[4] != OP_ADD || code[5] != OP_SET_LOCAL || code[6] != code[1])
+        return false;
+    if (!IS_NUMBER (chunk->constants.values[code[3]]))
+        return false;
+
+    uint8_t slot = code[1];
+    uint8_t constant = code[3];
+
+    chunk->count = start;
+    emitByte (OP_ADD_CONSTANT_LOCAL);
+    emitBytes (slot, constant);
+    return true;
+}
+
+/** Compile a condition and the jump taken when it is false.
+ *
+ * A condition that compares a local with another local or with a
+ * constant is fused with the jump. The fused jump reads its operands
+ * in place, so neither path has a condition to pop.
+ *
+ * @param popCondition set true if both paths must pop the condition
+ * @returns offset of the jump operand, for patchJump
+ */
+static int
+conditionJump (bool *popCondition)
+{
+    int start = currentChunk ()->count;
+
+    expression ();
+
+    uint8_t *code = currentChunk ()->code + start;
+    int length = currentChunk ()->count - start;
+    int test = -1;
+    uint8_t instruction = OP_COMPARE_LOCALS_JUMP;
+
+    if (length == 5 && code[4] == OP_LESS) {
+        test = TEST_NOT_LESS;
+    } else if (length == 5 && code[4] == OP_GREATER) {
+        test = TEST_NOT_GREATER;
+    } else if (length == 6 && code[4] == OP_GREATER && code[5] == OP_NOT) {
+        test = TEST_GREATER;
+    } else if (length == 6 && code[4] == OP_LESS && code[5] == OP_NOT) {
+        test = TEST_LESS;
+    }
+
+    if (test >= 0 && code[0] == OP_GET_LOCAL && (code[2] == OP_GET_LOCAL || code[2] == OP_CONSTANT)) {
+        instruction = code[2] == OP_GET_LOCAL ? OP_COMPARE_LOCALS_JUMP : OP_COMPARE_CONSTANT_JUMP;
+        code[2] = code[3];
+#ifdef  REGISTER_BYTECODE
+    } else if ((length == 4 || (length == 5 && code[4] == OP_NOT)) && (code[0] == OP_LESS_R || code[0] == OP_GREATER_R) && (code[1] == 0 || code[1] == REG_B_CONSTANT)) {
+        // the register form keeps its operands at code[2] and code[3]
+        if (code[0] == OP_LESS_R)
+            test = length == 4 ? TEST_NOT_LESS : TEST_LESS;
+        else
+            test = length == 4 ? TEST_NOT_GREATER : TEST_GREATER;
+        instruction = code[1] == 0 ? OP_COMPARE_LOCALS_JUMP : OP_COMPARE_CONSTANT_JUMP;
+        code[1] = code[2];
+        code[2] = code[3];
+#endif
+    } else {
+        *popCondition = true;
+        return emitJump (OP_JUMP_IF_FALSE);
+    }
+
+    uint8_t a = code[1];
+    uint8_t b = code[2];
+
+    currentChunk ()->count = start;
+    emitBytes (instruction, (uint8_t) test);
+    emitBytes (a, b);
+    emitBytes (0xff, 0xff);
+    *popCondition = false;
+    return currentChunk ()->count - 2;
+}
+
 /** Compile an expression statement to the chunk.
  */
 static void
 expressionStatement ()
 {
+    int start = currentChunk ()->count;
+
     expression ();
     consume (TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte (OP_POP);
+    if (!fuseStore (start))
+        emitByte (OP_POP);
 }
 
 /** Compile an "for" statement to the chunk.
@@ -1242,14 +2675,14 @@ forStatement ()
     int loopStart = currentChunk ()->count;
 
     int exitJump = -1;
+    bool popCondition = false;
 
     if (!match (TOKEN_SEMICOLON)) {
-        expression ();
-        consume (TOKEN_SEMICOLON, "Expect ';' after condition.");
-
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump (OP_JUMP_IF_FALSE);
-        emitByte (OP_POP);              // Condition
+        exitJump = conditionJump (&popCondition);
+        consume (TOKEN_SEMICOLON, "Expect ';' after condition.");
+        if (popCondition)
+            emitByte (OP_POP);          // Condition
     }
 
     if (!match (TOKEN_RIGHT_PAREN)) {
@@ -1257,7 +2690,8 @@ forStatement ()
         int incrementStart = currentChunk ()->count;
 
         expression ();
-        emitByte (OP_POP);
+        if (!fuseStore (incrementStart))
+            emitByte (OP_POP);
         consume (TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emitLoop (loopStart);
@@ -1270,7 +2704,8 @@ forStatement ()
 
     if (exitJump != -1) {
         patchJump (exitJump);
-        emitByte (OP_POP);              // Condition
+        if (popCondition)
+            emitByte (OP_POP);          // Condition
     }
 
     endScope ();
@@ -1282,23 +2717,42 @@ static void
 ifStatement ()
 {
     consume (TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression ();
-    consume (TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump (OP_JUMP_IF_FALSE);
+    bool popCondition;
+    int thenJump = conditionJump (&popCondition);
 
-    emitByte (OP_POP);
+    consume (TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    if (popCondition)
+        emitByte (OP_POP);
     statement ();
 
     int elseJump = emitJump (OP_JUMP);
 
     patchJump (thenJump);
-    emitByte (OP_POP);
+    if (popCondition)
+        emitByte (OP_POP);
     if (match (TOKEN_ELSE))
         statement ();
     patchJump (elseJump);
 }
 
+/** Compile an import statement.
+ *
+ * The path is taken from the directory clox runs in. A module runs
+ * the first time it is imported, and its globals are then there for
+ * every script; importing it again does nothing.
+ */
+static void
+importStatement ()
+{
+    consume (TOKEN_STRING, "Expect module path after 'import'.");
+    int path = makeConstant (OBJ_VAL (copyString (parser.previous.start + 1, parser.previous.length - 2)));
+
+    consume (TOKEN_SEMICOLON, "Expect ';' after module path.");
+    emitOperand (OP_IMPORT, OP_IMPORT_LONG, path);
+    emitByte (OP_POP);                  // what the module returned
+}
+
 /** Compile a print statement to the chunk.
  */
 static void
@@ -1338,18 +2792,20 @@ whileStatement ()
     int loopStart = currentChunk ()->count;
 
     consume (TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression ();
-    consume (TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump (OP_JUMP_IF_FALSE);
+    bool popCondition;
+    int exitJump = conditionJump (&popCondition);
 
-    emitByte (OP_POP);
+    consume (TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    if (popCondition)
+        emitByte (OP_POP);
     statement ();
 
     emitLoop (loopStart);
 
     patchJump (exitJump);
-    emitByte (OP_POP);
+    if (popCondition)
+        emitByte (OP_POP);
 }
 
 /** Synchronize the parser after an error
@@ -1357,7 +2813,7 @@ whileStatement ()
  * Skip forward until we are
  * - at EOF
  * - after a SEMICOLON
- * - before CLASS, FUN, VAR, FOR, IF, WHILE, PRINT, or RETURN
+ * - before CLASS, FUN, VAR, FOR, IF, IMPORT, WHILE, PRINT, or RETURN
  */
 static void
 synchronize ()
@@ -1375,6 +2831,7 @@ synchronize ()
         case TOKEN_VAR:
         case TOKEN_FOR:
         case TOKEN_IF:
+        case TOKEN_IMPORT:
         case TOKEN_WHILE:
         case TOKEN_PRINT:
         case TOKEN_RETURN:
@@ -1418,6 +2875,8 @@ statement ()
         forStatement ();
     } else if (match (TOKEN_IF)) {
         ifStatement ();
+    } else if (match (TOKEN_IMPORT)) {
+        importStatement ();
     } else if (match (TOKEN_RETURN)) {
         returnStatement ();
     } else if (match (TOKEN_WHILE)) {
@@ -1431,19 +2890,57 @@ statement ()
     }
 }
 
-/** Compile the source code into the chunk.
+/** Set aside the state of any compilation in progress.
+ *
+ * @param saved where to keep the state, until resumeCompile
+ */
+static void
+suspendCompile (SuspendedCompile *saved)
+{
+    saved->enclosing = suspended;
+    saved->scanner = saveScanner ();
+    saved->parser = parser;
+    saved->current = current;
+    saved->currentClass = currentClass;
+#ifdef  REGISTER_BYTECODE
+    saved->operandStart = operandStart;
+#endif
+    suspended = saved;
+    current = NULL;
+    currentClass = NULL;
+}
+
+/** Go back to the compilation set aside by suspendCompile.
+ *
+ * @param saved where the state was kept
+ */
+static void
+resumeCompile (SuspendedCompile *saved)
+{
+    suspended = saved->enclosing;
+    restoreScanner (saved->scanner);
+    parser = saved->parser;
+    current = saved->current;
+    currentClass = saved->currentClass;
+#ifdef  REGISTER_BYTECODE
+    operandStart = saved->operandStart;
+#endif
+}
+
+/** Compile a script into the region vm.allocPermanent selects.
  *
  * @param source pointer to a C string containing the source to compile
- * @returns true if all went well
- * @returns false if there was a parser error
+ * @returns the script, or NULL if there was a parser error
  */
-ObjFunction *
-compile (const char *source)
+static ObjFunction *
+compileScript (const char *source)
 {
-    initScanner (source);
+    SuspendedCompile saved;
     Compiler compiler;
 
-    initCompiler (&compiler, TYPE_SCRIPT);
+    suspendCompile (&saved);
+    initScanner (source);
+    initCompiler (&compiler, TYPE_SCRIPT, NULL);
     parser.hadError = false;
     parser.panicMode = false;
 
@@ -1453,8 +2950,200 @@ compile (const char *source)
     }
 
     ObjFunction *function = endCompiler ();
+    bool hadError = parser.hadError;
+
+    resumeCompile (&saved);
+    return hadError ? NULL : function;
+}
+
+/** Compile the source code into the chunk.
+ *
+ * Functions and strings made while compiling are placed in the
+ * garbage collected heap, so a script its caller drops, such as
+ * a line typed at the REPL, is reclaimed.
+ *
+ * @param source pointer to a C string containing the source to compile
+ * @returns the script, or NULL if there was a parser error
+ */
+ObjFunction *
+compile (const char *source)
+{
+    bool wasPermanent = vm.allocPermanent;
+
+    vm.allocPermanent = false;
+    ObjFunction *function = compileScript (source);
+
+    vm.allocPermanent = wasPermanent;
+    return function;
+}
+
+/** Compile the source code of a whole program.
+ *
+ * A program is loaded once and its code lives as long as the VM,
+ * so the functions and strings made while compiling are placed in
+ * the permanent region, where the GC does not trace or sweep them.
+ *
+ * @param source pointer to a C string containing the source to compile
+ * @returns the script, or NULL if there was a parser error
+ */
+ObjFunction *
+compileProgram (const char *source)
+{
+    bool wasPermanent = vm.allocPermanent;
+
+    vm.allocPermanent = true;
+    ObjFunction *function = compileScript (source);
 
-    return parser.hadError ? NULL : function;
+    vm.allocPermanent = wasPermanent;
+    return function;
+}
+
+/** Compile the files taken from the pool until none are left.
+ *
+ * @param arg the CompilePool shared by the threads
+ * @returns NULL
+ */
+static void *
+compileWorker (void *arg)
+{
+    CompilePool *pool = (CompilePool *) arg;
+
+    for (;;) {
+        pthread_mutex_lock (&pool->lock);
+        int file = pool->next++;
+
+        pthread_mutex_unlock (&pool->lock);
+
+        if (file >= pool->count)
+            return NULL;
+        pool->functions[file] = compileScript (pool->sources[file]);
+    }
+}
+
+/** Compile several independent programs on a pool of threads.
+ *
+ * The calling thread is one of the workers. While the others run,
+ * the heap is shared (see shareHeap), so the GC waits until all the
+ * files are compiled. The disassembly is not printed, as the
+ * threads would interleave it.
+ *
+ * @param sources the source text of each file
+ * @param functions where to put the script for each file, or NULL
+ * if the file did not compile
+ * @param count number of files
+ * @param jobs number of threads to compile on
+ */
+void
+compileAll (const char **sources, ObjFunction **functions, int count, int jobs)
+{
+    if (jobs > count)
+        jobs = count;
+    if (jobs <= 1) {
+        for (int i = 0; i < count; i++)
+            functions[i] = compileProgram (sources[i]);
+        return;
+    }
+
+    CompilePool pool;
+
+    pool.sources = sources;
+    pool.functions = functions;
+    pool.count = count;
+    pool.next = 0;
+    pthread_mutex_init (&pool.lock, NULL);
+
+#ifdef DEBUG_PRINT_CODE
+    int printCode = _DEBUG_PRINT_CODE;
+
+    _DEBUG_PRINT_CODE = 0;
+#endif
+
+    bool wasPermanent = vm.allocPermanent;
+    pthread_t threads[jobs - 1];
+    int started = 0;
+
+    vm.allocPermanent = true;
+    shareHeap (true);
+    while (started < jobs - 1 && 0 == pthread_create (&threads[started], NULL, compileWorker, &pool))
+        started++;
+    compileWorker (&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join (threads[i], NULL);
+    shareHeap (false);
+    vm.allocPermanent = wasPermanent;
+
+#ifdef DEBUG_PRINT_CODE
+    _DEBUG_PRINT_CODE = printCode;
+#endif
+    pthread_mutex_destroy (&pool.lock);
+}
+
+/** Compile the body of a lazy function, on its first call.
+ *
+ * The function object is filled in where it is, as closures
+ * already refer to it, and what the body makes goes in the same
+ * region as the function. If the body does not compile, it is
+ * kept so that the next call fails the same way.
+ *
+ * @param function the function, whose lazy body is consumed
+ * @returns true if all went well
+ * @returns false if there was a parser error
+ */
+bool
+compileLazy (ObjFunction *function)
+{
+    LazyBody *lazy = function->lazy;
+    bool wasPermanent = vm.allocPermanent;
+    SuspendedCompile saved;
+    ClassCompiler classCompiler;
+    Compiler compiler;
+
+    suspendCompile (&saved);
+    vm.allocPermanent = function->obj.isPermanent;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = lazy->hasSuperclass;
+    currentClass = lazy->inClass ? &classCompiler : NULL;
+    initScannerAt (lazy->source, lazy->line);
+
+    initCompiler (&compiler, lazy->type, function);
+    for (int i = 0; i < function->upvalueCount; i++)
+        compiler.upvalues[i].name = lazy->upvalueNames[i];
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    advance ();
+    beginScope ();
+    functionBody ();
+    endCompiler ();
+
+    bool hadError = parser.hadError;
+
+    resumeCompile (&saved);
+    vm.allocPermanent = wasPermanent;
+
+    if (hadError) {
+        freeChunk (&function->chunk);
+        function->arity = 0;
+        return false;
+    }
+
+    freeLazyBody (function);
+    return true;
+}
+
+/** Release the text of a lazy function body.
+ *
+ * @param function the function, compiled or being freed
+ */
+void
+freeLazyBody (ObjFunction *function)
+{
+    LazyBody *lazy = function->lazy;
+
+    FREE_ARRAY (char, lazy->source, lazy->length + 1);
+    FREE_ARRAY (Token, lazy->upvalueNames, function->upvalueCount);
+    FREE (LazyBody, lazy);
+    function->lazy = NULL;
 }
 
 /** Mark all compiler roots as reachable.
@@ -1462,10 +3151,9 @@ compile (const char *source)
 void
 markCompilerRoots ()
 {
-    Compiler *compiler = current;
-
-    while (compiler != NULL) {
+    for (Compiler * compiler = current; compiler != NULL; compiler = compiler->enclosing)
         markObject ((Obj *) compiler->function);
-        compiler = compiler->enclosing;
-    }
+    for (SuspendedCompile * saved = suspended; saved != NULL; saved = saved->enclosing)
+        for (Compiler * compiler = saved->current; compiler != NULL; compiler = compiler->enclosing)
+            markObject ((Obj *) compiler->function);
 }
@@ -64,6 +64,7 @@ tokenTypeString (TokenType type)
     case TOKEN_FOR:                     return "TOKEN_FOR";
     case TOKEN_FUN:                     return "TOKEN_FUN";
     case TOKEN_IF:                      return "TOKEN_IF";
+    case TOKEN_IMPORT:                  return "TOKEN_IMPORT";
     case TOKEN_NIL:                     return "TOKEN_NIL";
     case TOKEN_OR:                      return "TOKEN_OR";
     case TOKEN_PRINT:                   return "TOKEN_PRINT";
@@ -86,6 +87,120 @@ tokenTypeString (TokenType type)
     return ttStaticName;
 }
 
+/** Convert OpCode enum value into string.
+ *
+ * If the provided value is not an OpCode value, return a name
+ * formatted in a static buffer, which will be overwritten on the next
+ * call that needs it.
+ *
+ * @param instruction value from the OpCode enumeration
+ * @returns the name of the opcode, if it is in the enumeration.
+ * @returns a static buffer with a synthesized opcode string, otherwise.
+ */
+const char *
+opcodeString (OpCode instruction)
+{
+
+    // The compiler will inform us if an OpCode value is
+    // not in the switch, as long as we remember,
+    //     DO NOT ADD A "default:" CASE.
+
+    switch (instruction) {
+
+        // *INDENT-OFF*
+
+    case OP_CONSTANT:                   return "OP_CONSTANT";
+    case OP_CONSTANT_LONG:              return "OP_CONSTANT_LONG";
+    case OP_NIL:                        return "OP_NIL";
+    case OP_TRUE:                       return "OP_TRUE";
+    case OP_FALSE:                      return "OP_FALSE";
+    case OP_POP:                        return "OP_POP";
+    case OP_GET_LOCAL:                  return "OP_GET_LOCAL";
+    case OP_SET_LOCAL:                  return "OP_SET_LOCAL";
+    case OP_GET_LOCAL_LONG:             return "OP_GET_LOCAL_LONG";
+    case OP_SET_LOCAL_LONG:             return "OP_SET_LOCAL_LONG";
+    case OP_GET_GLOBAL:                 return "OP_GET_GLOBAL";
+    case OP_DEFINE_GLOBAL:              return "OP_DEFINE_GLOBAL";
+    case OP_SET_GLOBAL:                 return "OP_SET_GLOBAL";
+    case OP_GET_GLOBAL_LONG:            return "OP_GET_GLOBAL_LONG";
+    case OP_DEFINE_GLOBAL_LONG:         return "OP_DEFINE_GLOBAL_LONG";
+    case OP_SET_GLOBAL_LONG:            return "OP_SET_GLOBAL_LONG";
+    case OP_GET_UPVALUE:                return "OP_GET_UPVALUE";
+    case OP_SET_UPVALUE:                return "OP_SET_UPVALUE";
+    case OP_ADD:                        return "OP_ADD";
+    case OP_SUBTRACT:                   return "OP_SUBTRACT";
+    case OP_MULTIPLY:                   return "OP_MULTIPLY";
+    case OP_DIVIDE:                     return "OP_DIVIDE";
+    case OP_GET_PROPERTY:               return "OP_GET_PROPERTY";
+    case OP_SET_PROPERTY:               return "OP_SET_PROPERTY";
+    case OP_GET_PROPERTY_LONG:          return "OP_GET_PROPERTY_LONG";
+    case OP_SET_PROPERTY_LONG:          return "OP_SET_PROPERTY_LONG";
+    case OP_GET_SUPER:                  return "OP_GET_SUPER";
+    case OP_GET_SUPER_LONG:             return "OP_GET_SUPER_LONG";
+    case OP_EQUAL:                      return "OP_EQUAL";
+    case OP_GREATER:                    return "OP_GREATER";
+    case OP_LESS:                       return "OP_LESS";
+    case OP_NOT:                        return "OP_NOT";
+    case OP_NEGATE:                     return "OP_NEGATE";
+    case OP_ADD_NUMBER:                 return "OP_ADD_NUMBER";
+    case OP_SUBTRACT_NUMBER:            return "OP_SUBTRACT_NUMBER";
+    case OP_MULTIPLY_NUMBER:            return "OP_MULTIPLY_NUMBER";
+    case OP_DIVIDE_NUMBER:              return "OP_DIVIDE_NUMBER";
+    case OP_GREATER_NUMBER:             return "OP_GREATER_NUMBER";
+    case OP_LESS_NUMBER:                return "OP_LESS_NUMBER";
+    case OP_NEGATE_NUMBER:              return "OP_NEGATE_NUMBER";
+    case OP_PRINT:                      return "OP_PRINT";
+    case OP_JUMP:                       return "OP_JUMP";
+    case OP_JUMP_IF_FALSE:              return "OP_JUMP_IF_FALSE";
+    case OP_LOOP:                       return "OP_LOOP";
+    case OP_COMPARE_LOCALS_JUMP:        return "OP_COMPARE_LOCALS_JUMP";
+    case OP_COMPARE_CONSTANT_JUMP:      return "OP_COMPARE_CONSTANT_JUMP";
+    case OP_JUMP_LONG:                  return "OP_JUMP_LONG";
+    case OP_JUMP_IF_FALSE_LONG:         return "OP_JUMP_IF_FALSE_LONG";
+    case OP_LOOP_LONG:                  return "OP_LOOP_LONG";
+    case OP_COMPARE_LOCALS_JUMP_LONG:   return "OP_COMPARE_LOCALS_JUMP_LONG";
+    case OP_COMPARE_CONSTANT_JUMP_LONG: return "OP_COMPARE_CONSTANT_JUMP_LONG";
+    case OP_ADD_CONSTANT_LOCAL:         return "OP_ADD_CONSTANT_LOCAL";
+    case OP_ADD_R:                      return "OP_ADD_R";
+    case OP_SUBTRACT_R:                 return "OP_SUBTRACT_R";
+    case OP_MULTIPLY_R:                 return "OP_MULTIPLY_R";
+    case OP_DIVIDE_R:                   return "OP_DIVIDE_R";
+    case OP_EQUAL_R:                    return "OP_EQUAL_R";
+    case OP_GREATER_R:                  return "OP_GREATER_R";
+    case OP_LESS_R:                     return "OP_LESS_R";
+    case OP_CALL:                       return "OP_CALL";
+    case OP_INVOKE:                     return "OP_INVOKE";
+    case OP_SUPER_INVOKE:               return "OP_SUPER_INVOKE";
+    case OP_INVOKE_LONG:                return "OP_INVOKE_LONG";
+    case OP_SUPER_INVOKE_LONG:          return "OP_SUPER_INVOKE_LONG";
+    case OP_CLOSE_UPVALUE:              return "OP_CLOSE_UPVALUE";
+    case OP_RETURN:                     return "OP_RETURN";
+    case OP_CLASS:                      return "OP_CLASS";
+    case OP_CLASS_LONG:                 return "OP_CLASS_LONG";
+    case OP_INHERIT:                    return "OP_INHERIT";
+    case OP_METHOD:                     return "OP_METHOD";
+    case OP_METHOD_LONG:                return "OP_METHOD_LONG";
+    case OP_IMPORT:                     return "OP_IMPORT";
+    case OP_IMPORT_LONG:                return "OP_IMPORT_LONG";
+    case OP_CLOSURE:                    return "OP_CLOSURE";
+    case OP_CLOSURE_LONG:               return "OP_CLOSURE_LONG";
+
+#define SUPER_PAIR_NAME(name, a, b)     case name: return #name;
+#define SUPER_TRIPLE_NAME(name, a, b, c) case name: return #name;
+    SUPER_PAIRS (SUPER_PAIR_NAME)
+    SUPER_TRIPLES (SUPER_TRIPLE_NAME)
+#undef  SUPER_TRIPLE_NAME
+#undef  SUPER_PAIR_NAME
+
+        // *INDENT-ON*
+    }
+
+    static char opStaticName[32];
+
+    snprintf (opStaticName, sizeof opStaticName, "<OpCode=%d>", (int) instruction);
+    return opStaticName;
+}
+
 /** Print disassembly of a simple constant OpCode.
  *
  * @param name string representing the instruction
@@ -104,6 +219,24 @@ constantInstruction (const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+/** Print disassembly of a long constant OpCode.
+ *
+ * @param name string representing the instruction
+ * @param chunk that provided the instruction
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+constantLongInstruction (const char *name, Chunk *chunk, int offset)
+{
+    int constant = LONG_OPERAND (chunk->code + offset + 1);
+
+    printf ("%-16s %4d '", name, constant);
+    printValue (chunk->constants.values[constant]);
+    printf ("'\n");
+    return offset + 4;
+}
+
 /** Print disassembly of an INVOKE-style operation
  *
  * @param name string representing the instruction
@@ -123,6 +256,44 @@ invokeInstruction (const char *name, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+/** Print disassembly of a long INVOKE-style operation
+ *
+ * @param name string representing the instruction
+ * @param chunk that provided the instruction
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+invokeLongInstruction (const char *name, Chunk *chunk, int offset)
+{
+    int constant = LONG_OPERAND (chunk->code + offset + 1);
+    uint8_t argCount = chunk->code[offset + 4];
+
+    printf ("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue (chunk->constants.values[constant]);
+    printf ("'\n");
+    return offset + 5;
+}
+
+/** Print disassembly of a CALL operation
+ *
+ * @param name string representing the instruction
+ * @param chunk that provided the instruction
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+callInstruction (const char *name, Chunk *chunk, int offset)
+{
+    uint8_t argCount = chunk->code[offset + 1];
+    uint16_t site = (uint16_t) (chunk->code[offset + 2] << 8);
+
+    site |= (uint16_t) (chunk->code[offset + 3]);
+
+    printf ("%-16s (%d args) site %d\n", name, argCount, site);
+    return offset + 4;
+}
+
 /** Print disassembly of a simple instruction OpCode.
  *
  * @param name string representing the instruction
@@ -152,6 +323,20 @@ byteInstruction (const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+/** Print disassembly of a long slot OpCode.
+ *
+ * @param name string representing the instruction
+ * @param chunk where to find the bytecodes
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+longInstruction (const char *name, Chunk *chunk, int offset)
+{
+    printf ("%-16s %4d\n", name, LONG_OPERAND (chunk->code + offset + 1));
+    return offset + 4;
+}
+
 /** Print disassembly of a jump instruction OpCode.
  *
  * @param name string representing the instruction
@@ -171,6 +356,151 @@ jumpInstruction (const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+/** Print disassembly of a long jump instruction OpCode.
+ *
+ * @param name string representing the instruction
+ * @param sign direction (forward or backward)
+ * @param chunk where to find the bytecodes
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+jumpLongInstruction (const char *name, int sign, Chunk *chunk, int offset)
+{
+    int jump = LONG_OPERAND (chunk->code + offset + 1);
+
+    printf ("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+/** Print disassembly of a fused compare-and-jump OpCode.
+ *
+ * @param name string representing the instruction
+ * @param isConstant true if the second operand is a constant
+ * @param isLong true if the jump operand takes three bytes
+ * @param chunk where to find the bytecodes
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+compareJumpInstruction (const char *name, bool isConstant, bool isLong, Chunk *chunk, int offset)
+{
+    static const char *tests[] = {
+        [TEST_NOT_LESS] = "!<",
+        [TEST_NOT_GREATER] = "!>",
+        [TEST_LESS] = "<",
+        [TEST_GREATER] = ">",
+    };
+    uint8_t test = chunk->code[offset + 1];
+    uint8_t a = chunk->code[offset + 2];
+    uint8_t b = chunk->code[offset + 3];
+    int length = isLong ? 7 : 6;
+    int jump = isLong ? LONG_OPERAND (chunk->code + offset + 4) : (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+
+    printf ("%-16s %4d %-2s ", name, a, tests[test]);
+    if (isConstant) {
+        printf ("'");
+        printValue (chunk->constants.values[b]);
+        printf ("'");
+    } else {
+        printf ("%d", b);
+    }
+    printf (" -> %d\n", offset + length + jump);
+    return offset + length;
+}
+
+/** Print disassembly of an OP_ADD_CONSTANT_LOCAL.
+ *
+ * @param name string representing the instruction
+ * @param chunk where to find the bytecodes
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+addConstantInstruction (const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+
+    printf ("%-16s %4d += '", name, slot);
+    printValue (chunk->constants.values[constant]);
+    printf ("'\n");
+    return offset + 3;
+}
+
+/** Print one operand of a register instruction.
+ *
+ * @param chunk where to find the constants
+ * @param isConstant true if the operand indexes the constants
+ * @param operand the operand byte
+ */
+static void
+registerOperand (Chunk *chunk, bool isConstant, uint8_t operand)
+{
+    if (isConstant) {
+        printf ("'");
+        printValue (chunk->constants.values[operand]);
+        printf ("'");
+    } else {
+        printf ("[%d]", operand);
+    }
+}
+
+/** Print disassembly of a register instruction.
+ *
+ * Frame slots print as [slot], and constants in quotes.
+ *
+ * @param name string representing the instruction
+ * @param chunk where to find the bytecodes
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+registerInstruction (const char *name, Chunk *chunk, int offset)
+{
+    uint8_t mode = chunk->code[offset + 1];
+
+    printf ("%-16s ", name);
+    registerOperand (chunk, mode & REG_A_CONSTANT, chunk->code[offset + 2]);
+    printf (" ");
+    registerOperand (chunk, mode & REG_B_CONSTANT, chunk->code[offset + 3]);
+    if (mode & REG_STORE) {
+        printf (" -> [%d]\n", chunk->code[offset + 4]);
+        return offset + 5;
+    }
+    printf (" -> push\n");
+    return offset + 4;
+}
+
+static int printInstruction (OpCode instruction, Chunk *chunk, int offset);
+
+#if SUPER_COUNT > 0
+
+/** Print disassembly of a superinstruction.
+ *
+ * Each fused operation is printed on its own line, reading
+ * its operands from where they follow in the superinstruction.
+ *
+ * @param name string representing the instruction
+ * @param ops the operations fused by the superinstruction
+ * @param count the number of operations fused
+ * @param chunk where to find the bytecodes
+ * @param offset of the instruction bytecode in the chunk
+ * @returns offset of the next instruction in the chunk
+ */
+static int
+superInstruction (const char *name, const OpCode *ops, int count, Chunk *chunk, int offset)
+{
+    printf ("%s\n", name);
+    for (int i = 0; i < count; i++) {
+        printf ("%04d      + ", offset + 1);
+        offset = printInstruction (ops[i], chunk, offset) - 1;
+    }
+    return offset + 1;
+}
+
+#endif
+
 /** Disassemble one bytecode from a chunk.
  *
  * @param chunk where to find the bytecode stream
@@ -182,23 +512,41 @@ disassembleInstruction (Chunk *chunk, int offset)
 {
     printf ("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine (chunk, offset);
+
+    if (offset > 0 && line == getLine (chunk, offset - 1)) {
         printf ("   | ");
     } else {
-        printf ("%4d ", chunk->lines[offset]);
+        printf ("%4d ", line);
     }
 
-    uint8_t instruction = chunk->code[offset];
+    return printInstruction ((OpCode) chunk->code[offset], chunk, offset);
+}
+
+/** Print one instruction, without its offset and line.
+ *
+ * The operands are read from the bytes after the offset,
+ * which need not hold the instruction itself.
+ *
+ * @param instruction the OpCode to print
+ * @param chunk where to find the bytecode stream
+ * @param offset where in the chunk the instruction is
+ * @returns offset of next bytecode in this chunk
+ */
+static int
+printInstruction (OpCode instruction, Chunk *chunk, int offset)
+{
 
     // The compiler will inform us if an OpCode value is
     // not in the switch, as long as we remember,
     //     DO NOT ADD A "default:" CASE.
 
-    switch ((OpCode) instruction) {
+    switch (instruction) {
 
         // *INDENT-OFF*
 
     case OP_CONSTANT:                   return constantInstruction ("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:              return constantLongInstruction ("OP_CONSTANT_LONG", chunk, offset);
 
     case OP_NIL:                        return simpleInstruction ("OP_NIL", offset);
     case OP_TRUE:                       return simpleInstruction ("OP_TRUE", offset);
@@ -209,6 +557,11 @@ disassembleInstruction (Chunk *chunk, int offset)
     case OP_GET_GLOBAL:                 return constantInstruction ("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:              return constantInstruction ("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:                 return constantInstruction ("OP_SET_GLOBAL", chunk, offset);
+    case OP_GET_LOCAL_LONG:             return longInstruction ("OP_GET_LOCAL_LONG", chunk, offset);
+    case OP_SET_LOCAL_LONG:             return longInstruction ("OP_SET_LOCAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL_LONG:            return constantLongInstruction ("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:         return constantLongInstruction ("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    case OP_SET_GLOBAL_LONG:            return constantLongInstruction ("OP_SET_GLOBAL_LONG", chunk, offset);
 
     case OP_GET_UPVALUE:                return byteInstruction ("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:                return byteInstruction ("OP_SET_UPVALUE", chunk, offset);
@@ -220,8 +573,11 @@ disassembleInstruction (Chunk *chunk, int offset)
 
     case OP_GET_PROPERTY:               return constantInstruction ("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:               return constantInstruction ("OP_SET_PROPERTY", chunk, offset);
+    case OP_GET_PROPERTY_LONG:          return constantLongInstruction ("OP_GET_PROPERTY_LONG", chunk, offset);
+    case OP_SET_PROPERTY_LONG:          return constantLongInstruction ("OP_SET_PROPERTY_LONG", chunk, offset);
 
     case OP_GET_SUPER:                  return constantInstruction ("OP_GET_SUPER", chunk, offset);
+    case OP_GET_SUPER_LONG:             return constantLongInstruction ("OP_GET_SUPER_LONG", chunk, offset);
 
     case OP_EQUAL:                      return simpleInstruction ("OP_EQUAL", offset);
     case OP_GREATER:                    return simpleInstruction ("OP_GREATER", offset);
@@ -229,43 +585,85 @@ disassembleInstruction (Chunk *chunk, int offset)
 
     case OP_NOT:                        return simpleInstruction ("OP_NOT", offset);
     case OP_NEGATE:                     return simpleInstruction ("OP_NEGATE", offset);
+    case OP_ADD_NUMBER:                 return simpleInstruction ("OP_ADD_NUMBER", offset);
+    case OP_SUBTRACT_NUMBER:            return simpleInstruction ("OP_SUBTRACT_NUMBER", offset);
+    case OP_MULTIPLY_NUMBER:            return simpleInstruction ("OP_MULTIPLY_NUMBER", offset);
+    case OP_DIVIDE_NUMBER:              return simpleInstruction ("OP_DIVIDE_NUMBER", offset);
+    case OP_GREATER_NUMBER:             return simpleInstruction ("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:                return simpleInstruction ("OP_LESS_NUMBER", offset);
+    case OP_NEGATE_NUMBER:              return simpleInstruction ("OP_NEGATE_NUMBER", offset);
     case OP_PRINT:                      return simpleInstruction ("OP_PRINT", offset);
     case OP_JUMP:                       return jumpInstruction ("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:              return jumpInstruction ("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:                       return jumpInstruction ("OP_LOOP", -1, chunk, offset);
-    case OP_CALL:                       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_COMPARE_LOCALS_JUMP:        return compareJumpInstruction ("OP_COMPARE_LOCALS_JUMP", false, false, chunk, offset);
+    case OP_COMPARE_CONSTANT_JUMP:      return compareJumpInstruction ("OP_COMPARE_CONSTANT_JUMP", true, false, chunk, offset);
+    case OP_JUMP_LONG:                  return jumpLongInstruction ("OP_JUMP_LONG", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:         return jumpLongInstruction ("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_LOOP_LONG:                  return jumpLongInstruction ("OP_LOOP_LONG", -1, chunk, offset);
+    case OP_COMPARE_LOCALS_JUMP_LONG:   return compareJumpInstruction ("OP_COMPARE_LOCALS_JUMP_LONG", false, true, chunk, offset);
+    case OP_COMPARE_CONSTANT_JUMP_LONG: return compareJumpInstruction ("OP_COMPARE_CONSTANT_JUMP_LONG", true, true, chunk, offset);
+    case OP_ADD_CONSTANT_LOCAL:         return addConstantInstruction ("OP_ADD_CONSTANT_LOCAL", chunk, offset);
+    case OP_ADD_R:                      return registerInstruction ("OP_ADD_R", chunk, offset);
+    case OP_SUBTRACT_R:                 return registerInstruction ("OP_SUBTRACT_R", chunk, offset);
+    case OP_MULTIPLY_R:                 return registerInstruction ("OP_MULTIPLY_R", chunk, offset);
+    case OP_DIVIDE_R:                   return registerInstruction ("OP_DIVIDE_R", chunk, offset);
+    case OP_EQUAL_R:                    return registerInstruction ("OP_EQUAL_R", chunk, offset);
+    case OP_GREATER_R:                  return registerInstruction ("OP_GREATER_R", chunk, offset);
+    case OP_LESS_R:                     return registerInstruction ("OP_LESS_R", chunk, offset);
+    case OP_CALL:                       return callInstruction("OP_CALL", chunk, offset);
     case OP_INVOKE:                     return invokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:               return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_INVOKE_LONG:                return invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
+    case OP_SUPER_INVOKE_LONG:          return invokeLongInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
     case OP_CLOSE_UPVALUE:              return simpleInstruction ("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:                     return simpleInstruction ("OP_RETURN", offset);
     case OP_CLASS:                      return constantInstruction ("OP_CLASS", chunk, offset);
+    case OP_CLASS_LONG:                 return constantLongInstruction ("OP_CLASS_LONG", chunk, offset);
     case OP_INHERIT:                    return simpleInstruction ("OP_INHERIT", offset);
     case OP_METHOD:                     return constantInstruction ("OP_METHOD", chunk, offset);
+    case OP_METHOD_LONG:                return constantLongInstruction ("OP_METHOD_LONG", chunk, offset);
+    case OP_IMPORT:                     return constantInstruction ("OP_IMPORT", chunk, offset);
+    case OP_IMPORT_LONG:                return constantLongInstruction ("OP_IMPORT_LONG", chunk, offset);
+
+#define SUPER_PAIR_PRINT(name, a, b)    case name: return superInstruction (#name, (OpCode[]) { a, b }, 2, chunk, offset);
+#define SUPER_TRIPLE_PRINT(name, a, b, c) case name: return superInstruction (#name, (OpCode[]) { a, b, c }, 3, chunk, offset);
+    SUPER_PAIRS (SUPER_PAIR_PRINT)
+    SUPER_TRIPLES (SUPER_TRIPLE_PRINT)
+#undef  SUPER_TRIPLE_PRINT
+#undef  SUPER_PAIR_PRINT
 
         // *INDENT-ON*
 
-    case OP_CLOSURE:{
-            offset++;
-            uint8_t constant = chunk->code[offset++];
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:{
+            int constant;
 
-            printf ("%-16s %4d ", "OP_CLOSURE", constant);
+            if (instruction == OP_CLOSURE) {
+                constant = chunk->code[offset + 1];
+                offset += 2;
+            } else {
+                constant = LONG_OPERAND (chunk->code + offset + 1);
+                offset += 4;
+            }
+            printf ("%-16s %4d ", opcodeString (instruction), constant);
             printValue (chunk->constants.values[constant]);
             printf ("\n");
 
             ObjFunction *function = AS_FUNCTION (chunk->constants.values[constant]);
 
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
+                int kind = chunk->code[offset++];
                 int index = chunk->code[offset++];
 
-                printf ("%04d      | %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                printf ("%04d      | %s %d\n", offset - 2, kind == CAPTURE_COPY ? "copy" : kind == CAPTURE_LOCAL ? "local" : "upvalue", index);
             }
 
             return offset;
         }
     }
 
-    printf ("Unknown opcode %d\n", instruction);
+    printf ("Unknown opcode %d\n", (int) instruction);
     return offset + 1;
 }
 
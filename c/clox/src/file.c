@@ -0,0 +1,59 @@
+#define _POSIX_C_SOURCE 200809L        // for fileno
+#include "file.h"
+
+#include "memory.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+/** @file file.c
+ * @brief Read whole files
+ *
+ * Scripts, modules and images are all read into memory in one
+ * piece, by the one function here.
+ */
+
+/** Read the content of a file into a string.
+ *
+ * The size is taken from the open file, so it is read with one
+ * call, and not sought to the end and back first.
+ *
+ * @param path where to find the file
+ * @param length where to put the size of the file, or NULL
+ * @returns the content of the file, plus a '\0' terminator, or
+ * NULL if it could not be read, with errno saying why.
+ */
+char *
+readFile (const char *path, size_t *length)
+{
+    FILE *file = fopen (path, "rb");
+
+    if (NULL == file)
+        return NULL;
+
+    struct stat status;
+
+    if (fstat (fileno (file), &status) < 0) {
+        int en = errno;
+
+        fclose (file);
+        errno = en;
+        return NULL;
+    }
+    size_t fileSize = status.st_size;
+
+    char *buffer = ALLOCATE (char, fileSize + 1);
+    size_t bytesRead = fread (buffer, sizeof (char), fileSize, file);
+
+    fclose (file);
+    if (bytesRead != fileSize) {
+        FREE_ARRAY (char, buffer, fileSize + 1);
+        errno = EIO;
+        return NULL;
+    }
+    buffer[bytesRead] = '\0';
+    if (NULL != length)
+        *length = fileSize;
+    return buffer;
+}
@@ -0,0 +1,546 @@
+#include "image.h"
+
+#include "chunk.h"
+#include "error_log.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** @file image.c
+ * @brief Save compiled functions to a file, and map them back in
+ *
+ * An image is a header, then each string the functions use, then
+ * each function, with the functions it makes closures of placed
+ * before it, so the script comes last. Every record starts on an
+ * IMAGE_ALIGN boundary, so the loader can run the code and read
+ * the line runs where they lie in the mapped file; only the
+ * constants, which hold pointers, are built again.
+ */
+
+/** Alignment of each record in an image */
+#define IMAGE_ALIGN 8
+
+/** Start of an image file
+ */
+struct ImageHeader {
+    char magic[4];              ///< IMAGE_MAGIC, with no terminator
+    uint32_t version;           ///< IMAGE_VERSION of the build that wrote it
+    uint32_t opcodes;           ///< opcodeHash of the build that wrote it
+    uint32_t checksum;          ///< FNV-1a hash of everything after the header
+    uint32_t size;              ///< number of bytes after the header
+    uint32_t stringCount;       ///< number of string records
+    uint32_t functionCount;     ///< number of function records
+    uint32_t unused;            ///< pads the header to IMAGE_ALIGN
+};
+
+/** Start of a function record
+ *
+ * The constants follow, then the line runs, then the code.
+ */
+struct ImageFunction {
+    int32_t arity;              ///< number of parameters
+    int32_t upvalueCount;       ///< number of upvalues
+    int32_t name;               ///< string record of the name, or -1 for the script
+    int32_t codeCount;          ///< number of bytes of code
+    int32_t lineCount;          ///< number of line runs
+    int32_t constantCount;      ///< number of constants
+    int32_t callCount;          ///< number of OP_CALL sites
+};
+
+/** Enumerate the kinds of constant in an image
+ */
+typedef enum {
+    IMAGE_NIL,                  ///< nil
+    IMAGE_FALSE,                ///< false
+    IMAGE_TRUE,                 ///< true
+    IMAGE_NUMBER,               ///< a number, in the number field
+    IMAGE_STRING,               ///< a string, by record index
+    IMAGE_FUNCTION,             ///< a function, by record index
+} ImageConstantType;
+
+/** One entry of the constant pool of a function record
+ */
+struct ImageConstant {
+    int32_t type;               ///< an ImageConstantType
+    int32_t index;              ///< string or function record
+    double number;              ///< value of a number
+};
+
+/** Bytes of one section of an image being written
+ */
+struct ImageBuffer {
+    uint8_t *bytes;             ///< storage for the section
+    int count;                  ///< number of bytes written
+    int capacity;               ///< allocated size of bytes
+};
+
+/** State of an image being written
+ */
+struct ImageWriter {
+    ImageBuffer strings;        ///< the string records
+    ImageBuffer functions;      ///< the function records
+    Table indices;              ///< record index of each string written
+    int stringCount;            ///< number of string records
+    int functionCount;          ///< number of function records
+};
+
+/** Position in an image being loaded
+ */
+struct ImageReader {
+    const uint8_t *start;       ///< first byte after the header
+    const uint8_t *at;          ///< next byte to read
+    const uint8_t *end;         ///< first byte past the image
+};
+
+/** Mapped image files, kept until the VM is freed */
+static struct {
+    void *base;                 ///< where the file is mapped
+    size_t size;                ///< length of the mapping
+} *mappedImages = NULL;
+
+static int mappedCount = 0;     ///< number of mapped image files
+
+/** Continue an FNV-1a hash over some bytes.
+ *
+ * @param hash the hash so far
+ * @param bytes where the bytes start
+ * @param size number of bytes
+ * @returns the hash including those bytes
+ */
+static uint32_t
+checksum (uint32_t hash, const uint8_t *bytes, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/** Add bytes to a section of an image.
+ *
+ * @param buffer the section
+ * @param data bytes to copy in
+ * @param size number of bytes
+ */
+static void
+appendBytes (ImageBuffer *buffer, const void *data, int size)
+{
+    if (buffer->count + size > buffer->capacity) {
+        int oldCapacity = buffer->capacity;
+
+        while (buffer->capacity < buffer->count + size)
+            buffer->capacity = GROW_CAPACITY (buffer->capacity);
+        buffer->bytes = GROW_ARRAY (uint8_t, buffer->bytes, oldCapacity, buffer->capacity);
+    }
+    memcpy (buffer->bytes + buffer->count, data, size);
+    buffer->count += size;
+}
+
+/** Pad a section of an image to the start of the next record.
+ *
+ * @param buffer the section
+ */
+static void
+padBuffer (ImageBuffer *buffer)
+{
+    static const uint8_t zeros[IMAGE_ALIGN] = { 0 };
+
+    if (buffer->count % IMAGE_ALIGN != 0)
+        appendBytes (buffer, zeros, IMAGE_ALIGN - buffer->count % IMAGE_ALIGN);
+}
+
+/** Write a string record, unless the string has one already.
+ *
+ * @param writer the image being written
+ * @param string a flat string, as the compiler makes
+ * @returns the index of its string record
+ */
+static int
+writeString (ImageWriter *writer, ObjString *string)
+{
+    Value index;
+
+    if (tableGet (&writer->indices, string, &index))
+        return (int) AS_NUMBER (index);
+
+    int32_t length = string->length;
+
+    INVAR (NULL != string->chars, "the compiler only makes flat strings");
+    appendBytes (&writer->strings, &length, sizeof length);
+    appendBytes (&writer->strings, string->chars, length);
+    padBuffer (&writer->strings);
+    tableSet (&writer->indices, string, NUMBER_VAL (writer->stringCount));
+    return writer->stringCount++;
+}
+
+/** Write a function record, after those of its nested functions.
+ *
+ * @param writer the image being written
+ * @param function the compiled function
+ * @returns the index of its function record
+ */
+static int
+writeFunction (ImageWriter *writer, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int constantCount = chunk->constants.count;
+    ImageConstant *constants = ALLOCATE (ImageConstant, constantCount);
+
+    for (int i = 0; i < constantCount; i++) {
+        Value value = chunk->constants.values[i];
+        ImageConstant constant = { IMAGE_NIL, 0, 0.0 };
+
+        if (IS_BOOL (value)) {
+            constant.type = AS_BOOL (value) ? IMAGE_TRUE : IMAGE_FALSE;
+        } else if (IS_NUMBER (value)) {
+            constant.type = IMAGE_NUMBER;
+            constant.number = AS_NUMBER (value);
+        } else if (IS_STRING (value)) {
+            constant.type = IMAGE_STRING;
+            constant.index = writeString (writer, AS_STRING (value));
+        } else if (IS_FUNCTION (value)) {
+            constant.type = IMAGE_FUNCTION;
+            constant.index = writeFunction (writer, AS_FUNCTION (value));
+        } else {
+            INVAR (IS_NIL (value), "the compiler makes no other constants");
+        }
+        constants[i] = constant;
+    }
+
+    ImageFunction record = {
+        function->arity,
+        function->upvalueCount,
+        NULL == function->name ? -1 : writeString (writer, function->name),
+        chunk->count,
+        chunk->lineCount,
+        constantCount,
+        chunk->callCount,
+    };
+
+    appendBytes (&writer->functions, &record, sizeof record);
+    appendBytes (&writer->functions, constants, sizeof (ImageConstant) * constantCount);
+    appendBytes (&writer->functions, chunk->lines, sizeof (LineStart) * chunk->lineCount);
+    appendBytes (&writer->functions, chunk->code, chunk->count);
+    padBuffer (&writer->functions);
+
+    FREE_ARRAY (ImageConstant, constants, constantCount);
+    return writer->functionCount++;
+}
+
+/** Save a compiled script, and every function in it, as an image.
+ *
+ * @param script the function returned by compile
+ * @param path name of the file to write
+ * @returns true if the image was written, or
+ * @returns false after reporting why it was not
+ */
+bool
+writeImage (ObjFunction *script, const char *path)
+{
+    ImageWriter writer = { { NULL, 0, 0 }, { NULL, 0, 0 }, { 0 }, 0, 0 };
+
+    initTable (&writer.indices);
+    writeFunction (&writer, script);
+
+    ImageHeader header = {
+        { 0 },
+        IMAGE_VERSION,
+        opcodeHash (),
+        checksum (checksum (2166136261u, writer.strings.bytes, writer.strings.count), writer.functions.bytes, writer.functions.count),
+        writer.strings.count + writer.functions.count,
+        writer.stringCount,
+        writer.functionCount,
+        0,
+    };
+
+    memcpy (header.magic, IMAGE_MAGIC, sizeof header.magic);
+
+    FILE *file = fopen (path, "wb");
+    bool written = NULL != file
+        && 1 == fwrite (&header, sizeof header, 1, file)
+        && (size_t) writer.strings.count == fwrite (writer.strings.bytes, 1, writer.strings.count, file)
+        && (size_t) writer.functions.count == fwrite (writer.functions.bytes, 1, writer.functions.count, file);
+
+    if (NULL != file && 0 != fclose (file))
+        written = false;
+    if (!written)
+        fprintf (stderr, "Could not write image \"%s\".\n", path);
+
+    freeTable (&writer.indices);
+    FREE_ARRAY (uint8_t, writer.functions.bytes, writer.functions.capacity);
+    FREE_ARRAY (uint8_t, writer.strings.bytes, writer.strings.capacity);
+    return written;
+}
+
+/** Check whether a file is an image, by its first bytes.
+ *
+ * This is asked before running every script, so it reads just
+ * the magic number, without the buffering of stdio.
+ *
+ * @param path name of the file
+ * @returns true if it starts as an image does
+ */
+bool
+isImage (const char *path)
+{
+    char magic[sizeof IMAGE_MAGIC - 1];
+    int fd = open (path, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    bool matched = (ssize_t) sizeof magic == read (fd, magic, sizeof magic) && 0 == memcmp (magic, IMAGE_MAGIC, sizeof magic);
+
+    close (fd);
+    return matched;
+}
+
+/** Take the next bytes of an image being loaded.
+ *
+ * @param reader where loading has got to
+ * @param size number of bytes needed
+ * @returns where they are, or NULL if the image is too short
+ */
+static const void *
+take (ImageReader *reader, size_t size)
+{
+    const uint8_t *bytes = reader->at;
+
+    if (size > (size_t) (reader->end - reader->at))
+        return NULL;
+    reader->at += size;
+    return bytes;
+}
+
+/** Skip to the start of the next record of an image being loaded.
+ *
+ * @param reader where loading has got to
+ */
+static void
+skipPadding (ImageReader *reader)
+{
+    size_t offset = (size_t) (reader->at - reader->start);
+
+    if (offset % IMAGE_ALIGN != 0)
+        take (reader, IMAGE_ALIGN - offset % IMAGE_ALIGN);
+}
+
+/** Report why an image could not be loaded.
+ *
+ * @param path name of the file
+ * @param message what is wrong with it
+ * @returns NULL, for the caller to return
+ */
+static ObjFunction *
+imageError (const char *path, const char *message)
+{
+    fprintf (stderr, "Could not load image \"%s\": %s.\n", path, message);
+    return NULL;
+}
+
+/** Intern the strings of a mapped image.
+ *
+ * @param path name of the file, for errors
+ * @param header the header, already checked
+ * @param reader positioned after the header
+ * @param strings filled in with a string for each record
+ * @returns true if all went well, or
+ * @returns false after reporting an error
+ */
+static bool
+loadStrings (const char *path, const ImageHeader *header, ImageReader *reader, ObjString **strings)
+{
+    for (uint32_t i = 0; i < header->stringCount; i++) {
+        const int32_t *length = take (reader, sizeof (int32_t));
+        const char *chars = NULL == length || *length < 0 ? NULL : take (reader, *length);
+
+        if (NULL == chars)
+            return NULL != imageError (path, "string record is truncated");
+        skipPadding (reader);
+        strings[i] = copyString (chars, *length);
+        rememberValue (OBJ_VAL (strings[i]));
+    }
+    return true;
+}
+
+/** Build the functions of a mapped image.
+ *
+ * @param path name of the file, for errors
+ * @param header the header, already checked
+ * @param reader positioned after the header
+ * @param strings the string objects, one for each record
+ * @param functions filled in with a function for each record
+ * @returns the script, or NULL after reporting an error
+ */
+static ObjFunction *
+loadFunctions (const char *path, const ImageHeader *header, ImageReader *reader, ObjString **strings, ObjFunction **functions)
+{
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        const ImageFunction *record = take (reader, sizeof (ImageFunction));
+
+        if (NULL == record)
+            return imageError (path, "function record is truncated");
+        if (record->arity < 0 || record->arity > UINT8_MAX || record->upvalueCount < 0 || record->upvalueCount > UINT8_COUNT
+            || record->name < -1 || record->name >= (int32_t) header->stringCount
+            || record->codeCount < 0 || record->lineCount < 0 || record->constantCount < 0 || record->callCount < 0 || record->callCount > UINT16_COUNT)
+            return imageError (path, "function record is malformed");
+
+        const ImageConstant *constants = take (reader, sizeof (ImageConstant) * record->constantCount);
+        const LineStart *lines = take (reader, sizeof (LineStart) * record->lineCount);
+        const uint8_t *code = take (reader, record->codeCount);
+
+        if (NULL == constants || NULL == lines || NULL == code)
+            return imageError (path, "function record is truncated");
+        skipPadding (reader);
+
+        ObjFunction *function = newFunction ();
+
+        functions[i] = function;
+        function->arity = record->arity;
+        function->upvalueCount = record->upvalueCount;
+        function->name = record->name < 0 ? NULL : strings[record->name];
+
+        for (int k = 0; k < record->constantCount; k++) {
+            const ImageConstant *constant = &constants[k];
+            Value value;
+
+            switch (constant->type) {
+            case IMAGE_NIL:
+                value = NIL_VAL;
+                break;
+            case IMAGE_FALSE:
+            case IMAGE_TRUE:
+                value = BOOL_VAL (constant->type == IMAGE_TRUE);
+                break;
+            case IMAGE_NUMBER:
+                value = NUMBER_VAL (constant->number);
+                break;
+            case IMAGE_STRING:
+                if (constant->index < 0 || constant->index >= (int32_t) header->stringCount)
+                    return imageError (path, "constant names a missing string");
+                value = OBJ_VAL (strings[constant->index]);
+                break;
+            case IMAGE_FUNCTION:
+                if (constant->index < 0 || (uint32_t) constant->index >= i)
+                    return imageError (path, "constant names a function not yet loaded");
+                value = OBJ_VAL (functions[constant->index]);
+                break;
+            default:
+                return imageError (path, "constant has an unknown type");
+            }
+            writeValueArray (&function->chunk.constants, value);
+        }
+
+        // the code and line runs are used where they are mapped.
+        function->chunk.code = (uint8_t *) code;
+        function->chunk.lines = (LineStart *) lines;
+        function->chunk.lineCount = record->lineCount;
+        function->chunk.count = record->codeCount;
+        function->chunk.isImage = true;
+        for (int k = 0; k < record->callCount; k++)
+            addCallSite (&function->chunk);
+
+        if (!verifyFunction (function))
+            return imageError (path, "bytecode failed verification");
+    }
+
+    if (reader->at != reader->end)
+        return imageError (path, "image has bytes after the last function");
+    return functions[header->functionCount - 1];
+}
+
+/** Load an image, to run the script it holds.
+ *
+ * The file is mapped, and stays mapped until freeImages. The
+ * version, the opcode count and the checksum must all match,
+ * and every function must pass verifyFunction, before any of
+ * it may run.
+ *
+ * @param path name of the file
+ * @returns the script, or NULL after reporting why it was not loaded
+ */
+ObjFunction *
+loadImage (const char *path)
+{
+    int fd = open (path, O_RDONLY);
+    struct stat status;
+
+    if (fd < 0 || fstat (fd, &status) < 0) {
+        if (fd >= 0)
+            close (fd);
+        return imageError (path, "file can not be read");
+    }
+
+    size_t size = (size_t) status.st_size;
+
+    if (size < sizeof (ImageHeader)) {
+        close (fd);
+        return imageError (path, "file is too short");
+    }
+
+    void *base = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close (fd);
+    if (MAP_FAILED == base)
+        return imageError (path, "file can not be mapped");
+
+    mappedImages = realloc (mappedImages, sizeof mappedImages[0] * (mappedCount + 1));
+    INVAR (NULL != mappedImages, "unable to allocate memory for the image list");
+    mappedImages[mappedCount].base = base;
+    mappedImages[mappedCount].size = size;
+    mappedCount++;
+
+    const ImageHeader *header = base;
+    ImageReader reader = { (const uint8_t *) (header + 1), (const uint8_t *) (header + 1), (const uint8_t *) base + size };
+
+    if (0 != memcmp (header->magic, IMAGE_MAGIC, sizeof header->magic))
+        return imageError (path, "file is not an image");
+    if (header->version != IMAGE_VERSION || header->opcodes != opcodeHash ())
+        return imageError (path, "image is from a different version of clox");
+    if (header->size != size - sizeof (ImageHeader))
+        return imageError (path, "image is truncated");
+    if (header->checksum != checksum (2166136261u, reader.start, header->size))
+        return imageError (path, "checksum does not match");
+    if (0 == header->functionCount || header->functionCount > header->size / sizeof (ImageFunction)
+        || header->stringCount > header->size / IMAGE_ALIGN)
+        return imageError (path, "record counts are malformed");
+
+    ObjString **strings = malloc (sizeof (ObjString *) * (header->stringCount + 1));
+    ObjFunction **functions = malloc (sizeof (ObjFunction *) * header->functionCount);
+    ObjFunction *script = NULL;
+    bool wasPermanent = vm.allocPermanent;
+
+    INVAR (NULL != strings && NULL != functions, "unable to allocate memory to load an image");
+
+    // like compiled code, loaded code lives until the VM is freed.
+    vm.allocPermanent = true;
+    if (loadStrings (path, header, &reader, strings))
+        script = loadFunctions (path, header, &reader, strings, functions);
+    vm.allocPermanent = wasPermanent;
+    free (functions);
+    free (strings);
+    return script;
+}
+
+/** Unmap every image loaded.
+ *
+ * This must come after the functions loaded from them are freed.
+ */
+void
+freeImages ()
+{
+    for (int i = 0; i < mappedCount; i++)
+        munmap (mappedImages[i].base, mappedImages[i].size);
+    free (mappedImages);
+    mappedImages = NULL;
+    mappedCount = 0;
+}
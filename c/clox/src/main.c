@@ -3,10 +3,14 @@
 #include "bist.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "file.h"
+#include "image.h"
 #include "memory.h"
 #include "options.h"
 #include "post.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #include <errno.h>
@@ -23,6 +27,10 @@
 
 extern Options options;         // share command line options state
 
+static const char **queuedFiles = NULL; ///< files held back by --jobs
+static int queuedCount = 0;     ///< number of files held back
+static int queuedCapacity = 0;  ///< allocated size of the queuedFiles array
+
 /** Read-Evaluate-Print loop.
  */
 static void
@@ -42,88 +50,178 @@ repl ()
     }
 }
 
-/** Read the content of a file into a string.
+/** Read the content of a file, or exit.
  *
  * @param path where to find the file
+ * @param length where to put the size of the file, or NULL
  * @returns the content of the file, plus a '\0' terminator.
  *
  * Any failure will terminate the program abnormally with
  * an appropriate error message.
  */
 static char *
-readFile (const char *path)
+readFileOrExit (const char *path, size_t *length)
 {
-    FILE *file = fopen (path, "rb");
+    char *buffer = readFile (path, length);
 
-    if (NULL == file) {
+    if (NULL == buffer) {
         int en = errno;
 
         // *INDENT-OFF*
         fprintf (stderr,
-                 "Could not open file \"%s\".\n"
-                 "    fopen returned error %d: %s\n",
+                 "Could not read file \"%s\".\n"
+                 "    error %d: %s\n",
                  path, en, strerror (en));
         // *INDENT-ON*
 
-        exit (EX_NOINPUT);
+        exit (ENOENT == en || EACCES == en ? EX_NOINPUT : EX_IOERR);
     }
+    return buffer;
+}
 
-    fseek (file, 0L, SEEK_END);
-    size_t fileSize = ftell (file);
+/** Compile the Lox source in the file named into an image.
+ *
+ * The image is written to the file named by --compile.
+ *
+ * @param path where to find the file
+ *
+ * On error, terminates the program.
+ */
+static void
+compileFile (const char *path)
+{
+    char *source = readFileOrExit (path, NULL);
+    ObjFunction *function = compileProgram (source);
 
-    rewind (file);
+    FREE_ARRAY (char, (char *) source, 1 + strlen (source));
 
-    char *buffer = ALLOCATE (char, fileSize + 1);       // was (char *) malloc (fileSize + 1);
+    if (NULL == function)
+        exit (EX_DATAERR);
+    if (!writeImage (function, options.compileTo))
+        exit (EX_CANTCREAT);
+}
 
-    if (NULL == buffer) {
-        int en = errno;
+/** Run the script in the image file named.
+ *
+ * @param path where to find the file
+ *
+ * On error, terminates the program.
+ */
+static void
+runImage (const char *path)
+{
+    ObjFunction *function = loadImage (path);
 
-        // *INDENT-OFF*
-        fprintf (stderr,
-                 "Not enough memory to read %lu bytes from \"%s\".\n"
-                 "   malloc returned error number %d: %s\n",
-                 fileSize, path, en, strerror (en));
-        // *INDENT-ON*
+    if (NULL == function)
+        exit (EX_DATAERR);
+    if (interpretFunction (function) == INTERPRET_RUNTIME_ERROR)
+        exit (EX_SOFTWARE);
+}
+
+/** Process the Lox source, or the image, in the file named.
+ *
+ * With --compile, the source is compiled into an image instead.
+ *
+ * @param path where to find the file
+ *
+ * On error, terminates the program.
+ */
+static void
+runFile (const char *path)
+{
+    if (NULL != options.compileTo) {
+        compileFile (path);
+        return;
+    }
+    if (options.jobs > 0) {
+        if (queuedCapacity < queuedCount + 1) {
+            int oldCapacity = queuedCapacity;
 
-        // try again later when more memory is available.
-        exit (EX_TEMPFAIL);
+            queuedCapacity = GROW_CAPACITY (oldCapacity);
+            queuedFiles = GROW_ARRAY (const char *, queuedFiles, oldCapacity, queuedCapacity);
+        }
+        queuedFiles[queuedCount++] = path;
+        return;
     }
-    size_t bytesRead = fread (buffer, sizeof (char), fileSize, file);
 
-    if (bytesRead != fileSize) {
+    // only the magic number is read to tell an image, which is
+    // mapped rather than read, from source.
+    if (isImage (path)) {
+        runImage (path);
+        return;
+    }
 
-        // *INDENT-OFF*
-        fprintf (stderr,
-                 "Could not read %lu bytes from file \"%s\"\n",
-                 fileSize, path);
-        // *INDENT-ON*
+    char *source = readFileOrExit (path, NULL);
 
-        exit (EX_IOERR);
-    }
-    buffer[bytesRead] = '\0';
+    ObjFunction *function = compileProgram (source);
 
-    fclose (file);
-    return buffer;
+    FREE_ARRAY (char, (char *) source, 1 + strlen (source));    // was free (source);
+
+    if (NULL == function)
+        exit (EX_DATAERR);
+    if (interpretFunction (function) == INTERPRET_RUNTIME_ERROR)
+        exit (EX_SOFTWARE);
 }
 
-/** Process the Lox source in the file named.
+/** Run the files held back by --jobs.
  *
- * @param path where to find the file
+ * The sources are all compiled first, on options.jobs threads,
+ * then run in the order they were named. Images are loaded as
+ * they come. Running stops at the first file that fails, as it
+ * would have without --jobs.
  *
  * On error, terminates the program.
  */
 static void
-runFile (const char *path)
+runQueuedFiles ()
 {
-    char *source = readFile (path);
-    InterpretResult result = interpret (source);
+    if (queuedCount == 0)
+        return;
 
-    FREE_ARRAY (char, (char *) source, 1 + strlen (source));    // was free (source);
+    const char **sources = ALLOCATE (const char *, queuedCount);
+    ObjFunction **functions = ALLOCATE (ObjFunction *, queuedCount);
+    int sourceCount = 0;
 
-    if (result == INTERPRET_COMPILE_ERROR)
+    for (int i = 0; i < queuedCount; i++) {
+        if (!isImage (queuedFiles[i]))
+            sources[sourceCount++] = readFileOrExit (queuedFiles[i], NULL);
+    }
+    compileAll (sources, functions, sourceCount, options.jobs);
+    for (int i = 0; i < sourceCount; i++)
+        FREE_ARRAY (char, (char *) sources[i], 1 + strlen (sources[i]));
+
+    for (int i = 0, source = 0; i < queuedCount; i++) {
+        ObjFunction *function = isImage (queuedFiles[i]) ? loadImage (queuedFiles[i]) : functions[source++];
+
+        if (NULL == function)
+            exit (EX_DATAERR);
+        if (interpretFunction (function) == INTERPRET_RUNTIME_ERROR)
+            exit (EX_SOFTWARE);
+    }
+
+    FREE_ARRAY (const char *, sources, queuedCount);
+    FREE_ARRAY (ObjFunction *, functions, queuedCount);
+    FREE_ARRAY (const char *, queuedFiles, queuedCapacity);
+    queuedFiles = NULL;
+    queuedCount = 0;
+    queuedCapacity = 0;
+}
+
+/** Start from the heap saved in a snapshot.
+ *
+ * @param path where to find the snapshot
+ *
+ * On error, terminates the program.
+ */
+static void
+restoreFile (const char *path)
+{
+    if (queuedCount > 0) {
+        fprintf (stderr, "--restore must come before the files to run\n");
+        exit (EX_USAGE);
+    }
+    if (!restoreSnapshot (path))
         exit (EX_DATAERR);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit (EX_SOFTWARE);
 }
 
 /** Demonstration Function
@@ -160,8 +258,21 @@ demo ()
  *     -V, --no-verbose    turn down verbose operation flag
  *     -N, --no-dryrun     turn down dryrun flag
  *     -D, --no-debug      turn down debug level
+ *         --post          run the power-on self tests
  *         --bist          run the built-in self test
  *         --demo          run the quick demo code
+ *         --compile FILE  compile the files named after this into
+ *                         the image FILE, instead of running them
+ *         --lazy          compile each function body when it is
+ *                         first called (not when writing an image)
+ *         --jobs N        compile the files named after this on N
+ *                         threads, then run them in order
+ *         --cache-modules write an image of each imported module
+ *                         next to it, used until the source changes
+ *         --snapshot FILE write the heap to FILE after running the
+ *                         files named, for --restore to start from
+ *         --restore FILE  start from the heap in the snapshot FILE;
+ *                         this must come before the files to run
  * 
  *     Multiple short flags can be combined (so -dv will turn up both the
  *     debug and verbose levels).
@@ -191,17 +302,24 @@ demo ()
 int
 main (int argc, const char **argv)
 {
-    postAll ();
-
     initMemory ();
     initVM ();
 
+    options.post = postAll;
     options.bist = bistAll;
     options.demo = demo;
     options.cfar = runFile;
     options.repl = repl;
+    options.restore = restoreFile;
 
     parse_options (argc, argv);
+    runQueuedFiles ();
+
+    if (NULL != options.snapshotTo && !writeSnapshot (options.snapshotTo))
+        exit (EX_CANTCREAT);
+
+    if (options.verbose > 0)
+        fprintf (stderr, "compile cache: %u hits, %u misses\n", vm.compileHits, vm.compileMisses);
 
     freeVM ();
     return 0;
@@ -5,6 +5,7 @@
 #include "object.h"
 #include "vm.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -29,6 +30,38 @@ extern void *sbrk (intptr_t increment);
 /** best estimate of the start of the heap memory */
 static void *heap_base = 0;
 
+/** Size of each block of the permanent region */
+#define PERMANENT_BLOCK_SIZE (64 * 1024)
+
+/** Alignment of objects in the permanent region */
+#define PERMANENT_ALIGN sizeof (double)
+
+/** Free the storage for an object, unless it is in the permanent region. */
+#define FREE_OBJ(type, object)  ((object)->isPermanent ? NULL : FREE (type, object))
+
+/** Block of storage in the permanent region */
+struct PermanentBlock {
+    PermanentBlock *next;       ///< previously filled block
+    size_t used;                ///< bytes handed out from this block
+    size_t size;                ///< bytes available in this block
+    char data[];                ///< the storage
+};
+
+/** Set while the GC runs, so it is not started again from within. */
+static bool collecting = false;
+
+/** Blocks of the permanent region, most recent first */
+static PermanentBlock *permanentBlocks = NULL;
+
+/** Set while compiler threads share the heap; see shareHeap. */
+static bool heapShared = false;
+
+/** Held by the thread changing the heap while it is shared */
+static pthread_mutex_t heapMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Number of times this thread has taken heapMutex */
+static THREAD_LOCAL int heapLocks = 0;
+
 /** static limit on the number of allocations */
 #define MAX_HEAP_COUNT 10000
 
@@ -67,14 +100,16 @@ getSeq (void *ptr)
 
 /** Assign a heap allocation sequence number to this pointer.
  *
- * Sequence numbers start at 1 and go up,.
+ * Sequence numbers start at 1 and go up. Once MAX_HEAP_COUNT
+ * pointers have been recorded, no more are assigned.
  *
  * @param ptr A value that will be returned by reallocate
  */
 static void
 addSeq (void *ptr)
 {
-    INVAR (heap_count < MAX_HEAP_COUNT, "MAX_HEAP_COUNT is not big enough.");
+    if (heap_count >= MAX_HEAP_COUNT)
+        return;                         // later allocations print as heap offsets
     heap_ptrs[heap_count++] = ptr;
 }
 
@@ -120,9 +155,12 @@ printableHeapAddr (void *ptr)
 void *
 reallocate (void *pointer, size_t oldSize, size_t newSize)
 {
+    lockHeap ();
     vm.bytesAllocated += newSize - oldSize;
+    unlockHeap ();
 
-    if (newSize > oldSize) {
+    // the GC could not find the roots held by other threads
+    if (newSize > oldSize && !collecting && !heapShared) {
 #ifdef DEBUG_STRESS_GC
         collectGarbage ();
 #endif
@@ -144,12 +182,132 @@ reallocate (void *pointer, size_t oldSize, size_t newSize)
 
     INVAR (NULL != result, "realloc  failed.");
 
-    if (result != pointer)
+    if (result != pointer) {
+        lockHeap ();
         addSeq (result);
+        unlockHeap ();
+    }
+
+    return result;
+}
+
+/** Allocate storage in the permanent region.
+ *
+ * Objects made while compiling live for the whole run, so they are
+ * packed into large blocks that the GC neither marks nor sweeps, and
+ * which do not count toward the next GC threshold. The storage is
+ * only released by freeObjects.
+ *
+ * @param size bytes needed
+ * @returns a pointer to that many bytes in the permanent region
+ */
+void *
+allocatePermanent (size_t size)
+{
+    size = (size + PERMANENT_ALIGN - 1) & ~(PERMANENT_ALIGN - 1);
+    lockHeap ();
+
+    PermanentBlock *block = permanentBlocks;
+
+    if (NULL == block || block->used + size > block->size) {
+        size_t blockSize = size > PERMANENT_BLOCK_SIZE ? size : PERMANENT_BLOCK_SIZE;
+
+        block = (PermanentBlock *) malloc (sizeof (PermanentBlock) + blockSize);
+        INVAR (NULL != block, "unable to allocate memory for the permanent region");
+        block->next = permanentBlocks;
+        block->used = 0;
+        block->size = blockSize;
+        permanentBlocks = block;
+    }
+
+    void *result = block->data + block->used;
 
+    block->used += size;
+    unlockHeap ();
     return result;
 }
 
+/** Note that a permanent object refers to this value.
+ *
+ * The marker does not descend into permanent objects, so any
+ * heap object they refer to is kept in vm.permanentRefs, which
+ * is a GC root.
+ *
+ * @param value the value stored in a permanent object
+ */
+void
+rememberValue (Value value)
+{
+    if (!IS_OBJ (value) || AS_OBJ (value)->isPermanent)
+        return;
+
+    lockHeap ();
+    push (value);                       // protect from GC sweep
+    writeValueArray (&vm.permanentRefs, value);
+    pop ();
+    unlockHeap ();
+}
+
+/** Note that a function now holds a callee in a call site.
+ *
+ * The collector empties the sites of only the functions listed
+ * in vm.callers, so its cost does not grow with the regions it
+ * neither marks nor sweeps.
+ *
+ * @param function the function whose call site was just filled
+ */
+void
+rememberCaller (ObjFunction *function)
+{
+    if (function->chunk.hasCallees)
+        return;
+
+    if (vm.callerCapacity < vm.callerCount + 1) {
+        vm.callerCapacity = GROW_CAPACITY (vm.callerCapacity);
+        vm.callers = (ObjFunction **) realloc (vm.callers, sizeof (ObjFunction *) * vm.callerCapacity);
+        INVAR (NULL != vm.callers, "unable to allocate memory for the callers list");
+    }
+
+    vm.callers[vm.callerCount++] = function;
+    function->chunk.hasCallees = true;
+}
+
+/** Let several threads allocate, or go back to just one.
+ *
+ * While the heap is shared, changes to it are made under lockHeap
+ * and the GC does not run. Only compileAll shares the heap, and no
+ * other thread may be running when this is called.
+ *
+ * @param shared true before starting the threads, false after they end
+ */
+void
+shareHeap (bool shared)
+{
+    heapShared = shared;
+}
+
+/** Take the heap for a change made by this thread.
+ *
+ * This does nothing unless the heap is shared. A thread that
+ * already holds the heap may take it again, and must give it
+ * back as many times with unlockHeap.
+ */
+void
+lockHeap ()
+{
+    if (heapShared && heapLocks++ == 0)
+        pthread_mutex_lock (&heapMutex);
+}
+
+/** Give back the heap taken by lockHeap.
+ */
+void
+unlockHeap ()
+{
+    if (heapShared && --heapLocks == 0)
+        pthread_mutex_unlock (&heapMutex);
+}
+
 /** Annotate this object as reachable.
  *
  * @param object some Obj that was reached
@@ -240,6 +398,7 @@ blackenObject (Obj *object)
             markObject ((Obj *) closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
                 markObject ((Obj *) closure->upvalues[i]);
+                markValue (CLOSURE_COPIES (closure)[i]);
             }
             return;
         }
@@ -248,6 +407,7 @@ blackenObject (Obj *object)
             ObjFunction *function = (ObjFunction *) object;
 
             markObject ((Obj *) function->name);
+            markObject ((Obj *) function->closure);
             markArray (&function->chunk.constants);
             return;
         }
@@ -272,6 +432,11 @@ blackenObject (Obj *object)
         }
 
     case OBJ_STRING:{
+            ObjString *string = (ObjString *) object;
+
+            markObject ((Obj *) string->parent);
+            markObject ((Obj *) string->left);
+            markObject ((Obj *) string->right);
             return;
         }
     }
@@ -292,7 +457,7 @@ freeObject (Obj *object)
     switch (object->type) {
 
     case OBJ_BOUND_METHOD:{
-            FREE (ObjBoundMethod, object);
+            FREE_OBJ (ObjBoundMethod, object);
             return;
         }
 
@@ -300,7 +465,7 @@ freeObject (Obj *object)
             ObjInstance *instance = (ObjInstance *) object;
 
             freeTable (&instance->fields);
-            FREE (ObjInstance, object);
+            FREE_OBJ (ObjInstance, object);
 
             return;
         }
@@ -309,7 +474,7 @@ freeObject (Obj *object)
             ObjClass *klass = (ObjClass *) object;
 
             freeTable (&klass->methods);
-            FREE (ObjClass, object);
+            FREE_OBJ (ObjClass, object);
 
             return;
         }
@@ -317,8 +482,8 @@ freeObject (Obj *object)
     case OBJ_CLOSURE:{
             ObjClosure *closure = (ObjClosure *) object;
 
-            FREE_ARRAY (ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-            FREE (ObjClosure, object);
+            if (!object->isPermanent)
+                reallocate (object, CLOSURE_SIZE (closure->upvalueCount), 0);
 
             return;
         }
@@ -326,27 +491,31 @@ freeObject (Obj *object)
     case OBJ_FUNCTION:{
             ObjFunction *function = (ObjFunction *) object;
 
+            if (NULL != function->lazy)
+                freeLazyBody (function);
             freeChunk (&function->chunk);
-            FREE (ObjFunction, object);
+            FREE_OBJ (ObjFunction, object);
 
             return;
         }
 
     case OBJ_NATIVE:{
-            FREE (ObjNative, object);
+            FREE_OBJ (ObjNative, object);
             return;
         }
 
     case OBJ_STRING:{
             ObjString *string = (ObjString *) object;
-            FREE_ARRAY (char, string->chars, string->length + 1);
-            FREE (ObjString, object);
+
+            if (NULL != string->chars && NULL == string->parent)
+                FREE_ARRAY (char, string->chars, string->length + 1);
+            FREE_OBJ (ObjString, object);
 
             return;
         }
 
     case OBJ_UPVALUE:{
-            FREE (ObjUpvalue, object);
+            FREE_OBJ (ObjUpvalue, object);
             return;
         }
 
@@ -385,10 +554,14 @@ markRoots ()
     for (int i = 0; i < vm.frameCount; i++) {
         markObject ((Obj *) vm.frames[i].closure);
     }
-    for (ObjUpvalue * upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject ((Obj *) upvalue);
+    for (int slot = 0; slot < vm.openTop; slot++) {
+        markObject ((Obj *) vm.openSlots[slot]);
     }
     markTable (&vm.globals);
+    markTable (&vm.modules);
+    markArray (&vm.permanentRefs);
+    for (int i = 0; i < COMPILE_CACHE_SIZE; i++)
+        markObject ((Obj *) vm.compileCache[i].function);
     markCompilerRoots ();
     INVAR (NULL != vm.initString, "vm.initString must not be NULL.");
     INVAR (IS_STRING (OBJ_VAL (vm.initString)), "vm.initString must point to a String object.");
@@ -407,6 +580,40 @@ traceReferences ()
     }
 }
 
+/** Empty the call-site caches whose callee is about to be freed.
+ *
+ * The caches are weak: a callee is only kept while something else
+ * reaches it, so the last callee seen never pins a closure and the
+ * objects it captured. Only the functions in vm.callers can hold
+ * one; those that no longer do, or are about to be freed, leave
+ * the list.
+ */
+static void
+forgetDeadCallees ()
+{
+    int kept = 0;
+
+    for (int i = 0; i < vm.callerCount; i++) {
+        ObjFunction *function = vm.callers[i];
+        Chunk *chunk = &function->chunk;
+        bool hasCallees = false;
+
+        for (int j = 0; j < chunk->callCount; j++) {
+            Obj *callee = chunk->calls[j].callee;
+
+            if (NULL != callee && !callee->isMarked)
+                chunk->calls[j].callee = NULL;
+            else if (NULL != callee)
+                hasCallees = true;
+        }
+
+        chunk->hasCallees = hasCallees && function->obj.isMarked;
+        if (chunk->hasCallees)
+            vm.callers[kept++] = function;
+    }
+    vm.callerCount = kept;
+}
+
 /** Sweep up all of the unreachable objects.
  */
 static void
@@ -428,6 +635,17 @@ sweep ()
 
         *link = object->next;
 
+        // Dead strings are dropped from the string table as they are
+        // found, so the cost is proportional to the number of them.
+        if (object->type == OBJ_STRING && ((ObjString *) object)->isInterned) {
+#ifdef DEBUG_LOG_GC
+            printf ("sweep: dropping interned string %s ", printableHeapAddr (object));
+            printValue (OBJ_VAL (object));
+            printf ("\n");
+#endif
+            tableDelete (&vm.strings, (ObjString *) object);
+        }
+
 #ifndef DEBUG_FREELESS_GC
         freeObject (object);
 #else
@@ -436,6 +654,12 @@ sweep ()
         vm.unfree_link = &object->next;
 #endif
     }
+
+    // objects restored from a snapshot are never freed, but
+    // those that can change are marked like any other.
+    for (Obj *object = vm.snapshotObjects; object != NULL; object = object->next)
+        if (!object->isPermanent)
+            object->isMarked = false;
 }
 
 /** Run the Mark-Sweep Garbage Collector
@@ -448,10 +672,13 @@ collectGarbage ()
     size_t before = vm.bytesAllocated;
 #endif
 
+    collecting = true;
     markRoots ();
     traceReferences ();
-    tableRemoveWhite (&vm.strings);
+    forgetDeadCallees ();
     sweep ();
+    tablePurge (&vm.strings);
+    collecting = false;
 
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
@@ -460,7 +687,7 @@ collectGarbage ()
 #endif
 }
 
-/** Free all Objects.
+/** Free all Objects, including the permanent region.
  */
 void
 freeObjects ()
@@ -473,6 +700,27 @@ freeObjects ()
         freeObject (object);
         object = next;
     }
+    vm.objects = NULL;
+
+    object = vm.permanentObjects;
+    while (object != NULL) {
+        Obj *next = object->next;
+
+        freeObject (object);
+        object = next;
+    }
+    vm.permanentObjects = NULL;
+
+    while (permanentBlocks != NULL) {
+        PermanentBlock *next = permanentBlocks->next;
+
+        free (permanentBlocks);
+        permanentBlocks = next;
+    }
 
     free (vm.grayStack);
+    free (vm.callers);
+    vm.callers = NULL;
+    vm.callerCount = 0;
+    vm.callerCapacity = 0;
 }
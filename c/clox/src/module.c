@@ -0,0 +1,116 @@
+#define _XOPEN_SOURCE 700               // for realpath and st_mtim
+#include "module.h"
+
+#include "compiler.h"
+#include "file.h"
+#include "image.h"
+#include "memory.h"
+#include "options.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/** @file module.c
+ * @brief Find the script for an imported module
+ *
+ * A module is a Lox source file, or an image of one. With
+ * --cache-modules, the script compiled from a source is also
+ * written next to it as an image, whose name adds a "c" to the
+ * name of the source, and that image is loaded instead for as
+ * long as it is newer than the source.
+ *
+ * Modules are known by their canonical path, so each file runs
+ * once however the imports that name it spell its path.
+ */
+
+extern Options options;         // --cache-modules writes images of modules
+
+/** Check that an image of a source is up to date.
+ *
+ * The times are compared to the nanosecond, and must differ, as
+ * a source edited in the same tick its image was written may
+ * have changed after it. Where the file system keeps only whole
+ * seconds, that means an image from the same second is compiled
+ * again.
+ *
+ * @param image the image file
+ * @param source the source it was compiled from
+ * @returns true if the image is there and newer than the source
+ */
+static bool
+isCurrentImage (const char *image, const char *source)
+{
+    struct stat imageStatus;
+    struct stat sourceStatus;
+
+    if (stat (image, &imageStatus) < 0 || !isImage (image))
+        return false;
+    if (stat (source, &sourceStatus) < 0)
+        return true;
+    if (imageStatus.st_mtim.tv_sec != sourceStatus.st_mtim.tv_sec)
+        return imageStatus.st_mtim.tv_sec > sourceStatus.st_mtim.tv_sec;
+    return imageStatus.st_mtim.tv_nsec > sourceStatus.st_mtim.tv_nsec;
+}
+
+/** Find the name a module is known by.
+ *
+ * @param path the module path, as written in the import statement
+ * @returns the canonical path of the file, or the path as written
+ * if the file can not be found
+ */
+ObjString *
+modulePath (ObjString *path)
+{
+    char *canonical = realpath (stringChars (path), NULL);
+
+    if (NULL == canonical)
+        return path;
+
+    ObjString *name = copyString (canonical, (int) strlen (canonical));
+
+    free (canonical);
+    return name;
+}
+
+/** Get the script of a module.
+ *
+ * @param path the module path, as modulePath gives it
+ * @returns the script, or NULL after reporting why there is none
+ */
+ObjFunction *
+loadModule (ObjString *path)
+{
+    const char *source = stringChars (path);
+
+    if (isImage (source))
+        return loadImage (source);
+
+    int length = (int) strlen (source);
+    char *image = ALLOCATE (char, length + 2);
+
+    memcpy (image, source, length);
+    image[length] = 'c';
+    image[length + 1] = '\0';
+
+    ObjFunction *function = NULL;
+
+    if (isCurrentImage (image, source)) {
+        function = loadImage (image);
+    } else {
+        char *text = readFile (source, NULL);
+
+        if (NULL == text) {
+            fprintf (stderr, "Could not read module \"%s\".\n", source);
+        } else {
+            function = compile (text);
+            FREE_ARRAY (char, text, strlen (text) + 1);
+            if (NULL != function && options.cacheModules)
+                writeImage (function, image);
+        }
+    }
+
+    FREE_ARRAY (char, image, length + 2);
+    return function;
+}
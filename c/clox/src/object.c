@@ -1,3 +1,4 @@
+#define _GNU_SOURCE                     // for memmem
 #include "object.h"
 
 #include "memory.h"
@@ -11,11 +12,20 @@
  * @brief Implementation for the OBJECT module
  */
 
+/** Concatenations no longer than this are copied into a flat string. */
+#define ROPE_LEAF_MAX 256
+
+/** Ropes deeper than this are flattened rather than extended. */
+#define ROPE_MAX_DEPTH 48
+
 /** Allocate an object with the given type.
  */
 #define ALLOCATE_OBJ(type, objectType)          ((type*)allocateObject(sizeof (type), objectType))
 
 /** Allocate a new object.
+ *
+ * While vm.allocPermanent is set, the object is placed in the
+ * permanent region instead of the garbage collected heap.
  *
  * @param size byte needed for the object
  * @param type enumerated object type value to write
@@ -24,13 +34,32 @@
 static Obj *
 allocateObject (size_t size, ObjType type)
 {
-    Obj *object = (Obj *) reallocate (NULL, 0, size);
+    Obj *object;
+
+    if (vm.allocPermanent) {
+        object = (Obj *) allocatePermanent (size);
+        object->type = type;
+        object->isMarked = true;        // never cleared, as sweep does not see it
+        object->isPermanent = true;
+
+        lockHeap ();
+        object->next = vm.permanentObjects;
+        vm.permanentObjects = object;
+        unlockHeap ();
+        return object;
+    }
+
+    object = (Obj *) reallocate (NULL, 0, size);
 
     object->type = type;
     object->isMarked = false;
-    object->next = vm.objects;
+    object->isPermanent = false;
 
+    // compiler threads may also make heap objects; see shareHeap.
+    lockHeap ();
+    object->next = vm.objects;
     vm.objects = object;
+    unlockHeap ();
 
 #ifdef DEBUG_LOG_GC
     printf ("%s allocate %zu for %d\n", printableHeapAddr (object), size, type);
@@ -78,18 +107,41 @@ newClass (ObjString *name)
 ObjClosure *
 newClosure (ObjFunction *function)
 {
-    ObjUpvalue **upvalues = ALLOCATE (ObjUpvalue *, function->upvalueCount);
+    int count = function->upvalueCount;
+    ObjClosure *closure = (ObjClosure *) allocateObject (CLOSURE_SIZE (count), OBJ_CLOSURE);
 
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
+    closure->function = function;
+    closure->upvalueCount = count;
+    for (int i = 0; i < count; i++) {
+        closure->upvalues[i] = NULL;
+        CLOSURE_COPIES (closure)[i] = NIL_VAL;
     }
+    return closure;
+}
 
-    ObjClosure *closure = ALLOCATE_OBJ (ObjClosure, OBJ_CLOSURE);
+/** Return the Closure shared by all uses of a Function.
+ *
+ * A function that captures no upvalues behaves the same in every
+ * closure, so one closure is made on first use and cached in the
+ * function. It goes in the same region as the function, so that a
+ * permanent function does not refer into the heap.
+ *
+ * @param function the compiled code, which must have no upvalues
+ * @returns the ObjClosure object for the function
+ */
+ObjClosure *
+sharedClosure (ObjFunction *function)
+{
+    INVAR (0 == function->upvalueCount, "only functions without upvalues can share a closure");
 
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
-    return closure;
+    if (function->closure == NULL) {
+        bool wasPermanent = vm.allocPermanent;
+
+        vm.allocPermanent = function->obj.isPermanent;
+        function->closure = newClosure (function);
+        vm.allocPermanent = wasPermanent;
+    }
+    return function->closure;
 }
 
 /** Create a new Function object.
@@ -103,7 +155,10 @@ newFunction ()
 
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
+    function->closure = NULL;
+    function->lazy = NULL;
     initChunk (&function->chunk);
     return function;
 }
@@ -156,7 +211,13 @@ allocateString (char *chars, int length, uint32_t hash)
 
     string->length = length;
     string->chars = chars;
+    string->parent = NULL;
+    string->left = NULL;
+    string->right = NULL;
+    string->depth = 0;
     string->hash = hash;
+    string->hasHash = true;
+    string->isInterned = true;
 
     push (OBJ_VAL (string));
     tableSet (&vm.strings, string, NIL_VAL);
@@ -173,7 +234,7 @@ allocateString (char *chars, int length, uint32_t hash)
  * @param length number of bytes to include
  * @returns the 32-bit hash value of the string
  */
-static uint32_t
+uint32_t
 hashString (const char *key, int length)
 {
     uint32_t hash = 216613626lu;
@@ -206,15 +267,20 @@ ObjString *
 takeString (char *chars, int length)
 {
     uint32_t hash = hashString (chars, length);
+
+    lockHeap ();
     ObjString *interned = tableFindString (&vm.strings, chars, length, hash);
 
     if (interned != NULL) {
+        unlockHeap ();
         FREE_ARRAY (char, chars, length + 1);
-
         return interned;
     }
 
-    return allocateString (chars, length, hash);
+    ObjString *string = allocateString (chars, length, hash);
+
+    unlockHeap ();
+    return string;
 }
 
 /** Create a String object with a copy of the specified content
@@ -238,16 +304,440 @@ ObjString *
 copyString (const char *chars, int length)
 {
     uint32_t hash = hashString (chars, length);
+
+    // the lookup and the insert are one step for compiler threads
+    lockHeap ();
     ObjString *interned = tableFindString (&vm.strings, chars, length, hash);
 
+    if (interned == NULL) {
+        char *heapChars = ALLOCATE (char, length + 1);
+
+        memcpy (heapChars, chars, length);
+        heapChars[length] = '\0';
+        interned = allocateString (heapChars, length, hash);
+    }
+    unlockHeap ();
+    return interned;
+}
+
+/** Create a String object without interning it.
+ *
+ * This method TAKES OWNERSHIP of the memory containing the inbound
+ * string data, which must have room for a '\0' after the content.
+ *
+ * Used for strings produced at runtime, which are often discarded
+ * soon after. The string is neither hashed nor entered in the VM's
+ * string table; see internString, which does that on demand.
+ *
+ * @param chars start of the input string
+ * @param length number of bytes in the input string
+ * @returns a new String linking to this content, not interned
+ */
+ObjString *
+makeString (char *chars, int length)
+{
+    ObjString *string = ALLOCATE_OBJ (ObjString, OBJ_STRING);
+
+    string->length = length;
+    string->chars = chars;
+    string->parent = NULL;
+    string->left = NULL;
+    string->right = NULL;
+    string->depth = 0;
+    string->hash = 0;
+    string->hasHash = false;
+    string->isInterned = false;
+    return string;
+}
+
+/** Return the height of the rope tree under this string.
+ *
+ * Flattened ropes count as leaves. Their parents may then
+ * record a depth larger than the actual depth, which is harmless.
+ *
+ * @param string the String object of interest
+ * @returns 0 for flat strings, otherwise the recorded depth
+ */
+static int
+ropeDepth (ObjString *string)
+{
+    return string->chars != NULL ? 0 : string->depth;
+}
+
+/** Create a rope String for the concatenation of two strings.
+ *
+ * @param left the leading part of the new string
+ * @param right the trailing part of the new string
+ * @returns a new String, not interned, with no content of its own
+ */
+static ObjString *
+newRope (ObjString *left, ObjString *right)
+{
+    push (OBJ_VAL (left));              // protect from GC sweep
+    push (OBJ_VAL (right));
+    ObjString *string = ALLOCATE_OBJ (ObjString, OBJ_STRING);
+
+    pop ();
+    pop ();
+
+    int ld = ropeDepth (left);
+    int rd = ropeDepth (right);
+
+    string->length = left->length + right->length;
+    string->chars = NULL;
+    string->parent = NULL;
+    string->left = left;
+    string->right = right;
+    string->depth = 1 + (ld > rd ? ld : rd);
+    string->hash = 0;
+    string->hasHash = false;
+    string->isInterned = false;
+    return string;
+}
+
+/** Create a flat String holding the concatenation of two strings.
+ *
+ * @param a the leading part of the new string
+ * @param b the trailing part of the new string
+ * @returns a new String, not interned, with a copy of the content
+ */
+static ObjString *
+flatConcat (ObjString *a, ObjString *b)
+{
+    const char *ac = stringBytes (a);
+    const char *bc = stringBytes (b);
+    int length = a->length + b->length;
+    char *chars = ALLOCATE (char, length + 1);
+
+    memcpy (chars, ac, a->length);
+    memcpy (chars + a->length, bc, b->length);
+    chars[length] = '\0';
+    return makeString (chars, length);
+}
+
+/** Join two ropes, keeping the result balanced.
+ *
+ * This is the AVL "join" operation: when one side is more than one
+ * level taller than the other, descend its inner spine, join there,
+ * and rotate on the way back up if needed. Existing nodes are never
+ * modified, as they may be shared by other strings.
+ *
+ * @param left the leading part of the new string
+ * @param right the trailing part of the new string
+ * @returns a rope for the concatenation of left and right
+ */
+static ObjString *
+joinRopes (ObjString *left, ObjString *right)
+{
+    int ld = ropeDepth (left);
+    int rd = ropeDepth (right);
+    ObjString *result;
+
+    if (ld > rd + 1) {
+        ObjString *t = joinRopes (left->right, right);
+
+        if (ropeDepth (t) <= ropeDepth (left->left) + 1)
+            return newRope (left->left, t);
+
+        push (OBJ_VAL (t));             // protect from GC sweep
+        if (ropeDepth (t->left) > ropeDepth (t->right)) {
+            ObjString *a = newRope (left->left, t->left->left);
+
+            push (OBJ_VAL (a));
+            ObjString *b = newRope (t->left->right, t->right);
+
+            result = newRope (a, b);
+            pop ();
+        } else {
+            result = newRope (newRope (left->left, t->left), t->right);
+        }
+        pop ();
+        return result;
+    }
+
+    if (rd > ld + 1) {
+        ObjString *t = joinRopes (left, right->left);
+
+        if (ropeDepth (t) <= ropeDepth (right->right) + 1)
+            return newRope (t, right->right);
+
+        push (OBJ_VAL (t));             // protect from GC sweep
+        if (ropeDepth (t->right) > ropeDepth (t->left)) {
+            ObjString *a = newRope (t->left, t->right->left);
+
+            push (OBJ_VAL (a));
+            ObjString *b = newRope (t->right->right, right->right);
+
+            result = newRope (a, b);
+            pop ();
+        } else {
+            result = newRope (t->left, newRope (t->right, right->right));
+        }
+        pop ();
+        return result;
+    }
+
+    return newRope (left, right);
+}
+
+/** Create a String for the concatenation of two strings.
+ *
+ * Short results are copied into a flat string. Longer results are
+ * ropes that share the operands, so building a string by repeated
+ * appends does not copy the accumulated content each time. A short
+ * trailing leaf is merged with a short appended string, to keep the
+ * number of rope nodes down.
+ *
+ * The caller must keep both operands reachable by the GC.
+ *
+ * @param a the leading part of the new string
+ * @param b the trailing part of the new string
+ * @returns a String, not interned, for the concatenation
+ */
+ObjString *
+concatStrings (ObjString *a, ObjString *b)
+{
+    if (a->length == 0)
+        return b;
+    if (b->length == 0)
+        return a;
+    if (a->length + b->length <= ROPE_LEAF_MAX)
+        return flatConcat (a, b);
+
+    ObjString *result;
+
+    if (a->chars == NULL && a->right->chars != NULL && a->right->length + b->length <= ROPE_LEAF_MAX) {
+        ObjString *leaf = flatConcat (a->right, b);
+
+        push (OBJ_VAL (leaf));          // protect from GC sweep
+        result = joinRopes (a->left, leaf);
+        pop ();
+    } else {
+        result = joinRopes (a, b);
+    }
+
+    if (ropeDepth (result) > ROPE_MAX_DEPTH)
+        stringBytes (result);
+    return result;
+}
+
+/** Copy the content of a String into a buffer.
+ *
+ * @param dest where to write the content
+ * @param string the String object to copy
+ */
+static void
+copyChars (char *dest, ObjString *string)
+{
+    if (string->chars != NULL) {
+        memcpy (dest, string->chars, string->length);
+        return;
+    }
+    copyChars (dest, string->left);
+    copyChars (dest + string->left->length, string->right);
+}
+
+/** Return the content of a String, flattening a rope if needed.
+ *
+ * A rope is flattened in place: it gets its own copy of the
+ * content and drops its children. Other ropes sharing this
+ * one are not affected.
+ *
+ * The content of a slice is returned in place, and is not
+ * followed by a '\0'.
+ *
+ * @param string the String object of interest
+ * @returns a pointer to the first of string->length bytes
+ */
+const char *
+stringBytes (ObjString *string)
+{
+    if (string->chars != NULL)
+        return string->chars;
+
+    push (OBJ_VAL (string));            // protect from GC sweep
+    char *chars = ALLOCATE (char, string->length + 1);
+
+    pop ();
+
+    copyChars (chars, string);
+    chars[string->length] = '\0';
+    string->chars = chars;
+    string->left = NULL;
+    string->right = NULL;
+    return chars;
+}
+
+/** Return the content of a String as a C string.
+ *
+ * Ropes are flattened, and slices are given their own copy of
+ * the content (releasing their hold on the parent string).
+ *
+ * @param string the String object of interest
+ * @returns a pointer to the '\0' terminated content
+ */
+char *
+stringChars (ObjString *string)
+{
+    if (string->chars == NULL)
+        stringBytes (string);
+    if (string->parent == NULL)
+        return string->chars;
+
+    push (OBJ_VAL (string));            // protect from GC sweep
+    char *chars = ALLOCATE (char, string->length + 1);
+
+    pop ();
+
+    memcpy (chars, string->chars, string->length);
+    chars[string->length] = '\0';
+    string->chars = chars;
+    string->parent = NULL;
+    return chars;
+}
+
+/** Create a String referring to part of another String.
+ *
+ * The slice shares the bytes of the flat string holding them,
+ * and keeps that string alive; no content is copied. A rope is
+ * flattened first, and a slice of a slice refers directly to
+ * the original parent.
+ *
+ * The caller must keep the string reachable by the GC.
+ *
+ * @param string the String to take the slice from
+ * @param start offset of the first byte of the slice
+ * @param length number of bytes in the slice
+ * @returns a String, not interned, for that part of the string
+ */
+ObjString *
+sliceString (ObjString *string, int start, int length)
+{
+    INVAR (0 <= start && 0 <= length && start + length <= string->length, "slice must be within the string");
+
+    if (length == string->length)
+        return string;
+    if (length == 0)
+        return copyString ("", 0);
+
+    const char *bytes = stringBytes (string);
+    ObjString *parent = string->parent != NULL ? string->parent : string;
+
+    push (OBJ_VAL (string));            // protect from GC sweep
+    ObjString *slice = ALLOCATE_OBJ (ObjString, OBJ_STRING);
+
+    pop ();
+
+    slice->length = length;
+    slice->chars = (char *) bytes + start;
+    slice->parent = parent;
+    slice->left = NULL;
+    slice->right = NULL;
+    slice->depth = 0;
+    slice->hash = 0;
+    slice->hasHash = false;
+    slice->isInterned = false;
+    return slice;
+}
+
+/** Find the first occurrence of one String in another.
+ *
+ * Single byte needles are found with memchr, longer ones
+ * with memmem, both of which are vectorized by the C library.
+ *
+ * @param haystack the String to search in
+ * @param needle the String to search for
+ * @param from offset in the haystack where the search starts
+ * @returns the offset of the first match at or after from
+ * @returns -1 if there is no match
+ */
+int
+stringIndexOf (ObjString *haystack, ObjString *needle, int from)
+{
+    if (from < 0 || from + needle->length > haystack->length)
+        return -1;
+
+    const char *h = stringBytes (haystack);
+    const char *n = stringBytes (needle);
+    const char *found;
+
+    if (needle->length == 0)
+        return from;
+    if (needle->length == 1)
+        found = memchr (h + from, n[0], haystack->length - from);
+    else
+        found = memmem (h + from, haystack->length - from, n, needle->length);
+
+    return found != NULL ? (int) (found - h) : -1;
+}
+
+/** Return the hash value of a string, computing it if needed.
+ *
+ * @param string the String object of interest
+ * @returns the 32-bit hash value of the string
+ */
+uint32_t
+stringHash (ObjString *string)
+{
+    if (!string->hasHash) {
+        string->hash = hashString (stringBytes (string), string->length);
+        string->hasHash = true;
+    }
+    return string->hash;
+}
+
+/** Return the interned String with the same content.
+ *
+ * If the string is already interned, it is returned. If the string
+ * table holds a String with the same content, that one is returned
+ * (and the inbound one is left for the GC). Otherwise, the inbound
+ * string is entered in the string table and returned.
+ *
+ * @param string the String object of interest
+ * @returns the interned String matching this content
+ */
+ObjString *
+internString (ObjString *string)
+{
+    if (string->isInterned)
+        return string;
+
+    uint32_t hash = stringHash (string);
+    ObjString *interned = tableFindString (&vm.strings, string->chars, string->length, hash);
+
     if (interned != NULL)
         return interned;
 
-    char *heapChars = ALLOCATE (char, length + 1);
+    stringChars (string);               // table keys own their content
+    string->isInterned = true;
+    push (OBJ_VAL (string));
+    tableSet (&vm.strings, string, NIL_VAL);
+    pop ();
+    return string;
+}
 
-    memcpy (heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString (heapChars, length, hash);
+/** Decide if two Strings have the same content.
+ *
+ * Two distinct interned strings always differ. Otherwise, the
+ * lengths, hashes, and bytes are compared, in that order.
+ *
+ * @param a the first string to compare
+ * @param b the second string to compare
+ * @returns true if the strings have the same content
+ * @returns false otherwise
+ */
+bool
+stringsEqual (ObjString *a, ObjString *b)
+{
+    if (a == b)
+        return true;
+    if (a->isInterned && b->isInterned)
+        return false;
+    if (a->length != b->length)
+        return false;
+    if (stringHash (a) != stringHash (b))
+        return false;
+    return 0 == memcmp (stringBytes (a), stringBytes (b), a->length);
 }
 
 /** Create a new Upvalue Object referencing the indicated slot.
@@ -262,10 +752,27 @@ newUpvalue (Value *slot)
 
     upvalue->location = slot;
     upvalue->closed = NIL_VAL;
-    upvalue->next = NULL;
     return upvalue;
 }
 
+/** Print a String object without flattening it.
+ *
+ * Printing does not need the content in one piece, and must not
+ * allocate, as it is also used while logging GC activity.
+ *
+ * @param string the object to print
+ */
+static void
+printString (ObjString *string)
+{
+    if (string->chars != NULL) {
+        printf ("%.*s", string->length, string->chars);
+        return;
+    }
+    printString (string->left);
+    printString (string->right);
+}
+
 /** Print a Function object
  *
  * @param function the object to print
@@ -316,7 +823,7 @@ printObject (Value value)
         return;
 
     case OBJ_STRING:
-        printf ("%s", AS_CSTRING (value));
+        printString (AS_STRING (value));
         return;
 
     case OBJ_UPVALUE:
@@ -1,9 +1,11 @@
 #include "object.h"
 
 #include "error_log.h"
+#include "memory.h"
 #include "vm.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #define DEBUG_OBJECT_BIST
 
@@ -135,6 +137,55 @@ bistObject ()
     printValue (valUpvalue);
     printf ("'\n");
 
+    // Long concatenations are ropes, flattened when the bytes are needed.
+
+    ObjString *rope = copyString ("", 0);
+
+    push (OBJ_VAL (rope));              // so GC does not reap it
+    for (int i = 0; i < 30; ++i) {
+        rope = concatStrings (rope, objString);
+        pop ();
+        push (OBJ_VAL (rope));
+    }
+    INVAR (300 == rope->length, "expecting 30 copies of testObject");
+    INVAR (NULL == rope->chars, "expecting a long concatenation to be a rope");
+    INVAR (rope->depth < 10, "expecting rope to be balanced");
+
+    ObjString *flat = copyString ("testObject", 10);
+
+    push (OBJ_VAL (flat));              // so GC does not reap it
+    for (int i = 1; i < 30; ++i) {
+        flat = concatStrings (flat, objString);
+        stringChars (flat);
+        pop ();
+        push (OBJ_VAL (flat));
+    }
+    flat = internString (flat);
+    INVAR (valuesEqual (OBJ_VAL (rope), OBJ_VAL (flat)), "expecting rope to equal the flat string");
+    INVAR (NULL != rope->chars, "expecting comparison to flatten the rope");
+    INVAR (0 == memcmp (rope->chars, flat->chars, 300), "expecting flattened rope to hold the content");
+    INVAR (flat == internString (rope), "expecting rope to intern as the flat string");
+    pop ();
+    pop ();
+    collectGarbage ();                  // drop the intermediate strings
+
+    // Slices share the bytes of their parent until interned.
+
+    ObjString *slice = sliceString (objString, 4, 6);
+
+    push (OBJ_VAL (slice));             // so GC does not reap it
+    INVAR (objString == slice->parent, "expecting slice to refer to its parent");
+    INVAR (objString->chars + 4 == slice->chars, "expecting slice to share the parent bytes");
+    INVAR (4 == stringIndexOf (objString, slice, 0), "expecting to find the slice in its parent");
+    INVAR (-1 == stringIndexOf (objString, slice, 5), "expecting no match after the slice");
+
+    ObjString *object = copyString ("Object", 6);
+
+    INVAR (object == internString (slice), "expecting slice to intern as the existing string");
+    INVAR (objString == slice->parent, "expecting slice to stay a slice when a match is interned");
+    pop ();
+    collectGarbage ();                  // drop the slice
+
     /* end of test: dump the stack and object list. */
 
     while (vm.sp > sp) {
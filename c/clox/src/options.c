@@ -36,8 +36,21 @@ static const char *help_text[] = {
     "    -V, --no-verbose    turn down verbose operation flag",
     "    -N, --no-dryrun     turn down dryrun flag",
     "    -D, --no-debug      turn down debug level",
+    "        --post          run the power-on self tests",
     "        --bist          run the built-in self test",
     "        --demo          run the quick demo code",
+    "        --compile FILE  compile the files named after this into",
+    "                        the image FILE, instead of running them",
+    "        --lazy          compile each function body when it is",
+    "                        first called (not when writing an image)",
+    "        --jobs N        compile the files named after this on N",
+    "                        threads, then run them in order",
+    "        --cache-modules write an image of each imported module",
+    "                        next to it, used until the source changes",
+    "        --snapshot FILE write the heap to FILE after running the",
+    "                        files named, for --restore to start from",
+    "        --restore FILE  start from the heap in the snapshot FILE;",
+    "                        this must come before the files to run",
     "",
     "    Multiple short flags can be combined (so -dv will turn up both the",
     "    debug and verbose levels).",
@@ -131,6 +144,12 @@ parse_options (int argc, const char **argv)
                     continue;
                 }
 
+                if (!strcmp ("post", argp + 2)) {
+                    INVAR (options.post, "options: no post function pointer.");
+                    options.post ();
+                    continue;
+                }
+
                 if (!strcmp ("bist", argp + 2)) {
                     INVAR (options.bist, "options: no bist function pointer.");
                     options.bist ();
@@ -143,6 +162,54 @@ parse_options (int argc, const char **argv)
                     continue;
                 }
 
+                if (!strcmp ("lazy", argp + 2)) {
+                    options.lazy = true;
+                    continue;
+                }
+
+                if (!strcmp ("cache-modules", argp + 2)) {
+                    options.cacheModules = true;
+                    continue;
+                }
+
+                if (!strcmp ("jobs", argp + 2)) {
+                    if (argi >= argc || atoi (argv[argi]) < 1) {
+                        fprintf (stderr, "--jobs needs a number of threads\n");
+                        exit (EX_USAGE);
+                    }
+                    options.jobs = atoi (argv[argi++]);
+                    continue;
+                }
+
+                if (!strcmp ("snapshot", argp + 2)) {
+                    if (argi >= argc) {
+                        fprintf (stderr, "--snapshot needs the name of the file to write\n");
+                        exit (EX_USAGE);
+                    }
+                    options.snapshotTo = argv[argi++];
+                    continue;
+                }
+
+                if (!strcmp ("restore", argp + 2)) {
+                    if (argi >= argc) {
+                        fprintf (stderr, "--restore needs the name of the snapshot\n");
+                        exit (EX_USAGE);
+                    }
+                    INVAR (options.restore, "options: no restore function pointer.");
+                    options.restore (argv[argi++]);
+                    continue;
+                }
+
+                if (!strcmp ("compile", argp + 2)) {
+                    if (argi >= argc) {
+                        fprintf (stderr, "--compile needs the name of the image to write\n");
+                        exit (EX_USAGE);
+                    }
+                    options.compileTo = argv[argi++];
+                    autoRepl = false;
+                    continue;
+                }
+
             } else {
 
                 if (argp[1] == '\0') {
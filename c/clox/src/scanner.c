@@ -6,7 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 
-Scanner scanner;                ///< Storage for scanner state
+THREAD_LOCAL Scanner scanner;   ///< Storage for scanner state, one per thread
 
 /** Initialize the scanne
  *
@@ -14,10 +14,41 @@ Scanner scanner;                ///< Storage for scanner state
  */
 void
 initScanner (const char *source)
+{
+    initScannerAt (source, 1);
+}
+
+/** Initialize the scanner for text taken from inside a source.
+ *
+ * @param source start looking at this text
+ * @param line line number of the start of the text
+ */
+void
+initScannerAt (const char *source, int line)
 {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
+}
+
+/** Take a copy of the scanner state, to go back to later.
+ *
+ * @returns where the scanner has got to
+ */
+Scanner
+saveScanner ()
+{
+    return scanner;
+}
+
+/** Go back to a scanner state taken by saveScanner.
+ *
+ * @param saved where the scanner had got to
+ */
+void
+restoreScanner (Scanner saved)
+{
+    scanner = saved;
 }
 
 /** Does Lox consider this characer to be a Digit?
@@ -291,7 +322,6 @@ identifierType ()
     case 'a': return checkKeyword (1, 2, "nd", TOKEN_AND);
     case 'c': return checkKeyword (1, 4, "lass", TOKEN_CLASS);
     case 'e': return checkKeyword (1, 3, "lse", TOKEN_ELSE);
-    case 'i': return checkKeyword (1, 1, "f", TOKEN_IF);
     case 'n': return checkKeyword (1, 2, "il", TOKEN_NIL);
     case 'o': return checkKeyword (1, 1, "r", TOKEN_OR);
     case 'p': return checkKeyword (1, 4, "rint", TOKEN_PRINT);
@@ -300,6 +330,15 @@ identifierType ()
     case 'v': return checkKeyword (1, 2, "ar", TOKEN_VAR);
     case 'w': return checkKeyword (1, 4, "hile", TOKEN_WHILE);
 
+    case 'i':
+        if (scanner.current - scanner.start > 1) {
+            switch (scanner.start[1]) {
+            case 'f': return checkKeyword(2, 0, "", TOKEN_IF);
+            case 'm': return checkKeyword(2, 4, "port", TOKEN_IMPORT);
+            }
+        }
+        break;
+
     case 'f':
         if (scanner.current - scanner.start > 1) {
             switch (scanner.start[1]) {
@@ -6,7 +6,7 @@
  * @brief Built-In Self Test for the SCANNER module.
  */
 
-extern Scanner scanner;         // peek at scanner state
+extern THREAD_LOCAL Scanner scanner;         // peek at scanner state
 
 /** Run all BIST cases for Scanner.
  */
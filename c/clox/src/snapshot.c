@@ -0,0 +1,754 @@
+#include "snapshot.h"
+
+#include "chunk.h"
+#include "compiler.h"
+#include "error_log.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** @file snapshot.c
+ * @brief Save the heap to a file, and map it back in
+ *
+ * A snapshot is a header, then the tables the VM starts from,
+ * then every object they reach, each followed by the arrays it
+ * owns, laid out just as they are in memory. Each pointer is
+ * written as an offset from the start of the file, and listed
+ * in the relocation list at the end; restoring maps the file
+ * and adds the address of the mapping to each of them, in one
+ * pass. Native functions are listed apart, by their place in
+ * the list nativeIndex searches.
+ *
+ * The restored objects live in the mapping until the VM is
+ * freed. Strings, functions and natives never change, so they
+ * are made permanent. The others are marked like heap objects,
+ * as they may come to refer to the heap, but are never freed.
+ * Their tables are copied to the heap, where they can grow.
+ */
+
+/** Alignment of each record in a snapshot */
+#define SNAPSHOT_ALIGN 8
+
+/** Make room for one more element at the end of an array being built. */
+#define GROW_TO_FIT(type, array, count, capacity)                       \
+    do {                                                                \
+        if ((capacity) < (count) + 1) {                                 \
+            int oldCapacity = (capacity);                               \
+            (capacity) = GROW_CAPACITY (oldCapacity);                   \
+            (array) = GROW_ARRAY (type, (array), oldCapacity, (capacity)); \
+        }                                                               \
+    } while (0)
+
+/** Start of a snapshot file
+ */
+struct SnapshotHeader {
+    char magic[4];              ///< SNAPSHOT_MAGIC, with no terminator
+    uint32_t version;           ///< SNAPSHOT_VERSION of the build that wrote it
+    uint32_t opcodes;           ///< opcodeHash of the build that wrote it
+    uint32_t natives;           ///< number of natives in the build that wrote it
+    uint32_t layout;            ///< hash of the structure sizes in the build that wrote it
+    uint32_t size;              ///< number of bytes in the file
+    uint32_t relocations;       ///< offset of the relocation list
+    uint32_t relocationCount;   ///< number of pointers to relocate
+    uint32_t nativeSlots;       ///< offset of the native slot list
+    uint32_t nativeSlotCount;   ///< number of native slots
+};
+
+/** Tables and lists the VM starts from, just after the header
+ */
+struct SnapshotRoots {
+    Table globals;              ///< vm.globals
+    Table strings;              ///< vm.strings
+    Table modules;              ///< vm.modules
+    ObjString *initString;      ///< vm.initString
+    Obj *objects;               ///< linked list of all objects in the snapshot
+};
+
+/** Native function slot, filled in when a snapshot is restored
+ */
+struct SnapshotNative {
+    uint32_t at;                ///< offset of the function field of an ObjNative
+    uint32_t index;             ///< place of the function, as nativeIndex gives it
+};
+
+/** Offset given to an object in a snapshot being written
+ */
+struct SnapshotSlot {
+    Obj *object;                ///< the object, or NULL for an empty slot
+    uint32_t offset;            ///< where it was written, or 0 if not yet
+};
+
+/** Pointer in a snapshot being written, to an object not yet placed
+ */
+struct SnapshotFixup {
+    uint32_t at;                ///< offset of the pointer
+    Obj *target;                ///< object it points to
+};
+
+/** State of a snapshot being written
+ */
+struct SnapshotWriter {
+    uint8_t *bytes;             ///< the snapshot as it is built
+    int count;                  ///< number of bytes written
+    int capacity;               ///< allocated size of bytes
+    SnapshotSlot *slots;        ///< hash of every object found, by address
+    int slotCount;              ///< number of objects found
+    int slotCapacity;           ///< allocated size of slots, a power of two
+    Obj **pending;              ///< objects found but not yet written
+    int pendingCount;           ///< number of pending objects
+    int pendingCapacity;        ///< allocated size of pending
+    SnapshotFixup *fixups;      ///< pointers to objects, to fill in at the end
+    int fixupCount;             ///< number of fixups
+    int fixupCapacity;          ///< allocated size of fixups
+    uint32_t *relocations;      ///< offset of every pointer written
+    int relocationCount;        ///< number of relocations
+    int relocationCapacity;     ///< allocated size of relocations
+    SnapshotNative *natives;    ///< native slots
+    int nativeCount;            ///< number of native slots
+    int nativeCapacity;         ///< allocated size of natives
+    uint32_t lastLink;          ///< offset of the link to the next object written
+    const char *error;          ///< why the snapshot can not be written, or NULL
+};
+
+static void *mappedBase = NULL; ///< where the restored snapshot is mapped
+static size_t mappedSize = 0;   ///< length of the mapping
+
+/** Hash the sizes of the structures a snapshot holds.
+ *
+ * @returns an FNV-1a hash that changes if any of them does
+ */
+static uint32_t
+layoutHash ()
+{
+    const uint32_t sizes[] = {
+        sizeof (void *), sizeof (Value), sizeof (Entry), sizeof (Table),
+        sizeof (Chunk), sizeof (CallSite), sizeof (SnapshotRoots),
+        sizeof (ObjBoundMethod), sizeof (ObjClass), sizeof (ObjClosure), sizeof (ObjFunction),
+        sizeof (ObjInstance), sizeof (ObjNative), sizeof (ObjString), sizeof (ObjUpvalue),
+    };
+
+    const uint8_t *bytes = (const uint8_t *) sizes;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof sizes; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/** Add zeroed bytes to a snapshot being written.
+ *
+ * The bytes may move, so offsets are kept, not pointers.
+ *
+ * @param writer the snapshot being written
+ * @param size number of bytes, rounded up to SNAPSHOT_ALIGN
+ * @returns the offset of the first of them
+ */
+static uint32_t
+reserve (SnapshotWriter *writer, size_t size)
+{
+    uint32_t at = (uint32_t) writer->count;
+
+    size = (size + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+    if (writer->count + (int) size > writer->capacity) {
+        int oldCapacity = writer->capacity;
+
+        while (writer->capacity < writer->count + (int) size)
+            writer->capacity = GROW_CAPACITY (writer->capacity);
+        writer->bytes = GROW_ARRAY (uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+    memset (writer->bytes + at, 0, size);
+    writer->count += (int) size;
+    return at;
+}
+
+/** Write a pointer to a place in the snapshot, and list it for relocation.
+ *
+ * @param writer the snapshot being written
+ * @param at offset of the pointer
+ * @param offset offset of what it points to
+ */
+static void
+putOffset (SnapshotWriter *writer, uint32_t at, uint32_t offset)
+{
+    uintptr_t pointer = offset;
+
+    memcpy (writer->bytes + at, &pointer, sizeof pointer);
+    GROW_TO_FIT (uint32_t, writer->relocations, writer->relocationCount, writer->relocationCapacity);
+    writer->relocations[writer->relocationCount++] = at;
+}
+
+/** Copy an array into the snapshot.
+ *
+ * @param writer the snapshot being written
+ * @param data the array
+ * @param size number of bytes in it
+ * @returns the offset of the copy
+ */
+static uint32_t
+appendArray (SnapshotWriter *writer, const void *data, size_t size)
+{
+    uint32_t offset = reserve (writer, size);
+
+    if (0 != size)
+        memcpy (writer->bytes + offset, data, size);
+    return offset;
+}
+
+/** Copy an array into the snapshot, and point a field at it.
+ *
+ * @param writer the snapshot being written
+ * @param at offset of the pointer field
+ * @param data the array
+ * @param size number of bytes in it; the field is left NULL if 0
+ * @returns the offset of the copy
+ */
+static uint32_t
+putArray (SnapshotWriter *writer, uint32_t at, const void *data, size_t size)
+{
+    if (0 == size)
+        return 0;
+
+    uint32_t offset = appendArray (writer, data, size);
+
+    putOffset (writer, at, offset);
+    return offset;
+}
+
+/** Find the slot of an object, or where it would go.
+ *
+ * @param writer the snapshot being written
+ * @param object the object of interest
+ * @returns its slot, or the empty slot to put it in
+ */
+static SnapshotSlot *
+findSlot (SnapshotWriter *writer, Obj *object)
+{
+    uint32_t index = (uint32_t) (((uintptr_t) object >> 3) * 2654435761u) & (writer->slotCapacity - 1);
+
+    for (;;) {
+        SnapshotSlot *slot = &writer->slots[index];
+
+        if (slot->object == object || NULL == slot->object)
+            return slot;
+        index = (index + 1) & (writer->slotCapacity - 1);
+    }
+}
+
+/** Note an object that the snapshot must hold.
+ *
+ * @param writer the snapshot being written
+ * @param object the object, which is queued if it is new
+ */
+static void
+discover (SnapshotWriter *writer, Obj *object)
+{
+    if (writer->slotCount + 1 > writer->slotCapacity * 3 / 4) {
+        SnapshotSlot *slots = writer->slots;
+        int capacity = writer->slotCapacity;
+
+        writer->slotCapacity = capacity < 64 ? 64 : capacity * 2;
+        writer->slots = ALLOCATE (SnapshotSlot, writer->slotCapacity);
+        memset (writer->slots, 0, sizeof (SnapshotSlot) * writer->slotCapacity);
+        for (int i = 0; i < capacity; i++)
+            if (NULL != slots[i].object)
+                *findSlot (writer, slots[i].object) = slots[i];
+        FREE_ARRAY (SnapshotSlot, slots, capacity);
+    }
+
+    SnapshotSlot *slot = findSlot (writer, object);
+
+    if (NULL != slot->object)
+        return;
+    slot->object = object;
+    slot->offset = 0;
+    writer->slotCount++;
+
+    GROW_TO_FIT (Obj *, writer->pending, writer->pendingCount, writer->pendingCapacity);
+    writer->pending[writer->pendingCount++] = object;
+}
+
+/** Write a pointer to an object, which will be placed later.
+ *
+ * @param writer the snapshot being written
+ * @param at offset of the pointer
+ * @param target the object, or NULL
+ */
+static void
+putObject (SnapshotWriter *writer, uint32_t at, Obj *target)
+{
+    memset (writer->bytes + at, 0, sizeof (Obj *));
+    if (NULL == target)
+        return;
+
+    discover (writer, target);
+    GROW_TO_FIT (SnapshotFixup, writer->fixups, writer->fixupCount, writer->fixupCapacity);
+    writer->fixups[writer->fixupCount].at = at;
+    writer->fixups[writer->fixupCount].target = target;
+    writer->fixupCount++;
+}
+
+/** Write a value into the snapshot.
+ *
+ * @param writer the snapshot being written
+ * @param at offset of the value
+ * @param value the value
+ */
+static void
+putValue (SnapshotWriter *writer, uint32_t at, Value value)
+{
+    memcpy (writer->bytes + at, &value, sizeof value);
+    if (IS_OBJ (value))
+        putObject (writer, at + offsetof (Value, as.obj), AS_OBJ (value));
+}
+
+/** Write the entries of a table, already copied into the snapshot.
+ *
+ * @param writer the snapshot being written
+ * @param at offset of the copy of the Table
+ * @param table the table itself
+ */
+static void
+putTable (SnapshotWriter *writer, uint32_t at, Table *table)
+{
+    uint32_t entries = putArray (writer, at + offsetof (Table, entries), table->entries, sizeof (Entry) * table->capacity);
+
+    for (int i = 0; i < table->capacity; i++) {
+        uint32_t entry = entries + i * sizeof (Entry);
+
+        putObject (writer, entry + offsetof (Entry, key), (Obj *) table->entries[i].key);
+        putValue (writer, entry + offsetof (Entry, value), table->entries[i].value);
+    }
+}
+
+/** Write the arrays of a function, already copied into the snapshot.
+ *
+ * @param writer the snapshot being written
+ * @param at offset of the copy of the ObjFunction
+ * @param function the function itself
+ */
+static void
+putFunction (SnapshotWriter *writer, uint32_t at, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    uint32_t base = at + offsetof (ObjFunction, chunk);
+    Chunk *copy = (Chunk *) (writer->bytes + base);
+
+    copy->capacity = chunk->count;
+    copy->lineCapacity = chunk->lineCount;
+    copy->constants.capacity = chunk->constants.count;
+    copy->callCapacity = chunk->callCount;
+    copy->isImage = true;
+    copy->isPacked = false;
+    copy->hasCallees = false;
+
+    putObject (writer, at + offsetof (ObjFunction, name), (Obj *) function->name);
+    putObject (writer, at + offsetof (ObjFunction, closure), (Obj *) function->closure);
+    putArray (writer, base + offsetof (Chunk, code), chunk->code, chunk->count);
+    putArray (writer, base + offsetof (Chunk, lines), chunk->lines, sizeof (LineStart) * chunk->lineCount);
+
+    uint32_t constants = putArray (writer, base + offsetof (Chunk, constants.values), chunk->constants.values, sizeof (Value) * chunk->constants.count);
+
+    for (int i = 0; i < chunk->constants.count; i++)
+        putValue (writer, constants + i * sizeof (Value), chunk->constants.values[i]);
+
+    // the callee caches start out empty, as they do when compiled.
+    uint32_t calls = putArray (writer, base + offsetof (Chunk, calls), chunk->calls, sizeof (CallSite) * chunk->callCount);
+
+    for (int i = 0; i < chunk->callCount; i++)
+        ((CallSite *) (writer->bytes + calls))[i].callee = NULL;
+}
+
+/** Write an object into the snapshot.
+ *
+ * @param writer the snapshot being written
+ * @param object the object, which has been discovered
+ */
+static void
+writeObject (SnapshotWriter *writer, Obj *object)
+{
+    size_t size = 0;
+    bool permanent = false;
+
+    switch (object->type) {
+    case OBJ_BOUND_METHOD:
+        size = sizeof (ObjBoundMethod);
+        break;
+    case OBJ_CLASS:
+        size = sizeof (ObjClass);
+        break;
+    case OBJ_CLOSURE:
+        size = CLOSURE_SIZE (((ObjClosure *) object)->upvalueCount);
+        break;
+    case OBJ_FUNCTION:
+        // a lazy body is compiled now, as its first call would.
+        if (NULL != ((ObjFunction *) object)->lazy && !compileLazy ((ObjFunction *) object))
+            writer->error = "a function does not compile";
+        size = sizeof (ObjFunction);
+        permanent = true;
+        break;
+    case OBJ_INSTANCE:
+        size = sizeof (ObjInstance);
+        break;
+    case OBJ_NATIVE:
+        size = sizeof (ObjNative);
+        permanent = true;
+        break;
+    case OBJ_STRING:
+        stringChars ((ObjString *) object);
+        size = sizeof (ObjString);
+        permanent = true;
+        break;
+    case OBJ_UPVALUE:
+        if (((ObjUpvalue *) object)->location != &((ObjUpvalue *) object)->closed)
+            writer->error = "a variable is still on the stack";
+        size = sizeof (ObjUpvalue);
+        break;
+    }
+
+    uint32_t at = reserve (writer, size);
+    Obj *copy = (Obj *) (writer->bytes + at);
+
+    memcpy (copy, object, size);
+    copy->isMarked = permanent;
+    copy->isPermanent = permanent;
+    copy->next = NULL;
+    findSlot (writer, object)->offset = at;
+    putOffset (writer, writer->lastLink, at);
+    writer->lastLink = at + offsetof (Obj, next);
+
+    switch (object->type) {
+    case OBJ_BOUND_METHOD:{
+            ObjBoundMethod *bound = (ObjBoundMethod *) object;
+
+            putValue (writer, at + offsetof (ObjBoundMethod, receiver), bound->receiver);
+            putObject (writer, at + offsetof (ObjBoundMethod, method), (Obj *) bound->method);
+            return;
+        }
+
+    case OBJ_CLASS:{
+            ObjClass *klass = (ObjClass *) object;
+
+            putObject (writer, at + offsetof (ObjClass, name), (Obj *) klass->name);
+            putTable (writer, at + offsetof (ObjClass, methods), &klass->methods);
+            return;
+        }
+
+    case OBJ_CLOSURE:{
+            ObjClosure *closure = (ObjClosure *) object;
+
+            putObject (writer, at + offsetof (ObjClosure, function), (Obj *) closure->function);
+            uint32_t copies = at + offsetof (ObjClosure, upvalues) + CLOSURE_COPIES_OFFSET (closure->upvalueCount);
+
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                putObject (writer, at + offsetof (ObjClosure, upvalues) + i * sizeof (ObjUpvalue *), (Obj *) closure->upvalues[i]);
+                putValue (writer, copies + i * sizeof (Value), CLOSURE_COPIES (closure)[i]);
+            }
+            return;
+        }
+
+    case OBJ_FUNCTION:{
+            ((ObjFunction *) copy)->lazy = NULL;
+            putFunction (writer, at, (ObjFunction *) object);
+            return;
+        }
+
+    case OBJ_INSTANCE:{
+            ObjInstance *instance = (ObjInstance *) object;
+
+            putObject (writer, at + offsetof (ObjInstance, klass), (Obj *) instance->klass);
+            putTable (writer, at + offsetof (ObjInstance, fields), &instance->fields);
+            return;
+        }
+
+    case OBJ_NATIVE:{
+            int index = nativeIndex (((ObjNative *) object)->function);
+
+            if (index < 0)
+                writer->error = "a native function is not built in";
+            ((ObjNative *) copy)->function = NULL;
+            GROW_TO_FIT (SnapshotNative, writer->natives, writer->nativeCount, writer->nativeCapacity);
+            writer->natives[writer->nativeCount].at = at + offsetof (ObjNative, function);
+            writer->natives[writer->nativeCount].index = (uint32_t) index;
+            writer->nativeCount++;
+            return;
+        }
+
+    case OBJ_STRING:{
+            ObjString *string = (ObjString *) object;
+
+            putArray (writer, at + offsetof (ObjString, chars), string->chars, string->length + 1);
+            return;
+        }
+
+    case OBJ_UPVALUE:{
+            ObjUpvalue *upvalue = (ObjUpvalue *) object;
+
+            putOffset (writer, at + offsetof (ObjUpvalue, location), at + offsetof (ObjUpvalue, closed));
+            putValue (writer, at + offsetof (ObjUpvalue, closed), upvalue->closed);
+            return;
+        }
+    }
+    UNREACHABLE ("corrupted object type");
+}
+
+/** Save the heap as a snapshot.
+ *
+ * The garbage is collected first, then everything reachable
+ * from the globals, the string table and the module table is
+ * written. This must be called between scripts, with nothing
+ * on the stack.
+ *
+ * @param path name of the file to write
+ * @returns true if the snapshot was written, or
+ * @returns false after reporting why it was not
+ */
+bool
+writeSnapshot (const char *path)
+{
+    SnapshotWriter writer;
+
+    memset (&writer, 0, sizeof writer);
+    collectGarbage ();
+
+    reserve (&writer, sizeof (SnapshotHeader));
+
+    uint32_t roots = reserve (&writer, sizeof (SnapshotRoots));
+    SnapshotRoots *copy = (SnapshotRoots *) (writer.bytes + roots);
+
+    copy->globals = vm.globals;
+    copy->strings = vm.strings;
+    copy->modules = vm.modules;
+    writer.lastLink = roots + offsetof (SnapshotRoots, objects);
+    putTable (&writer, roots + offsetof (SnapshotRoots, globals), &vm.globals);
+    putTable (&writer, roots + offsetof (SnapshotRoots, strings), &vm.strings);
+    putTable (&writer, roots + offsetof (SnapshotRoots, modules), &vm.modules);
+    putObject (&writer, roots + offsetof (SnapshotRoots, initString), (Obj *) vm.initString);
+
+    while (writer.pendingCount > 0)
+        writeObject (&writer, writer.pending[--writer.pendingCount]);
+
+    for (int i = 0; i < writer.fixupCount; i++)
+        putOffset (&writer, writer.fixups[i].at, findSlot (&writer, writer.fixups[i].target)->offset);
+
+    SnapshotHeader header;
+
+    memset (&header, 0, sizeof header);
+    memcpy (header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+    header.version = SNAPSHOT_VERSION;
+    header.opcodes = opcodeHash ();
+    header.natives = (uint32_t) nativeCount ();
+    header.layout = layoutHash ();
+    header.relocationCount = (uint32_t) writer.relocationCount;
+    header.relocations = appendArray (&writer, writer.relocations, sizeof (uint32_t) * writer.relocationCount);
+    header.nativeSlotCount = (uint32_t) writer.nativeCount;
+    header.nativeSlots = appendArray (&writer, writer.natives, sizeof (SnapshotNative) * writer.nativeCount);
+    header.size = (uint32_t) writer.count;
+    memcpy (writer.bytes, &header, sizeof header);
+
+    FILE *file = NULL;
+    bool written = NULL == writer.error && NULL != (file = fopen (path, "wb"))
+        && (size_t) writer.count == fwrite (writer.bytes, 1, writer.count, file);
+
+    if (NULL != file && 0 != fclose (file))
+        written = false;
+    if (NULL != writer.error)
+        fprintf (stderr, "Could not write snapshot \"%s\": %s.\n", path, writer.error);
+    else if (!written)
+        fprintf (stderr, "Could not write snapshot \"%s\".\n", path);
+
+    FREE_ARRAY (SnapshotNative, writer.natives, writer.nativeCapacity);
+    FREE_ARRAY (uint32_t, writer.relocations, writer.relocationCapacity);
+    FREE_ARRAY (SnapshotFixup, writer.fixups, writer.fixupCapacity);
+    FREE_ARRAY (Obj *, writer.pending, writer.pendingCapacity);
+    FREE_ARRAY (SnapshotSlot, writer.slots, writer.slotCapacity);
+    FREE_ARRAY (uint8_t, writer.bytes, writer.capacity);
+    return written;
+}
+
+/** Report why a snapshot could not be restored.
+ *
+ * Any mapping is released, as none of it is in use yet.
+ *
+ * @param path name of the file
+ * @param message what is wrong with it
+ * @returns false, for the caller to return
+ */
+static bool
+snapshotError (const char *path, const char *message)
+{
+    if (NULL != mappedBase)
+        munmap (mappedBase, mappedSize);
+    mappedBase = NULL;
+    mappedSize = 0;
+    fprintf (stderr, "Could not restore snapshot \"%s\": %s.\n", path, message);
+    return false;
+}
+
+/** Give a table restored from a snapshot its own entries on the heap.
+ *
+ * @param table the table, with entries still in the mapping
+ */
+static void
+copyTable (Table *table)
+{
+    if (NULL == table->entries)
+        return;
+
+    Entry *entries = ALLOCATE (Entry, table->capacity);
+
+    memcpy (entries, table->entries, sizeof (Entry) * table->capacity);
+    table->entries = entries;
+}
+
+/** Check that a list in a snapshot lies within the file.
+ *
+ * @param header the header, with size already checked
+ * @param offset where the list starts
+ * @param count number of elements
+ * @param size bytes in each element
+ * @returns true if the whole list is in the file
+ */
+static bool
+inFile (const SnapshotHeader *header, uint32_t offset, uint32_t count, size_t size)
+{
+    return offset >= sizeof (SnapshotHeader) && offset <= header->size && count <= (header->size - offset) / size;
+}
+
+/** Restore the heap from a snapshot, in place of a fresh VM.
+ *
+ * The file is mapped, and stays mapped until freeSnapshots. The
+ * version, the opcode and native counts, and the structure sizes
+ * must all match, and each pointer must land in the file. The
+ * rest is trusted to be as writeSnapshot left it: there is no
+ * checksum, and the bytecode is not verified again, as reading
+ * the whole file would cost more than mapping it.
+ *
+ * This must come before any code is compiled or run, as the
+ * objects of the VM are replaced by those in the snapshot.
+ *
+ * @param path name of the file
+ * @returns true if the snapshot was restored, or
+ * @returns false after reporting why it was not
+ */
+bool
+restoreSnapshot (const char *path)
+{
+    if (NULL != vm.permanentObjects || NULL != vm.snapshotObjects)
+        return snapshotError (path, "code has already been run");
+
+    int fd = open (path, O_RDONLY);
+    struct stat status;
+
+    if (fd < 0 || fstat (fd, &status) < 0) {
+        if (fd >= 0)
+            close (fd);
+        return snapshotError (path, "file can not be read");
+    }
+    if ((size_t) status.st_size < sizeof (SnapshotHeader) + sizeof (SnapshotRoots)) {
+        close (fd);
+        return snapshotError (path, "file is too short");
+    }
+
+    // a private mapping, so the pointers can be relocated in place.
+    mappedSize = (size_t) status.st_size;
+    mappedBase = mmap (NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (MAP_FAILED == mappedBase) {
+        mappedBase = NULL;
+        return snapshotError (path, "file can not be mapped");
+    }
+
+    uint8_t *base = mappedBase;
+    const SnapshotHeader *header = mappedBase;
+
+    if (0 != memcmp (header->magic, SNAPSHOT_MAGIC, sizeof header->magic))
+        return snapshotError (path, "file is not a snapshot");
+    if (header->version != SNAPSHOT_VERSION || header->opcodes != opcodeHash ()
+        || header->natives != (uint32_t) nativeCount () || header->layout != layoutHash ())
+        return snapshotError (path, "snapshot is from a different build of clox");
+    if (header->size != mappedSize)
+        return snapshotError (path, "snapshot is truncated");
+    if (!inFile (header, header->relocations, header->relocationCount, sizeof (uint32_t))
+        || !inFile (header, header->nativeSlots, header->nativeSlotCount, sizeof (SnapshotNative)))
+        return snapshotError (path, "lists are malformed");
+
+    const uint32_t *relocations = (const uint32_t *) (base + header->relocations);
+    const SnapshotNative *natives = (const SnapshotNative *) (base + header->nativeSlots);
+
+    for (uint32_t i = 0; i < header->relocationCount; i++) {
+        uintptr_t *pointer = (uintptr_t *) (base + relocations[i]);
+
+        if (relocations[i] % sizeof (uintptr_t) != 0 || !inFile (header, relocations[i], 1, sizeof (uintptr_t))
+            || *pointer >= header->relocations)
+            return snapshotError (path, "a pointer is out of range");
+        *pointer += (uintptr_t) base;
+    }
+    for (uint32_t i = 0; i < header->nativeSlotCount; i++) {
+        NativeFn function = nativeFunction ((int) natives[i].index);
+
+        if (NULL == function || !inFile (header, natives[i].at, 1, sizeof (NativeFn)))
+            return snapshotError (path, "a native function is out of range");
+        memcpy (base + natives[i].at, &function, sizeof function);
+    }
+
+    SnapshotRoots *roots = (SnapshotRoots *) (base + sizeof (SnapshotHeader));
+
+    for (Obj *object = roots->objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_CLASS)
+            copyTable (&((ObjClass *) object)->methods);
+        else if (object->type == OBJ_INSTANCE)
+            copyTable (&((ObjInstance *) object)->fields);
+    }
+    copyTable (&roots->globals);
+    copyTable (&roots->strings);
+    copyTable (&roots->modules);
+
+    // the strings made by initVM are garbage now; they must not
+    // be looked for in the new string table when they are swept.
+    for (int i = 0; i < vm.strings.capacity; i++)
+        if (NULL != vm.strings.entries[i].key)
+            vm.strings.entries[i].key->isInterned = false;
+    freeTable (&vm.globals);
+    freeTable (&vm.strings);
+    freeTable (&vm.modules);
+    vm.globals = roots->globals;
+    vm.strings = roots->strings;
+    vm.modules = roots->modules;
+    vm.initString = roots->initString;
+    vm.snapshotObjects = roots->objects;
+    return true;
+}
+
+/** Release the snapshot restored, if any.
+ *
+ * This must come after the heap objects are freed, as they may
+ * refer into the mapping.
+ */
+void
+freeSnapshots ()
+{
+    for (Obj *object = vm.snapshotObjects; object != NULL; object = object->next) {
+        if (object->type == OBJ_CLASS)
+            freeTable (&((ObjClass *) object)->methods);
+        else if (object->type == OBJ_INSTANCE)
+            freeTable (&((ObjInstance *) object)->fields);
+    }
+    vm.snapshotObjects = NULL;
+
+    if (NULL != mappedBase)
+        munmap (mappedBase, mappedSize);
+    mappedBase = NULL;
+    mappedSize = 0;
+}
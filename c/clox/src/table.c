@@ -3,6 +3,7 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,6 +16,10 @@
  */
 #define TABLE_MAX_LOAD 0.75
 
+/** Fraction of a Table that may be tombstones before tablePurge rebuilds it.
+ */
+#define TABLE_MAX_TOMBSTONES 0.25
+
 /** @file table.h
  * @brief hash table implementation
  */
@@ -30,6 +35,7 @@ void
 initTable (Table *table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
 }
@@ -94,6 +100,43 @@ findEntry (Entry *entries, int capacity, ObjString *key)
     }
 }
 
+/** Return the key to use for table lookups.
+ *
+ * Table entries are found by comparing key pointers, so only
+ * interned strings can be used as keys. Strings created at runtime
+ * are interned here, on demand, the first time they are used as a
+ * key.
+ *
+ * @param key the string to use as the key
+ * @returns the interned string with the same content
+ */
+static ObjString *
+internKey (ObjString *key)
+{
+    if (key->isInterned)
+        return key;
+    return internString (key);
+}
+
+/** Return the key to use for table searches.
+ *
+ * Like internKey, but a string that is not interned yet is not
+ * added to the string table: if no interned string has the same
+ * content, it can not be a key in any table.
+ *
+ * @param key the string to use as the key
+ * @returns the interned string with the same content, or NULL
+ */
+static ObjString *
+searchKey (ObjString *key)
+{
+    if (key->isInterned)
+        return key;
+    uint32_t hash = stringHash (key);   // also flattens a rope key
+
+    return tableFindString (&vm.strings, key->chars, key->length, hash);
+}
+
 /** Get the value associated with this key in this table
  *
  * @param table the hash table of interest
@@ -108,6 +151,10 @@ tableGet (Table *table, ObjString *key, Value *value)
     if (table->count == 0)
         return false;
 
+    key = searchKey (key);
+    if (key == NULL)
+        return false;
+
     Entry *entry = findEntry (table->entries, table->capacity, key);
 
     if (entry->key == NULL)
@@ -122,6 +169,7 @@ tableGet (Table *table, ObjString *key, Value *value)
  * The entry count is nearing the load factor times the
  * capacity, expand the table. Note that the entries in
  * the old table must be "rehashed" into the larger table.
+ * Tombstones are not copied.
  *
  * @param table the table of interest
  * @param capacity the desired new capacity
@@ -137,6 +185,7 @@ adjustCapacity (Table *table, int capacity)
     }
 
     table->count = 0;
+    table->tombstones = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
 
@@ -166,6 +215,7 @@ adjustCapacity (Table *table, int capacity)
 bool
 tableSet (Table *table, ObjString *key, Value value)
 {
+    key = internKey (key);
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY (table->capacity);
 
@@ -176,6 +226,8 @@ tableSet (Table *table, ObjString *key, Value value)
 
     if (isNewKey && IS_NIL (entry->value))
         table->count++;
+    else if (isNewKey)
+        table->tombstones--;
     entry->key = key;
     entry->value = value;
     return isNewKey;
@@ -197,6 +249,10 @@ tableDelete (Table *table, ObjString *key)
         return false;
 
     // find the entry.
+    key = searchKey (key);
+    if (key == NULL)
+        return false;
+
     Entry *entry = findEntry (table->entries, table->capacity, key);
 
     if (entry->key == NULL)
@@ -205,6 +261,7 @@ tableDelete (Table *table, ObjString *key)
     // Place a tombstone.
     entry->key = NULL;
     entry->value = BOOL_VAL (true);
+    table->tombstones++;
     return true;
 }
 
@@ -259,25 +316,29 @@ tableFindString (Table *table, const char *chars, int length, uint32_t hash)
     }
 }
 
-/** Remove stale weak references from the table.
+/** Remove tombstones if they fill too much of the table.
+ *
+ * Tombstones count against the load factor and slow down searches,
+ * and are otherwise only cleared when the table grows. A table that
+ * sees many deletions (such as the string table, where the GC deletes
+ * each dead string) is rebuilt here at a size suited to its live
+ * entries, which may shrink it.
  *
- * @param table the list of weak-reference entries
+ * @param table the table of interest
  */
 void
-tableRemoveWhite (Table *table)
+tablePurge (Table *table)
 {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
+    if (table->tombstones <= table->capacity * TABLE_MAX_TOMBSTONES)
+        return;
 
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-#ifdef DEBUG_LOG_GC
-            printf ("tableRemoveWhite: dropping weak key %s ", printableHeapAddr (entry->key));
-            printValue (OBJ_VAL (entry->key));
-            printf ("\n");
-#endif
-            tableDelete (table, entry->key);
-        }
-    }
+    int live = table->count - table->tombstones;
+    int capacity = GROW_MIN_SIZE;
+
+    while (live + 1 > capacity * TABLE_MAX_LOAD / 2)
+        capacity *= GROW_MUL_FAC;
+
+    adjustCapacity (table, capacity);
 }
 
 /** Mark objects listed in a table.
@@ -1,9 +1,11 @@
 #include "table.h"
 
+#include "memory.h"
 #include "object.h"
 #include "vm.h"
 
 #include <stdio.h>
+#include <string.h>
 
 /** @file table_bist.c
  * @brief Built-In Self Test for the TABLE module.
@@ -93,6 +95,59 @@ bistTable ()
 
     // printObject (OBJ_VAL ((Obj *) k1));
 
+    // Strings made at runtime are interned only when needed.
+    char *chars = ALLOCATE (char, 4);
+
+    memcpy (chars, "k1", 3);
+    chars[3] = '\0';
+    ObjString *r1 = makeString (chars, 3);
+
+    push (OBJ_VAL (r1));                // protect r1 from GC sweep
+    INVAR (!r1->isInterned, "makeString must not intern the string");
+    INVAR (valuesEqual (OBJ_VAL (r1), OBJ_VAL (k1)), "expecting runtime string to equal k1");
+
+    k1b = tableGet (&table2, r1, &val);
+    INVAR (k1b, "expecing true when getting k1 via a runtime string");
+    INVAR (1.0 == AS_NUMBER (val), "expecting to see 1.0 from k1 via a runtime string");
+    INVAR (!r1->isInterned, "tableGet must not intern the key");
+
+    k1b = tableSet (&table2, r1, NUMBER_VAL (2.0));
+    INVAR (!k1b, "expecing false when updating k1 via a runtime string");
+    k1b = tableGet (&table2, k1, &val);
+    INVAR (2.0 == AS_NUMBER (val), "expecting to see 2.0 from k1");
+
+    // Deleted keys leave tombstones, until tablePurge rebuilds the table.
+    Table table3;
+    char name[16];
+
+    initTable (&table3);
+    for (int i = 0; i < 64; ++i) {
+        snprintf (name, sizeof name, "t%d", i);
+        ObjString *key = copyString (name, (int) strlen (name));
+
+        push (OBJ_VAL (key));           // protect key from GC sweep
+        tableSet (&table3, key, NUMBER_VAL (i));
+    }
+    int grownCapacity = table3.capacity;
+
+    for (int i = 0; i < 60; ++i) {
+        snprintf (name, sizeof name, "t%d", i);
+        k1b = tableDelete (&table3, copyString (name, (int) strlen (name)));
+        INVAR (k1b, "expecting true when deleting a key");
+    }
+    INVAR (60 == table3.tombstones, "expecting a tombstone for each deleted key");
+    INVAR (64 == table3.count, "expecting tombstones to be counted");
+
+    tablePurge (&table3);
+    INVAR (0 == table3.tombstones, "tablePurge should remove the tombstones");
+    INVAR (4 == table3.count, "tablePurge should keep the live entries");
+    INVAR (table3.capacity < grownCapacity, "tablePurge should shrink the table");
+    k1b = tableGet (&table3, copyString ("t63", 3), &val);
+    INVAR (k1b && 63.0 == AS_NUMBER (val), "expecting to see 63 from t63 after tablePurge");
+    freeTable (&table3);
+    for (int i = 0; i < 64; ++i)
+        pop ();
+
     freeTable (&table);
     INVAR (0 == table.count, "freeTable should set count to zero.");
     INVAR (0 == table.capacity, "freeTable should set capacity to zero.");
@@ -107,6 +162,7 @@ bistTable ()
     pop ();
     pop ();
     pop ();
+    pop ();
 
     printf ("BIST: %s ... done.\n", "bistTable");
 }
@@ -17,7 +17,8 @@
  * - the values are equal per the rules for that type
  *
  * Note that for OBJECTS (Functions and Strings), equality
- * is defined as referencing the same Obj structure.
+ * is defined as referencing the same Obj structure, except
+ * that Strings not yet interned are compared by content.
  *
  * @param a the first value to compare
  * @param b the second value to compare
@@ -28,6 +29,8 @@ valuesEqual (Value a, Value b)
 {
     if (a.type != b.type)
         return false;
+    if (IS_STRING (a) && IS_STRING (b))
+        return stringsEqual (AS_STRING (a), AS_STRING (b));
     switch (a.type) {
 
         // *INDENT-OFF*
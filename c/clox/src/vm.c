@@ -3,12 +3,16 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "image.h"
 #include "memory.h"
+#include "module.h"
 #include "object.h"
+#include "snapshot.h"
 
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -66,6 +70,288 @@ gcNative (int argCount, Value *args)
     return NIL_VAL;
 }
 
+/** Decode an integer argument to a Native Function.
+ *
+ * @param value the argument
+ * @param lo smallest acceptable value
+ * @param hi largest acceptable value
+ * @param out where to store the integer
+ * @returns true if the value is an integral number in lo..hi
+ */
+static bool
+intArg (Value value, int lo, int hi, int *out)
+{
+    if (!IS_NUMBER (value))
+        return false;
+
+    double d = AS_NUMBER (value);
+
+    if (d != floor (d) || d < lo || d > hi)
+        return false;
+    *out = (int) d;
+    return true;
+}
+
+/** Native Function: substring(s, start, end)
+ *
+ * Returns the part of s from offset start up to (not including)
+ * offset end, which defaults to the length of s. The result is
+ * a slice that shares the bytes of s.
+ *
+ * @param argCount number of parameters in the function call
+ * @param args list of Values passed to the function
+ * @returns Value containing the substring, or nil if the arguments are bad
+ */
+static Value
+substringNative (int argCount, Value *args)
+{
+    if (argCount < 2 || argCount > 3 || !IS_STRING (args[0]))
+        return NIL_VAL;
+
+    ObjString *string = AS_STRING (args[0]);
+    int start;
+    int end = string->length;
+
+    if (!intArg (args[1], 0, string->length, &start))
+        return NIL_VAL;
+    if (argCount == 3 && !intArg (args[2], start, string->length, &end))
+        return NIL_VAL;
+
+    return OBJ_VAL (sliceString (string, start, end - start));
+}
+
+/** Native Function: indexOf(s, t, from)
+ *
+ * Returns the offset of the first occurrence of t in s at or
+ * after offset from, which defaults to zero.
+ *
+ * @param argCount number of parameters in the function call
+ * @param args list of Values passed to the function
+ * @returns Value containing the offset, -1 if not found, or nil if the arguments are bad
+ */
+static Value
+indexOfNative (int argCount, Value *args)
+{
+    if (argCount < 2 || argCount > 3 || !IS_STRING (args[0]) || !IS_STRING (args[1]))
+        return NIL_VAL;
+
+    ObjString *string = AS_STRING (args[0]);
+    int from = 0;
+
+    if (argCount == 3 && !intArg (args[2], 0, string->length, &from))
+        return NIL_VAL;
+
+    return NUMBER_VAL (stringIndexOf (string, AS_STRING (args[1]), from));
+}
+
+/** Native Function: split(s, sep, n)
+ *
+ * Lox has no lists, so rather than returning all of the fields,
+ * this returns field number n (counting from zero) of s, where
+ * fields are separated by occurrences of sep. The result is a
+ * slice that shares the bytes of s.
+ *
+ * @param argCount number of parameters in the function call
+ * @param args list of Values passed to the function
+ * @returns Value containing the field, or nil if there is no such field
+ */
+static Value
+splitNative (int argCount, Value *args)
+{
+    if (argCount != 3 || !IS_STRING (args[0]) || !IS_STRING (args[1]))
+        return NIL_VAL;
+
+    ObjString *string = AS_STRING (args[0]);
+    ObjString *sep = AS_STRING (args[1]);
+    int n;
+
+    if (sep->length == 0 || !intArg (args[2], 0, string->length, &n))
+        return NIL_VAL;
+
+    int start = 0;
+
+    while (n-- > 0) {
+        start = stringIndexOf (string, sep, start);
+        if (start < 0)
+            return NIL_VAL;
+        start += sep->length;
+    }
+
+    int end = stringIndexOf (string, sep, start);
+
+    if (end < 0)
+        end = string->length;
+    return OBJ_VAL (sliceString (string, start, end - start));
+}
+
+/** Decide if a character is white space for trim()
+ *
+ * @param c the character to check
+ * @returns true for blanks, tabs, and line endings
+ */
+static bool
+isBlank (char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/** Native Function: trim(s)
+ *
+ * Returns s without leading and trailing blanks, tabs and
+ * newlines. The result is a slice that shares the bytes of s.
+ *
+ * @param argCount number of parameters in the function call
+ * @param args list of Values passed to the function
+ * @returns Value containing the trimmed string, or nil if the arguments are bad
+ */
+static Value
+trimNative (int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_STRING (args[0]))
+        return NIL_VAL;
+
+    ObjString *string = AS_STRING (args[0]);
+    const char *bytes = stringBytes (string);
+    int start = 0;
+    int end = string->length;
+
+    while (start < end && isBlank (bytes[start]))
+        start++;
+    while (end > start && isBlank (bytes[end - 1]))
+        end--;
+
+    return OBJ_VAL (sliceString (string, start, end - start));
+}
+
+/** Native functions, in the order initVM defines them.
+ *
+ * A snapshot refers to each native by its place in this list.
+ */
+static const struct {
+    const char *name;           ///< name of the global holding it
+    NativeFn function;          ///< the glue function
+} natives[] = {
+    { "clock", clockNative },
+    { "gc", gcNative },
+    { "substring", substringNative },
+    { "indexOf", indexOfNative },
+    { "split", splitNative },
+    { "trim", trimNative },
+};
+
+/** Number of native functions built in */
+#define NATIVE_COUNT ((int) (sizeof natives / sizeof natives[0]))
+
+/** Find the place of a native function in the built in list.
+ *
+ * @param function the glue function
+ * @returns its index, or -1 if it is not built in
+ */
+int
+nativeIndex (NativeFn function)
+{
+    for (int i = 0; i < NATIVE_COUNT; i++)
+        if (natives[i].function == function)
+            return i;
+    return -1;
+}
+
+/** Find a native function by its place in the built in list.
+ *
+ * @param index as returned by nativeIndex
+ * @returns the glue function, or NULL if there is none there
+ */
+NativeFn
+nativeFunction (int index)
+{
+    return index < 0 || index >= NATIVE_COUNT ? NULL : natives[index].function;
+}
+
+/** Count the native functions built in.
+ *
+ * @returns the length of the list nativeIndex searches
+ */
+int
+nativeCount ()
+{
+    return NATIVE_COUNT;
+}
+
+/** Make room on the data stack.
+ *
+ * The stack is moved to larger storage when needed, so the
+ * stack pointer, the slots of each frame, and the locations of
+ * open upvalues are all adjusted to point into the new storage.
+ *
+ * @param needed number of Values that will be pushed
+ * @returns true if there is room for them
+ * @returns false if that would exceed STACK_MAX
+ */
+static bool
+ensureStack (int needed)
+{
+    int used = (int) (vm.sp - vm.stack);
+
+    if (used + needed <= vm.stackCapacity)
+        return true;
+    if (used + needed > STACK_MAX)
+        return false;
+
+    int capacity = vm.stackCapacity;
+
+    while (capacity < used + needed)
+        capacity *= 2;
+    if (capacity > STACK_MAX)
+        capacity = STACK_MAX;
+
+    Value *old = vm.stack;
+    Value *stack = (Value *) malloc (sizeof (Value) * capacity);
+    ObjUpvalue **openSlots = (ObjUpvalue **) realloc (vm.openSlots, sizeof (ObjUpvalue *) * capacity);
+
+    INVAR (NULL != stack && NULL != openSlots, "unable to allocate memory for the data stack");
+    memcpy (stack, old, sizeof (Value) * used);
+    memset (openSlots + vm.stackCapacity, 0, sizeof (ObjUpvalue *) * (capacity - vm.stackCapacity));
+    vm.openSlots = openSlots;
+
+    vm.sp = stack + (vm.sp - old);
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - old);
+    }
+    for (int slot = 0; slot < vm.openTop; slot++) {
+        if (NULL != openSlots[slot])
+            openSlots[slot]->location = stack + slot;
+    }
+
+    free (old);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+    return true;
+}
+
+/** Make room for another stack frame.
+ *
+ * @returns true if there is room for one more frame
+ * @returns false if that would exceed FRAMES_MAX
+ */
+static bool
+ensureFrame ()
+{
+    if (vm.frameCount < vm.frameCapacity)
+        return true;
+    if (vm.frameCount >= FRAMES_MAX)
+        return false;
+
+    int capacity = vm.frameCapacity * 2;
+
+    if (capacity > FRAMES_MAX)
+        capacity = FRAMES_MAX;
+
+    vm.frames = (CallFrame *) realloc (vm.frames, sizeof (CallFrame) * capacity);
+    INVAR (NULL != vm.frames, "unable to allocate memory for stack frames");
+    vm.frameCapacity = capacity;
+    return true;
+}
+
 /** Reset the VM stack to empty.
  */
 static void
@@ -73,7 +359,8 @@ resetStack ()
 {
     vm.sp = vm.stack;
     vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    vm.openTop = 0;
+    memset (vm.openSlots, 0, sizeof (ObjUpvalue *) * vm.stackCapacity);
 }
 
 /** Report a runtime error.
@@ -97,7 +384,7 @@ runtimeError (const char *format, ...)
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
 
-        fprintf (stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf (stderr, "[line %d] in ", getLine (&function->chunk, (int) instruction));
         if (function->name == NULL) {
             fprintf (stderr, "script\n");
         } else {
@@ -124,6 +411,78 @@ defineNative (const char *name, NativeFn function)
     pop ();
 }
 
+#ifdef  DEBUG_PROFILE_OPCODES
+
+/** Operations with an EXEC_ macro in run(), which can be fused
+ * into superinstructions.
+ */
+static const bool composable[OP__LAST + 1] = {
+    [OP_CONSTANT] = true,[OP_NIL] = true,[OP_TRUE] = true,[OP_FALSE] = true,
+    [OP_POP] = true,[OP_GET_LOCAL] = true,[OP_SET_LOCAL] = true,
+    [OP_GET_GLOBAL] = true,[OP_DEFINE_GLOBAL] = true,[OP_SET_GLOBAL] = true,
+    [OP_GET_UPVALUE] = true,[OP_SET_UPVALUE] = true,[OP_EQUAL] = true,
+    [OP_ADD] = true,[OP_SUBTRACT] = true,[OP_MULTIPLY] = true,[OP_DIVIDE] = true,
+    [OP_GREATER] = true,[OP_LESS] = true,[OP_NOT] = true,[OP_NEGATE] = true,
+    [OP_ADD_NUMBER] = true,[OP_SUBTRACT_NUMBER] = true,[OP_MULTIPLY_NUMBER] = true,
+    [OP_DIVIDE_NUMBER] = true,[OP_GREATER_NUMBER] = true,[OP_LESS_NUMBER] = true,
+    [OP_NEGATE_NUMBER] = true,
+    [OP_PRINT] = true,[OP_ADD_CONSTANT_LOCAL] = true,
+};
+
+static unsigned long long profileDispatches;    ///< number of instructions run
+static unsigned long long profilePairs[OP__LAST + 1][OP__LAST + 1];     ///< runs of two composable operations
+static unsigned long long profileTriples[OP__LAST + 1][OP__LAST + 1][OP__LAST + 1];     ///< runs of three composable operations
+static int profileLast = -1;    ///< last operation, if composable
+static int profileBefore = -1;  ///< operation before that, if composable
+
+/** Count an instruction about to be run.
+ *
+ * Composable operations never jump, so consecutive ones
+ * are also adjacent in the code.
+ *
+ * @param instruction the OpCode being dispatched
+ */
+static void
+profileOpcode (OpCode instruction)
+{
+    profileDispatches++;
+    if (!composable[instruction]) {
+        profileLast = profileBefore = -1;
+        return;
+    }
+    if (profileLast >= 0) {
+        profilePairs[profileLast][instruction]++;
+        if (profileBefore >= 0)
+            profileTriples[profileBefore][profileLast][instruction]++;
+    }
+    profileBefore = profileLast;
+    profileLast = instruction;
+}
+
+/** Print the opcode profile, for bin/superinstructions.awk
+ */
+static void
+profileReport ()
+{
+    fprintf (stderr, "profile dispatches %llu\n", profileDispatches);
+    for (int a = 0; a <= OP__LAST; a++) {
+        for (int b = 0; b <= OP__LAST; b++) {
+            if (profilePairs[a][b] > 0)
+                fprintf (stderr, "profile pair %s %s %llu\n", opcodeString (a), opcodeString (b), profilePairs[a][b]);
+            for (int c = 0; c <= OP__LAST; c++) {
+                if (profileTriples[a][b][c] > 0)
+                    fprintf (stderr, "profile triple %s %s %s %llu\n", opcodeString (a), opcodeString (b), opcodeString (c), profileTriples[a][b][c]);
+            }
+        }
+    }
+
+    profileDispatches = 0;
+    memset (profilePairs, 0, sizeof profilePairs);
+    memset (profileTriples, 0, sizeof profileTriples);
+}
+
+#endif
+
 /** Initialize the VM completely.
  *
  * After this call, the VM does not have a reference
@@ -136,8 +495,19 @@ initVM ()
     INVAR (!vmInitialized, "refused, VM is already initialized.");
     vmInitialized = true;
 
+    vm.frames = (CallFrame *) malloc (sizeof (CallFrame) * FRAMES_INIT);
+    vm.frameCapacity = FRAMES_INIT;
+    vm.stack = (Value *) malloc (sizeof (Value) * STACK_INIT);
+    vm.openSlots = (ObjUpvalue **) malloc (sizeof (ObjUpvalue *) * STACK_INIT);
+    vm.stackCapacity = STACK_INIT;
+    INVAR (NULL != vm.frames && NULL != vm.stack && NULL != vm.openSlots, "unable to allocate memory for the VM stacks");
+
     resetStack ();
     vm.objects = NULL;
+    vm.permanentObjects = NULL;
+    vm.allocPermanent = false;
+    initValueArray (&vm.permanentRefs);
+    vm.snapshotObjects = NULL;
 
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
@@ -145,6 +515,14 @@ initVM ()
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.callerCount = 0;
+    vm.callerCapacity = 0;
+    vm.callers = NULL;
+
+    memset (vm.compileCache, 0, sizeof (vm.compileCache));
+    vm.compileClock = 0;
+    vm.compileHits = 0;
+    vm.compileMisses = 0;
 
 #ifdef DEBUG_FREELESS_GC
     vm.unfree = NULL;
@@ -153,14 +531,15 @@ initVM ()
 
     initTable (&vm.globals);
     initTable (&vm.strings);
+    initTable (&vm.modules);
 
     // CAREFUL: GC might trigger in copyString
     // so it must be initialized before making the call.
     vm.initString = NULL;
     vm.initString = copyString ("init", 4);
 
-    defineNative ("clock", clockNative);
-    defineNative ("gc", gcNative);
+    for (int i = 0; i < NATIVE_COUNT; i++)
+        defineNative (natives[i].name, natives[i].function);
 }
 
 /** Release storage owned by the VM.
@@ -173,13 +552,39 @@ freeVM ()
     INVAR (vmInitialized, "refused, VM is not initialized.");
     vmInitialized = false;
 
+    for (int i = 0; i < COMPILE_CACHE_SIZE; i++) {
+        CachedScript *entry = &vm.compileCache[i];
+
+        if (NULL != entry->source)
+            FREE_ARRAY (char, entry->source, entry->length + 1);
+        entry->source = NULL;
+        entry->function = NULL;
+    }
+
     freeTable (&vm.strings);
     freeTable (&vm.globals);
+    freeTable (&vm.modules);
+    freeValueArray (&vm.permanentRefs);
     freeObjects ();
+    freeSnapshots ();
+    freeImages ();
+
+    free (vm.frames);
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
+    free (vm.stack);
+    vm.stack = NULL;
+    free (vm.openSlots);
+    vm.openSlots = NULL;
+    vm.stackCapacity = 0;
 
 #ifdef DEBUG_FREELESS_GC
     freeUnfree ();
 #endif
+
+#ifdef  DEBUG_PROFILE_OPCODES
+    profileReport ();
+#endif
 }
 
 /** Push a value onto the VM stack.
@@ -187,7 +592,8 @@ freeVM ()
  * This adjusts the stack pointer so that several
  * values pushed do not overwrite each other.
  *
- * @warning no protection from stack overflow.
+ * Each call reserves the depth found when its function
+ * was verified, so there is no need to check for room.
  *
  * @param value data to be pushed.
  */
@@ -195,7 +601,6 @@ void
 push (Value value)
 {
     INVAR (vmInitialized, "refused, VM is not initialized.");
-    INVAR (vm.sp < vm.stack + STACK_MAX, "STACK OVERFLOW");
     *vm.sp = value;
     vm.sp++;
 }
@@ -241,10 +646,27 @@ peek (int distance)
     return vm.sp[-1 - distance];
 }
 
+/** Start a frame for a call already known to be valid.
+ *
+ * @param closure what to call
+ * @param argCount how many args are being sent
+ */
+static inline void
+pushFrame (ObjClosure *closure, int argCount)
+{
+    CallFrame *frame = &vm.frames[vm.frameCount++];
+
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->slots = vm.sp - argCount - 1;
+    frame->hasOpenUpvalues = false;
+}
+
 /** Call a function.
  *
  * @param function what to call
  * @param argCount how many args are being sent
+ * @returns false if a lazy function body does not compile
  * @returns false if the argument count is wrong
  * @returns false if the frame stack is full.
  * @returns true if the call was started
@@ -254,21 +676,22 @@ call (ObjClosure *closure, int argCount)
 {
     INVAR (vmInitialized, "refused, VM is not initialized.");
 
+    if (NULL != closure->function->lazy && !compileLazy (closure->function)) {
+        runtimeError ("Could not compile %s.", closure->function->name->chars);
+        return false;
+    }
+
     if (argCount != closure->function->arity) {
         runtimeError ("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (!ensureFrame () || !ensureStack (closure->function->maxStack + STACK_SCRATCH)) {
         runtimeError ("Stack overflow.");
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
-
-    frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
-    frame->slots = vm.sp - argCount - 1;
+    pushFrame (closure, argCount);
     return true;
 }
 
@@ -317,6 +740,12 @@ callValue (Value callee, int argCount)
 
         case OBJ_NATIVE:{
                 NativeFn native = AS_NATIVE (callee)->function;
+
+                if (!ensureStack (STACK_SCRATCH)) {
+                    runtimeError ("Stack overflow.");
+                    return false;
+                }
+
                 Value result = native (argCount, vm.sp - argCount);
 
                 vm.sp -= argCount + 1;
@@ -419,6 +848,9 @@ bindMethod (ObjClass *klass, ObjString *name)
 }
 
 /** Capture an Upvalue
+ *
+ * Open Upvalues are kept in vm.openSlots by stack slot, so an
+ * existing one is found, and a new one recorded, without a search.
  *
  * @param local where the Upvalue value is stored
  * @returns an Upvalue object on the heap
@@ -426,43 +858,45 @@ bindMethod (ObjClass *klass, ObjString *name)
 static ObjUpvalue *
 captureUpvalue (Value *local)
 {
-    ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
+    int slot = (int) (local - vm.stack);
+    ObjUpvalue *existing = vm.openSlots[slot];
 
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
-
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
+    if (existing != NULL)
+        return existing;
 
     ObjUpvalue *createdUpvalue = newUpvalue (local);
 
-    if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
-    } else {
-        prevUpvalue->next = createdUpvalue;
-    }
+    vm.openSlots[slot] = createdUpvalue;
+    if (vm.openTop <= slot)
+        vm.openTop = slot + 1;
 
     return createdUpvalue;
 }
 
 /** Close every open upvalue that can be closed.
+ *
+ * Only the slots from last up to vm.openTop are looked at. That
+ * bound is the slot above the highest open upvalue, or the first
+ * slot of the frame that last closed any, if that is higher.
  *
  * @param last where to stop the stack scan
  */
 static void
 closeUpvalues (Value *last)
 {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.openUpvalues;
+    int first = (int) (last - vm.stack);
+
+    for (int slot = vm.openTop - 1; slot >= first; slot--) {
+        ObjUpvalue *upvalue = vm.openSlots[slot];
 
+        if (NULL == upvalue)
+            continue;
+        vm.openSlots[slot] = NULL;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
     }
+    if (vm.openTop > first)
+        vm.openTop = first;
 }
 
 static void
@@ -475,6 +909,29 @@ defineMethod (ObjString *name)
     pop ();
 }
 
+/** Decide whether a fused compare-and-jump takes its branch.
+ *
+ * @param test a JumpTest value from the instruction
+ * @param a the first operand
+ * @param b the second operand
+ * @returns true if the jump is taken
+ */
+static inline bool
+jumpTest (uint8_t test, double a, double b)
+{
+    switch ((JumpTest) test) {
+    case TEST_NOT_LESS:
+        return !(a < b);
+    case TEST_NOT_GREATER:
+        return !(a > b);
+    case TEST_LESS:
+        return a < b;
+    case TEST_GREATER:
+        return a > b;
+    }
+    UNREACHABLE ("bad JumpTest %d", test);
+}
+
 /** Return true if the value is falsey.
  *
  * Follows the RUBY convention that nil and false are falsey
@@ -499,14 +956,11 @@ concatenate ()
 
     ObjString *b = AS_STRING (peek (0));
     ObjString *a = AS_STRING (peek (1));
-    int length = a->length + b->length;
-    char *chars = ALLOCATE (char, length + 1);
-
-    memcpy (chars, a->chars, a->length);
-    memcpy (chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
 
-    ObjString *result = takeString (chars, length);
+    // Not interned: most concatenation results are intermediates
+    // that are never used as table keys. Long results are ropes,
+    // which share the operands rather than copying them.
+    ObjString *result = concatStrings (a, b);
 
     pop ();
     pop ();
@@ -538,6 +992,201 @@ run ()
 #define READ_SHORT()    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING()   (AS_STRING(READ_CONSTANT()))
+#define READ_LONG()     (frame->ip += 3, LONG_OPERAND(frame->ip - 3))
+#define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[READ_LONG()])
+#define READ_STRING_LONG() (AS_STRING(READ_CONSTANT_LONG()))
+
+    // Straight-line operations are written as EXEC_ macros, so the
+    // superinstructions listed in superinstructions.h can run several
+    // of them from a single dispatch.
+
+#define BINARY_OP(valueType, op)                                        \
+    do {                                                                \
+        if (!IS_NUMBER(peek(0)) || (!IS_NUMBER(peek(1)))) {             \
+            runtimeError("Operands must be numbers.");                  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        Value b = pop();                                                \
+        Value a = pop();                                                \
+        push(valueType(AS_NUMBER(a) op AS_NUMBER(b)));                  \
+    } while (false)
+
+    // Register instructions read their operands from frame slots or
+    // constants, as told by their mode, and push or store the result.
+
+#define REGISTER_OPERAND(mode, isConstant)                              \
+    (((mode) & (isConstant)) ? READ_CONSTANT() : frame->slots[READ_BYTE()])
+
+#define REGISTER_RESULT(mode, value)                                    \
+    do {                                                                \
+        if ((mode) & REG_STORE)                                         \
+            frame->slots[READ_BYTE()] = (value);                        \
+        else                                                            \
+            push(value);                                                \
+    } while (false)
+
+#define REGISTER_OP(valueType, op)                                      \
+    do {                                                                \
+        uint8_t mode = READ_BYTE();                                     \
+        Value a = REGISTER_OPERAND(mode, REG_A_CONSTANT);               \
+        Value b = REGISTER_OPERAND(mode, REG_B_CONSTANT);               \
+                                                                        \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                           \
+            runtimeError("Operands must be numbers.");                  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        REGISTER_RESULT(mode, valueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+    } while (false)
+
+#define EXEC_OP_CONSTANT()      push(READ_CONSTANT())
+#define EXEC_OP_NIL()           push(NIL_VAL)
+#define EXEC_OP_TRUE()          push(BOOL_VAL(true))
+#define EXEC_OP_FALSE()         push(BOOL_VAL(false))
+#define EXEC_OP_POP()           (void) pop()
+#define EXEC_OP_GET_LOCAL()     push(frame->slots[READ_BYTE()])
+#define EXEC_OP_SET_LOCAL()     (frame->slots[READ_BYTE()] = peek(0))
+// a copied capture has no upvalue, and is read from the closure.
+#define EXEC_OP_GET_UPVALUE()                                           \
+    do {                                                                \
+        uint8_t index = READ_BYTE();                                    \
+        ObjUpvalue *upvalue = frame->closure->upvalues[index];          \
+                                                                        \
+        push(NULL == upvalue ? CLOSURE_COPIES(frame->closure)[index] : *upvalue->location); \
+    } while (false)
+#define EXEC_OP_SET_UPVALUE()   (*frame->closure->upvalues[READ_BYTE()]->location = peek(0))
+#define EXEC_OP_SUBTRACT()      BINARY_OP(NUMBER_VAL, -)
+#define EXEC_OP_MULTIPLY()      BINARY_OP(NUMBER_VAL, *)
+#define EXEC_OP_DIVIDE()        BINARY_OP(NUMBER_VAL, /)
+#define EXEC_OP_GREATER()       BINARY_OP(BOOL_VAL,   >)
+#define EXEC_OP_LESS()          BINARY_OP(BOOL_VAL,   <)
+
+    // The compiler proved the operands of a _NUMBER operation are
+    // numbers, so it works on the stack in place, with no checks.
+
+#define NUMBER_OP(valueType, op)                                        \
+    do {                                                                \
+        vm.sp[-2] = valueType(AS_NUMBER(vm.sp[-2]) op AS_NUMBER(vm.sp[-1])); \
+        vm.sp--;                                                        \
+    } while (false)
+
+#define EXEC_OP_ADD_NUMBER()        NUMBER_OP(NUMBER_VAL, +)
+#define EXEC_OP_SUBTRACT_NUMBER()   NUMBER_OP(NUMBER_VAL, -)
+#define EXEC_OP_MULTIPLY_NUMBER()   NUMBER_OP(NUMBER_VAL, *)
+#define EXEC_OP_DIVIDE_NUMBER()     NUMBER_OP(NUMBER_VAL, /)
+#define EXEC_OP_GREATER_NUMBER()    NUMBER_OP(BOOL_VAL,   >)
+#define EXEC_OP_LESS_NUMBER()       NUMBER_OP(BOOL_VAL,   <)
+#define EXEC_OP_NEGATE_NUMBER()     (vm.sp[-1] = NUMBER_VAL(-AS_NUMBER(vm.sp[-1])))
+#define EXEC_OP_NOT()           push(BOOL_VAL(isFalsey(pop())))
+
+    // The short and long forms of an operation share its body,
+    // and differ only in how they read the operand.
+
+#define GET_GLOBAL(readName)                                            \
+    do {                                                                \
+        ObjString *name = (readName);                                   \
+        Value value;                                                    \
+                                                                        \
+        if (!tableGet(&vm.globals, name, &value)) {                     \
+            runtimeError("Undefined variable '%s'.", name->chars);      \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        push(value);                                                    \
+    } while (false)
+
+#define DEFINE_GLOBAL(readName)                                         \
+    do {                                                                \
+        ObjString *name = (readName);                                   \
+                                                                        \
+        tableSet(&vm.globals, name, peek(0));                           \
+        pop();                                                          \
+    } while (false)
+
+#define SET_GLOBAL(readName)                                            \
+    do {                                                                \
+        ObjString *name = (readName);                                   \
+                                                                        \
+        if (tableSet(&vm.globals, name, peek(0))) {                     \
+            tableDelete(&vm.globals, name);                             \
+            runtimeError("Undefined variable '%s'.", name->chars);      \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+    } while (false)
+
+#define COMPARE_JUMP(readB, readOffset)                                 \
+    do {                                                                \
+        uint8_t test = READ_BYTE();                                     \
+        Value a = frame->slots[READ_BYTE()];                            \
+        Value b = (readB);                                              \
+        int offset = (readOffset);                                      \
+                                                                        \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                           \
+            runtimeError("Operands must be numbers.");                  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        if (jumpTest(test, AS_NUMBER(a), AS_NUMBER(b)))                 \
+            frame->ip += offset;                                        \
+    } while (false)
+
+#define EXEC_OP_GET_GLOBAL()    GET_GLOBAL(READ_STRING())
+#define EXEC_OP_DEFINE_GLOBAL() DEFINE_GLOBAL(READ_STRING())
+#define EXEC_OP_SET_GLOBAL()    SET_GLOBAL(READ_STRING())
+
+// comparing ropes flattens them, so both stay on the stack until then.
+#define EXEC_OP_EQUAL()                                                 \
+    do {                                                                \
+        bool equal = valuesEqual(peek(1), peek(0));                     \
+                                                                        \
+        pop();                                                          \
+        pop();                                                          \
+        push(BOOL_VAL(equal));                                          \
+    } while (false)
+
+#define EXEC_OP_ADD()                                                   \
+    do {                                                                \
+        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {                 \
+            concatenate();                                              \
+        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {          \
+            double b = AS_NUMBER(pop());                                \
+            double a = AS_NUMBER(pop());                                \
+                                                                        \
+            push(NUMBER_VAL(a + b));                                    \
+        } else {                                                        \
+            runtimeError("Operands must be two numbers or two strings."); \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+    } while (false)
+
+#define EXEC_OP_NEGATE()                                                \
+    do {                                                                \
+        if (!IS_NUMBER(peek(0))) {                                      \
+            runtimeError("Operand must be a number.");                  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        push(NUMBER_VAL(-AS_NUMBER(pop())));                            \
+    } while (false)
+
+#define EXEC_OP_PRINT()                                                 \
+    do {                                                                \
+        printValue(pop());                                              \
+        printf("\n");                                                   \
+    } while (false)
+
+#define EXEC_OP_ADD_CONSTANT_LOCAL()                                    \
+    do {                                                                \
+        Value *local = &frame->slots[READ_BYTE()];                      \
+        Value constant = READ_CONSTANT();                               \
+                                                                        \
+        if (!IS_NUMBER(*local)) {                                       \
+            runtimeError("Operands must be two numbers or two strings."); \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(constant));   \
+    } while (false)
+
+#define SUPER_PAIR_CASE(name, a, b)                                     \
+    case name: EXEC_ ## a(); EXEC_ ## b(); break;
+#define SUPER_TRIPLE_CASE(name, a, b, c)                                \
+    case name: EXEC_ ## a(); EXEC_ ## b(); EXEC_ ## c(); break;
 
     for (;;) {
 #ifdef  DEBUG_TRACE_EXECUTION
@@ -565,129 +1214,107 @@ run ()
 
         const OpCode instruction = (OpCode) READ_BYTE ();
 
-        switch (instruction) {
-
-        case OP_CONSTANT:
-            push (READ_CONSTANT ());
-            break;
-
-        case OP_NIL:
-            push (NIL_VAL);
-            break;
-        case OP_TRUE:
-            push (BOOL_VAL (true));
-            break;
-        case OP_FALSE:
-            push (BOOL_VAL (false));
-            break;
-        case OP_POP:
-            (void) pop ();
-            break;
-
-        case OP_GET_LOCAL:{
-                uint8_t slot = READ_BYTE ();
-
-                push (frame->slots[slot]);
-                break;
-            }
-
-        case OP_GET_GLOBAL:{
-                ObjString *name = READ_STRING ();
-                Value value;
-
-                if (!tableGet (&vm.globals, name, &value)) {
-                    runtimeError ("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push (value);
-                break;
-            }
-
-        case OP_DEFINE_GLOBAL:{
-                ObjString *name = READ_STRING ();
-
-                tableSet (&vm.globals, name, peek (0));
-                pop ();
-                break;
-            }
-
-        case OP_SET_LOCAL:{
-                uint8_t slot = READ_BYTE ();
-
-                frame->slots[slot] = peek (0);
-                break;
-            }
-
-        case OP_SET_GLOBAL:{
-                ObjString *name = READ_STRING ();
+#ifdef  DEBUG_PROFILE_OPCODES
+        profileOpcode (instruction);
+#endif
 
-                if (tableSet (&vm.globals, name, peek (0))) {
-                    tableDelete (&vm.globals, name);
-                    runtimeError ("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
+        switch (instruction) {
 
-        case OP_GET_UPVALUE:{
-                uint8_t slot = READ_BYTE ();
+            // *INDENT-OFF*
 
-                push (*frame->closure->upvalues[slot]->location);
-                break;
-            }
+        case OP_CONSTANT:       EXEC_OP_CONSTANT ();      break;
+        case OP_NIL:            EXEC_OP_NIL ();           break;
+        case OP_TRUE:           EXEC_OP_TRUE ();          break;
+        case OP_FALSE:          EXEC_OP_FALSE ();         break;
+        case OP_POP:            EXEC_OP_POP ();           break;
+        case OP_GET_LOCAL:      EXEC_OP_GET_LOCAL ();     break;
+        case OP_SET_LOCAL:      EXEC_OP_SET_LOCAL ();     break;
+        case OP_GET_GLOBAL:     EXEC_OP_GET_GLOBAL ();    break;
+        case OP_DEFINE_GLOBAL:  EXEC_OP_DEFINE_GLOBAL (); break;
+        case OP_SET_GLOBAL:     EXEC_OP_SET_GLOBAL ();    break;
+        case OP_GET_UPVALUE:    EXEC_OP_GET_UPVALUE ();   break;
+        case OP_SET_UPVALUE:    EXEC_OP_SET_UPVALUE ();   break;
+        case OP_EQUAL:          EXEC_OP_EQUAL ();         break;
+        case OP_ADD:            EXEC_OP_ADD ();           break;
+        case OP_SUBTRACT:       EXEC_OP_SUBTRACT ();      break;
+        case OP_MULTIPLY:       EXEC_OP_MULTIPLY ();      break;
+        case OP_DIVIDE:         EXEC_OP_DIVIDE ();        break;
+        case OP_GREATER:        EXEC_OP_GREATER ();       break;
+        case OP_LESS:           EXEC_OP_LESS ();          break;
+        case OP_NOT:            EXEC_OP_NOT ();           break;
+        case OP_NEGATE:         EXEC_OP_NEGATE ();        break;
+        case OP_ADD_NUMBER:     EXEC_OP_ADD_NUMBER ();    break;
+        case OP_SUBTRACT_NUMBER: EXEC_OP_SUBTRACT_NUMBER (); break;
+        case OP_MULTIPLY_NUMBER: EXEC_OP_MULTIPLY_NUMBER (); break;
+        case OP_DIVIDE_NUMBER:  EXEC_OP_DIVIDE_NUMBER ();  break;
+        case OP_GREATER_NUMBER: EXEC_OP_GREATER_NUMBER (); break;
+        case OP_LESS_NUMBER:    EXEC_OP_LESS_NUMBER ();   break;
+        case OP_NEGATE_NUMBER:  EXEC_OP_NEGATE_NUMBER (); break;
+        case OP_PRINT:          EXEC_OP_PRINT ();         break;
+        case OP_ADD_CONSTANT_LOCAL: EXEC_OP_ADD_CONSTANT_LOCAL (); break;
+
+        case OP_CONSTANT_LONG:      push (READ_CONSTANT_LONG ());                break;
+        case OP_GET_LOCAL_LONG:     push (frame->slots[READ_LONG ()]);           break;
+        case OP_SET_LOCAL_LONG:     frame->slots[READ_LONG ()] = peek (0);       break;
+        case OP_GET_GLOBAL_LONG:    GET_GLOBAL (READ_STRING_LONG ());            break;
+        case OP_DEFINE_GLOBAL_LONG: DEFINE_GLOBAL (READ_STRING_LONG ());         break;
+        case OP_SET_GLOBAL_LONG:    SET_GLOBAL (READ_STRING_LONG ());            break;
+        case OP_CLASS_LONG:         push (OBJ_VAL (newClass (READ_STRING_LONG ()))); break;
+        case OP_METHOD_LONG:        defineMethod (READ_STRING_LONG ());          break;
+
+        case OP_COMPARE_LOCALS_JUMP:        COMPARE_JUMP (frame->slots[READ_BYTE ()], READ_SHORT ()); break;
+        case OP_COMPARE_CONSTANT_JUMP:      COMPARE_JUMP (READ_CONSTANT (), READ_SHORT ());           break;
+        case OP_COMPARE_LOCALS_JUMP_LONG:   COMPARE_JUMP (frame->slots[READ_BYTE ()], READ_LONG ());  break;
+        case OP_COMPARE_CONSTANT_JUMP_LONG: COMPARE_JUMP (READ_CONSTANT (), READ_LONG ());            break;
+
+        SUPER_PAIRS (SUPER_PAIR_CASE)
+        SUPER_TRIPLES (SUPER_TRIPLE_CASE)
+
+        case OP_SUBTRACT_R:     REGISTER_OP (NUMBER_VAL, -); break;
+        case OP_MULTIPLY_R:     REGISTER_OP (NUMBER_VAL, *); break;
+        case OP_DIVIDE_R:       REGISTER_OP (NUMBER_VAL, /); break;
+        case OP_GREATER_R:      REGISTER_OP (BOOL_VAL,   >); break;
+        case OP_LESS_R:         REGISTER_OP (BOOL_VAL,   <); break;
 
-        case OP_SET_UPVALUE:{
-                uint8_t slot = READ_BYTE ();
+            // *INDENT-ON*
 
-                *frame->closure->upvalues[slot]->location = pop ();
-                break;
-            }
+        case OP_ADD_R:{
+                uint8_t mode = READ_BYTE ();
+                Value a = REGISTER_OPERAND (mode, REG_A_CONSTANT);
+                Value b = REGISTER_OPERAND (mode, REG_B_CONSTANT);
 
-#define BINARY_OP(valueType, op)                                        \
-            do {                                                        \
-                if (!IS_NUMBER(peek(0)) || (!IS_NUMBER(peek(1)))) {     \
-                    runtimeError("Operands must be numbers.");          \
-                    return INTERPRET_RUNTIME_ERROR;                     \
-                }                                                       \
-                Value b = pop();                                        \
-                Value a = pop();                                        \
-                push(valueType(AS_NUMBER(a) op AS_NUMBER(b)));          \
-            } while (false)
-
-        case OP_ADD:{
-                if (IS_STRING (peek (0)) && IS_STRING (peek (1))) {
+                if (IS_NUMBER (a) && IS_NUMBER (b)) {
+                    REGISTER_RESULT (mode, NUMBER_VAL (AS_NUMBER (a) + AS_NUMBER (b)));
+                } else if (IS_STRING (a) && IS_STRING (b)) {
+                    push (a);
+                    push (b);
                     concatenate ();
-                } else if (IS_NUMBER (peek (0)) && IS_NUMBER (peek (1))) {
-                    double b = AS_NUMBER (pop ());
-                    double a = AS_NUMBER (pop ());
-
-                    push (NUMBER_VAL (a + b));
+                    REGISTER_RESULT (mode, pop ());
                 } else {
                     runtimeError ("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
 
-            // *INDENT-OFF*
-
-        case OP_SUBTRACT: BINARY_OP (NUMBER_VAL, -); break;
-        case OP_MULTIPLY: BINARY_OP (NUMBER_VAL, *); break;
-        case OP_DIVIDE:   BINARY_OP (NUMBER_VAL, /); break;
-
-        case OP_GREATER:  BINARY_OP (BOOL_VAL,   >); break;
-        case OP_LESS:     BINARY_OP (BOOL_VAL,   <); break;
+        case OP_EQUAL_R:{
+                uint8_t mode = READ_BYTE ();
+                Value a = REGISTER_OPERAND (mode, REG_A_CONSTANT);
+                Value b = REGISTER_OPERAND (mode, REG_B_CONSTANT);
 
-            // *INDENT-ON*
+                REGISTER_RESULT (mode, BOOL_VAL (valuesEqual (a, b)));
+                break;
+            }
 
-#undef  BINARY_OP
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:{
+                ObjString *name = instruction == OP_GET_PROPERTY ? READ_STRING () : READ_STRING_LONG ();
 
-        case OP_GET_PROPERTY:{
                 if (!IS_INSTANCE (peek (0))) {
                     runtimeError ("Only instances have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ObjInstance *instance = AS_INSTANCE (peek (0));
-                ObjString *name = READ_STRING ();
 
                 Value value;
 
@@ -705,14 +1332,17 @@ run ()
                 break;
             }
 
-        case OP_SET_PROPERTY:{
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:{
+                ObjString *name = instruction == OP_SET_PROPERTY ? READ_STRING () : READ_STRING_LONG ();
+
                 if (!IS_INSTANCE (peek (1))) {
                     runtimeError ("Only instances can have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ObjInstance *instance = AS_INSTANCE (peek (1));
 
-                tableSet (&instance->fields, READ_STRING (), peek (0));
+                tableSet (&instance->fields, name, peek (0));
                 Value value = pop ();
 
                 pop ();
@@ -720,8 +1350,9 @@ run ()
                 break;
             }
 
-        case OP_GET_SUPER:{
-                ObjString *name = READ_STRING ();
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:{
+                ObjString *name = instruction == OP_GET_SUPER ? READ_STRING () : READ_STRING_LONG ();
                 ObjClass *superclass = AS_CLASS (pop ());
 
                 if (!bindMethod (superclass, name)) {
@@ -730,31 +1361,6 @@ run ()
                 break;
             }
 
-        case OP_EQUAL:{
-                Value b = pop ();
-                Value a = pop ();
-
-                push (BOOL_VAL (valuesEqual (a, b)));
-                break;
-            }
-
-        case OP_NOT:
-            push (BOOL_VAL (isFalsey (pop ())));
-            break;
-
-        case OP_NEGATE:
-            if (!IS_NUMBER (peek (0))) {
-                runtimeError ("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push (NUMBER_VAL (-AS_NUMBER (pop ())));
-            break;
-
-        case OP_PRINT:
-            printValue (pop ());
-            printf ("\n");
-            break;
-
         case OP_JUMP:{
                 uint16_t offset = READ_SHORT ();
 
@@ -770,6 +1376,14 @@ run ()
                 break;
             }
 
+        case OP_JUMP_IF_FALSE_LONG:{
+                int offset = READ_LONG ();
+
+                if (isFalsey (peek (0)))
+                    frame->ip += offset;
+                break;
+            }
+
         case OP_LOOP:{
                 uint16_t offset = READ_SHORT ();
 
@@ -777,18 +1391,58 @@ run ()
                 break;
             }
 
+        case OP_JUMP_LONG:{
+                int offset = READ_LONG ();
+
+                frame->ip += offset;
+                break;
+            }
+
+        case OP_LOOP_LONG:{
+                int offset = READ_LONG ();
+
+                frame->ip -= offset;
+                break;
+            }
+
+
         case OP_CALL:{
                 int argCount = READ_BYTE ();
+                ObjFunction *caller = frame->closure->function;
+                CallSite *site = &caller->chunk.calls[READ_SHORT ()];
+                Value callee = peek (argCount);
+
+                // a hit means this callee already passed the checks
+                // in callValue, so only the room for it is checked.
+                if (IS_OBJ (callee) && AS_OBJ (callee) == site->callee && vm.frameCount < vm.frameCapacity
+                    && vm.sp + site->headroom <= vm.stack + vm.stackCapacity) {
+                    if (site->callee->type == OBJ_NATIVE) {
+                        Value result = ((ObjNative *) site->callee)->function (argCount, vm.sp - argCount);
+
+                        vm.sp -= argCount;
+                        vm.sp[-1] = result;
+                    } else {
+                        pushFrame ((ObjClosure *) site->callee, argCount);
+                        frame = &vm.frames[vm.frameCount - 1];
+                    }
+                    break;
+                }
 
-                if (!callValue (peek (argCount), argCount)) {
+                if (!callValue (callee, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if (IS_CLOSURE (callee) || IS_NATIVE (callee)) {
+                    site->callee = AS_OBJ (callee);
+                    site->headroom = IS_CLOSURE (callee) ? AS_CLOSURE (callee)->function->maxStack + STACK_SCRATCH : STACK_SCRATCH;
+                    rememberCaller (caller);
+                }
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
 
-        case OP_INVOKE:{
-                ObjString *method = READ_STRING ();
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:{
+                ObjString *method = instruction == OP_INVOKE ? READ_STRING () : READ_STRING_LONG ();
                 int argCount = READ_BYTE ();
 
                 if (!invoke (method, argCount)) {
@@ -798,8 +1452,9 @@ run ()
                 break;
             }
 
-        case OP_SUPER_INVOKE:{
-                ObjString *method = READ_STRING ();
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG:{
+                ObjString *method = instruction == OP_SUPER_INVOKE ? READ_STRING () : READ_STRING_LONG ();
                 int argCount = READ_BYTE ();
                 ObjClass *superclass = AS_CLASS (pop ());
 
@@ -810,20 +1465,31 @@ run ()
                 break;
             }
 
-        case OP_CLOSURE:{
-                ObjFunction *function = AS_FUNCTION (READ_CONSTANT ());
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:{
+                ObjFunction *function = AS_FUNCTION (instruction == OP_CLOSURE ? READ_CONSTANT () : READ_CONSTANT_LONG ());
+
+                if (function->upvalueCount == 0) {
+                    push (OBJ_VAL (sharedClosure (function)));
+                    break;
+                }
+
                 ObjClosure *closure = newClosure (function);
 
                 push (OBJ_VAL (closure));
 
                 for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE ();
+                    uint8_t kind = READ_BYTE ();
                     uint8_t index = READ_BYTE ();
 
-                    if (isLocal) {
+                    if (kind == CAPTURE_COPY) {
+                        CLOSURE_COPIES (closure)[i] = frame->slots[index];
+                    } else if (kind == CAPTURE_LOCAL) {
+                        frame->hasOpenUpvalues = true;
                         closure->upvalues[i] = captureUpvalue (frame->slots + index);
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
+                        CLOSURE_COPIES (closure)[i] = CLOSURE_COPIES (frame->closure)[index];
                     }
                 }
 
@@ -838,7 +1504,8 @@ run ()
         case OP_RETURN:
             Value result = pop ();
 
-            closeUpvalues (frame->slots);
+            if (frame->hasOpenUpvalues)
+                closeUpvalues (frame->slots);
 
             vm.frameCount--;
             if (vm.frameCount == 0) {
@@ -859,6 +1526,52 @@ run ()
             push (OBJ_VAL (newClass (READ_STRING ())));
             break;
 
+        case OP_IMPORT:
+        case OP_IMPORT_LONG:{
+                ObjString *written = instruction == OP_IMPORT ? READ_STRING () : READ_STRING_LONG ();
+                Value script;
+
+                // modules are known by canonical path, and by each
+                // spelling already imported, which skips realpath.
+                if (tableGet (&vm.modules, written, &script)) {
+                    push (NIL_VAL);
+                    break;
+                }
+
+                ObjString *path = modulePath (written);
+
+                push (OBJ_VAL (path));  // protect from GC sweep
+                if (tableGet (&vm.modules, path, &script)) {
+                    tableSet (&vm.modules, written, script);
+                    pop ();
+                    push (NIL_VAL);
+                    break;
+                }
+
+                ObjFunction *function = loadModule (path);
+
+                if (NULL == function) {
+                    runtimeError ("Could not import \"%s\".", stringChars (written));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // entered before it runs, so an import cycle ends here
+                push (OBJ_VAL (function));      // protect from GC sweep
+                tableSet (&vm.modules, path, OBJ_VAL (function));
+                tableSet (&vm.modules, written, OBJ_VAL (function));
+
+                ObjClosure *closure = newClosure (function);
+
+                pop ();
+                pop ();
+                push (OBJ_VAL (closure));
+                if (!call (closure, 0)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+
         case OP_INHERIT:{
                 Value superclass = peek (1);
 
@@ -879,12 +1592,109 @@ run ()
             break;
         }
     }
+#undef  SUPER_TRIPLE_CASE
+#undef  SUPER_PAIR_CASE
+#undef  EXEC_OP_ADD_CONSTANT_LOCAL
+#undef  EXEC_OP_PRINT
+#undef  EXEC_OP_NEGATE
+#undef  EXEC_OP_ADD
+#undef  EXEC_OP_EQUAL
+#undef  EXEC_OP_SET_GLOBAL
+#undef  EXEC_OP_DEFINE_GLOBAL
+#undef  EXEC_OP_GET_GLOBAL
+#undef  EXEC_OP_NOT
+#undef  EXEC_OP_NEGATE_NUMBER
+#undef  EXEC_OP_LESS_NUMBER
+#undef  EXEC_OP_GREATER_NUMBER
+#undef  EXEC_OP_DIVIDE_NUMBER
+#undef  EXEC_OP_MULTIPLY_NUMBER
+#undef  EXEC_OP_SUBTRACT_NUMBER
+#undef  EXEC_OP_ADD_NUMBER
+#undef  NUMBER_OP
+#undef  EXEC_OP_LESS
+#undef  EXEC_OP_GREATER
+#undef  EXEC_OP_DIVIDE
+#undef  EXEC_OP_MULTIPLY
+#undef  EXEC_OP_SUBTRACT
+#undef  EXEC_OP_SET_UPVALUE
+#undef  EXEC_OP_GET_UPVALUE
+#undef  EXEC_OP_SET_LOCAL
+#undef  EXEC_OP_GET_LOCAL
+#undef  EXEC_OP_POP
+#undef  EXEC_OP_FALSE
+#undef  EXEC_OP_TRUE
+#undef  EXEC_OP_NIL
+#undef  EXEC_OP_CONSTANT
+#undef  COMPARE_JUMP
+#undef  SET_GLOBAL
+#undef  DEFINE_GLOBAL
+#undef  GET_GLOBAL
+#undef  REGISTER_OP
+#undef  REGISTER_RESULT
+#undef  REGISTER_OPERAND
+#undef  BINARY_OP
+#undef  READ_STRING_LONG
+#undef  READ_CONSTANT_LONG
+#undef  READ_LONG
 #undef  READ_SHORT
 #undef  READ_CONSTANT
 #undef  READ_STRING
 #undef  READ_BYTE
 }
 
+/** Compile a source text, reusing the script from an earlier call.
+ *
+ * The REPL and embedders tend to hand the same text to interpret
+ * again and again. Running a script does not change it, so the
+ * function compiled the first time serves every later call. The
+ * cache is small and drops the entry least recently used. Scripts
+ * are compiled into the collected heap, so once an entry is
+ * dropped, the GC reclaims its script.
+ *
+ * @param source the text to compile
+ * @returns the script, or NULL if the source did not compile
+ */
+static ObjFunction *
+compileCached (const char *source)
+{
+    int length = (int) strlen (source);
+    uint32_t hash = hashString (source, length);
+    CachedScript *oldest = &vm.compileCache[0];
+
+    vm.compileClock++;
+    for (int i = 0; i < COMPILE_CACHE_SIZE; i++) {
+        CachedScript *entry = &vm.compileCache[i];
+
+        if (NULL != entry->source && entry->hash == hash && entry->length == length
+            && !memcmp (entry->source, source, length)) {
+            entry->lastUse = vm.compileClock;
+            vm.compileHits++;
+            return entry->function;
+        }
+        if (entry->lastUse < oldest->lastUse)
+            oldest = entry;
+    }
+
+    vm.compileMisses++;
+    ObjFunction *function = compile (source);
+
+    if (function == NULL)
+        return NULL;
+
+    push (OBJ_VAL (function));          // protect from GC sweep
+    if (NULL != oldest->source)
+        FREE_ARRAY (char, oldest->source, oldest->length + 1);
+    oldest->source = ALLOCATE (char, length + 1);
+    memcpy (oldest->source, source, length + 1);
+    oldest->hash = hash;
+    oldest->length = length;
+    oldest->function = function;
+    oldest->lastUse = vm.compileClock;
+    pop ();
+
+    return function;
+}
+
 /** Interpret source code using the VM.
  *
  * Compile the source code into a chunk of bytecode,
@@ -899,11 +1709,25 @@ interpret (const char *source)
 {
     INVAR (vmInitialized, "refused, VM is not initialized.");
 
-    ObjFunction *function = compile (source);
+    ObjFunction *function = compileCached (source);
 
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction (function);
+}
+
+/** Interpret a compiled script using the VM.
+ *
+ * @param function the script, from compile or loadImage
+ * @returns a code indicating a failure code if a failure occurs
+ * @returns a code indicating success if all went well
+ */
+InterpretResult
+interpretFunction (ObjFunction *function)
+{
+    INVAR (vmInitialized, "refused, VM is not initialized.");
+
     push (OBJ_VAL (function));
 
     ObjClosure *closure = newClosure (function);
@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "compiler.h"
+#include "memory.h"
 
 #include <stdio.h>
 
@@ -11,6 +12,72 @@
 
 extern VM vm;                   // peek at VM state
 
+#ifdef DEBUG_PRINT_CODE
+extern int _DEBUG_PRINT_CODE;   // quiet while running many scripts
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+extern int _DEBUG_TRACE_EXECUTION;      // quiet while running many scripts
+#endif
+
+/** Count the objects in the permanent region.
+ *
+ * @returns the length of vm.permanentObjects
+ */
+static int
+permanentCount ()
+{
+    int count = 0;
+
+    for (Obj *object = vm.permanentObjects; object != NULL; object = object->next)
+        count++;
+    return count;
+}
+
+/** Check that scripts dropped from the compile cache are reclaimed.
+ *
+ * Four times as many distinct scripts as the cache holds are run.
+ * Once the cache has turned over, the heap left after a collection
+ * must not grow from one script to the next, and nothing may go in
+ * the permanent region.
+ */
+static void
+bistCompileCacheMemory ()
+{
+#ifdef DEBUG_PRINT_CODE
+    int printCode = _DEBUG_PRINT_CODE;
+
+    _DEBUG_PRINT_CODE = 0;
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    int traceExecution = _DEBUG_TRACE_EXECUTION;
+
+    _DEBUG_TRACE_EXECUTION = 0;
+#endif
+
+    int permanent = permanentCount ();
+    size_t settled = 0;
+    char source[64];
+
+    for (int i = 0; i < 4 * COMPILE_CACHE_SIZE; i++) {
+        snprintf (source, sizeof source, "{ var s = \"script %d\"; }", 1000 + i);
+        INVAR (INTERPRET_OK == interpret (source), "distinct script failed");
+        if (i < 2 * COMPILE_CACHE_SIZE - 1)
+            continue;
+        collectGarbage ();
+        if (0 == settled)
+            settled = vm.bytesAllocated;
+        INVAR (settled == vm.bytesAllocated, "scripts dropped from the compile cache were not reclaimed");
+    }
+    INVAR (permanent == permanentCount (), "interpret compiled into the permanent region");
+
+#ifdef DEBUG_PRINT_CODE
+    _DEBUG_PRINT_CODE = printCode;
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    _DEBUG_TRACE_EXECUTION = traceExecution;
+#endif
+}
+
 /** Run all BIST cases for Vm.
  */
 void
@@ -55,8 +122,16 @@ bistVM ()
         InterpretResult result = interpret (source);
 
         INVAR (INTERPRET_OK == result, "simple compilation failed");
+
+        unsigned int hits = vm.compileHits;
+
+        result = interpret (source);
+        INVAR (INTERPRET_OK == result, "cached script failed");
+        INVAR (hits + 1 == vm.compileHits, "second interpret did not reuse the script");
     }
 
+    bistCompileCacheMemory ();
+
     freeVM ();
     initVM ();
 